@@ -1,5 +1,7 @@
 #include <cubez/cubez.h>
 #include <cubez/utils.h>
+#include <src/coro.h>
+#include <src/sparse_set.h>
 
 #include <omp.h>
 #include <unordered_map>
@@ -119,17 +121,85 @@ double iterate_unpack_one_component_benchmark(uint64_t count, uint64_t iteration
   return elapsed;
 }
 
+double iterate_batch_one_component_benchmark(uint64_t count, uint64_t iterations) {
+  qbTimer timer;
+  qb_timer_create(&timer, 0);
+  {
+    qbEntityAttr attr;
+    qb_entityattr_create(&attr);
+    PositionComponent p;
+    qb_entityattr_addcomponent(attr, position_component, &p);
+
+    for (uint64_t i = 0; i < count; ++i) {
+      qbEntity entity;
+      p.p.x++;
+      qb_entity_create(&entity, attr);
+    }
+
+    qb_entityattr_destroy(&attr);
+  }
+  {
+    qbSystemAttr attr;
+    qb_systemattr_create(&attr);
+    qb_systemattr_addconst(attr, position_component);
+    qb_systemattr_setbatchfunction(attr,
+      [](const qbEntity*, size_t count, void** data, const size_t* strides, qbFrame*) {
+        uint64_t sum = 0;
+        const uint8_t* p = (const uint8_t*)data[0];
+        for (size_t i = 0; i < count; ++i, p += strides[0]) {
+          sum += (uint64_t)((const PositionComponent*)p)->p.x ^ 0x12983;
+        }
+        *Count() += sum;
+      });
+
+    qbSystem system;
+    qb_system_create(&system, attr);
+    qb_systemattr_destroy(&attr);
+  }
+  qb_loop(0, 0);
+  qb_timer_start(timer);
+  for (uint64_t i = 0; i < iterations; ++i) {
+    qb_loop(0, 0);
+  }
+  qb_timer_stop(timer);
+  std::cout << "Count = " << *Count() << std::endl;
+
+  double elapsed = qb_timer_elapsed(timer);
+  qb_timer_destroy(&timer);
+  return elapsed;
+}
+
+// Number of frames every coroutine in "coroutine_overhead_benchmark" is
+// suspended under. The stack-copying backend copies all of them on every
+// switch. Build the library with -DQB_CORO_STACK_COPY to measure it.
+uint64_t coro_stack_depth = 0;
+bool coro_running = false;
+
+uint64_t coro_recurse(uint64_t depth) {
+  volatile uint64_t frame[8];
+  frame[0] = depth;
+  if (depth == 0) {
+    while (coro_running) {
+      *Count() += 1;
+      qb_coro_yield(qbNone);
+    }
+    return 0;
+  }
+  return coro_recurse(depth - 1) + frame[0];
+}
+
 double coroutine_overhead_benchmark(uint64_t count, uint64_t iterations) {
   qbTimer timer;
   qb_timer_create(&timer, 0);
 
+  std::cout << "Backend = " << coro_backend() << ", depth = "
+            << coro_stack_depth << std::endl;
+
   *Count() = 0;
-  for (auto i = 0; i < count; ++i) {
+  coro_running = true;
+  for (uint64_t i = 0; i < count; ++i) {
     qb_coro_sync([](qbVar) {
-      for (;;) {
-        *Count() += 1;
-        qb_coro_yield(qbNone);
-      }
+      coro_recurse(coro_stack_depth);
       return qbNone;
     }, qbNone);
   }
@@ -141,6 +211,90 @@ double coroutine_overhead_benchmark(uint64_t count, uint64_t iterations) {
   }
   qb_timer_stop(timer);
 
+  // Let the coroutines finish so the next run starts without them.
+  coro_running = false;
+  qb_loop(0, 0);
+
+  std::cout << "Count = " << *Count() << std::endl;
+
+  double elapsed = qb_timer_elapsed(timer);
+  qb_timer_destroy(&timer);
+  return elapsed;
+}
+
+// The sparse set layout before the paged index: one 64-bit slot for every id
+// up to the largest inserted id.
+class FlatSparseSet {
+public:
+  FlatSparseSet() : sparse_(16, -1) {}
+
+  void insert(uint64_t value) {
+    if (value >= sparse_.size()) {
+      sparse_.resize(value + 1, -1);
+    }
+    sparse_[value] = dense_.size();
+    dense_.push_back(value);
+  }
+
+  bool has(uint64_t value) {
+    if (value >= sparse_.size()) {
+      return false;
+    }
+    return sparse_[value] != -1;
+  }
+
+  size_t memory_usage() const {
+    return sparse_.capacity() * sizeof(qbHandle) +
+           dense_.capacity() * sizeof(uint64_t);
+  }
+
+private:
+  std::vector<qbHandle> sparse_;
+  std::vector<uint64_t> dense_;
+};
+
+// Simulates many components that each hold runs of entities that were created
+// together, spread over a large id range. Prints the index footprint and
+// returns the time to look up "count" random (entity, component) pairs.
+template<class Set_>
+double sparse_index_benchmark(uint64_t count, uint64_t iterations) {
+  const uint64_t kComponents = 128;
+  const uint64_t kRunLength = 64;
+  const uint64_t kMaxId = count * 4;
+
+  uint64_t seed = 0x12983;
+  auto next = [&seed]() {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return seed >> 33;
+  };
+
+  std::vector<Set_> sets(kComponents);
+  for (uint64_t i = 0; i < count / kRunLength; ++i) {
+    Set_& set = sets[next() % kComponents];
+    uint64_t start = next() % (kMaxId - kRunLength);
+    for (uint64_t id = start; id < start + kRunLength; ++id) {
+      if (!set.has(id)) {
+        set.insert(id);
+      }
+    }
+  }
+
+  size_t memory = 0;
+  for (auto& set : sets) {
+    memory += set.memory_usage();
+  }
+  std::cout << "Index memory = " << memory / (1024 * 1024) << "MB\n";
+
+  qbTimer timer;
+  qb_timer_create(&timer, 0);
+  qb_timer_start(timer);
+  *Count() = 0;
+  for (uint64_t i = 0; i < iterations; ++i) {
+    for (uint64_t j = 0; j < count; ++j) {
+      *Count() += sets[next() % kComponents].has(next() % kMaxId);
+    }
+  }
+  qb_timer_stop(timer);
   std::cout << "Count = " << *Count() << std::endl;
 
   double elapsed = qb_timer_elapsed(timer);
@@ -214,8 +368,17 @@ int main() {
                create_entities_benchmark, count, iterations, 1);*/
   do_benchmark("Unpack one component benchmark",
     iterate_unpack_one_component_benchmark, count, iterations, test_iterations);
-  /*do_benchmark("coroutine_overhead_benchmark",
-               coroutine_overhead_benchmark, 1, 1000000, 1);*/
+  /*do_benchmark("Batch one component benchmark",
+               iterate_batch_one_component_benchmark, count, iterations, test_iterations);*/
+  /*do_benchmark("Flat sparse index benchmark",
+               sparse_index_benchmark<FlatSparseSet>, count, 10, 1);
+  do_benchmark("Paged sparse index benchmark",
+               sparse_index_benchmark<SparseSet>, count, 10, 1);*/
+  /*for (uint64_t depth : { 0, 16, 64, 256, 1024 }) {
+    coro_stack_depth = depth;
+    do_benchmark("coroutine_overhead_benchmark",
+                 coroutine_overhead_benchmark, 1, 1000000, 1);
+  }*/
   qb_stop();
   while (1);
 }
@@ -281,4 +444,15 @@ Total elapsed: 66839651ns
 Elapsed per iteration: 66839651ns
 Total elapsed: 0.0668397s
 Elapsed per iteration: 0.0668397s
+
+Sparse index, 1M ids over 128 components (10M lookups)
+Flat
+Index memory = 5872MB
+Total elapsed: 20314951ns
+Elapsed per iteration: 20314951ns
+
+Paged
+Index memory = 79MB
+Total elapsed: 5127143ns
+Elapsed per iteration: 5127143ns
 */
\ No newline at end of file
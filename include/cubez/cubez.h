@@ -25,6 +25,8 @@
 
 #include "common.h"
 
+#include <stddef.h>
+
 typedef enum {
   QB_TAG_VOID,
   QB_TAG_UINT,
@@ -174,6 +176,7 @@ typedef struct qbScene_* qbScene;
 typedef struct qbCoro_* qbCoro;
 typedef struct qbAsync_* qbAsync;
 typedef struct qbAlarm_* qbAlarm;
+typedef struct qbJobGroup_* qbJobGroup;
 
 ///////////////////////////////////////////////////////////
 ///////////////////////  Components  //////////////////////
@@ -193,6 +196,19 @@ typedef enum {
   QB_COMPONENT_TYPE_COMPOSITE,
 } qbComponentType;
 
+// ======== qbComponentStorage ========
+typedef enum {
+  // Each component is stored in its own sparse array indexed by entity id.
+  QB_COMPONENT_STORAGE_SPARSE = 0,
+
+  // Entities with the same set of archetype-stored components are packed
+  // together into a table with one dense column per component. Systems that
+  // only select archetype-stored components iterate the columns directly
+  // without any per-entity lookups. Adding or removing a component moves the
+  // entity to a different table.
+  QB_COMPONENT_STORAGE_ARCHETYPE,
+} qbComponentStorage;
+
 // ======== qbComponentAttr ========
 // Creates a new qbComponentAttr object for qbComponent creation.
 QB_API qbResult      qb_componentattr_create(qbComponentAttr* attr);
@@ -211,6 +227,26 @@ QB_API qbResult      qb_componentattr_settype(qbComponentAttr attr,
 // Sets the component to be shared across programs with a reader/writer lock.
 QB_API qbResult      qb_componentattr_setshared(qbComponentAttr attr);
 
+// Shares the component across programs without blocking readers. Systems that
+// read the component with "addconst" see a copy of the instances as they were
+// at the start of the frame and never wait on systems writing them. Instances
+// created during the frame are not visible to readers until the next frame.
+// Only the blocks of instances written during a frame are copied, which
+// includes every instance returned by qb_instance_find or
+// qb_instance_getcomponent. Implies "setshared" and sparse storage.
+QB_API qbResult      qb_componentattr_setbuffered(qbComponentAttr attr);
+
+// Sets how the component instances are laid out in memory. Default is
+// QB_COMPONENT_STORAGE_SPARSE.
+QB_API qbResult      qb_componentattr_setstorage(qbComponentAttr attr,
+                                                 qbComponentStorage storage);
+
+// Makes the component a tag: a marker without any instance data. Tags only
+// store one bit per entity and are evaluated as filters when joined with other
+// components. Instances of a tag have a null data pointer. Overrides the data
+// size and the storage. Tags can not be used in QB_JOIN_CROSS.
+QB_API qbResult      qb_componentattr_settag(qbComponentAttr attr);
+
 
 // Unimplemented.
 QB_API qbResult      qb_componentattr_onserialize(qbComponentAttr attr,
@@ -302,16 +338,33 @@ QB_API qbResult      qb_entityattr_addcomponent(qbEntityAttr attr,
 // ======== qbEntity ========
 // A qbEntity is an identifier to a game object. qbComponents can be added to
 // the entity.
-// Creates a new qbEntity with the specified attributes.
+// Creates a new qbEntity with the specified attributes. When called while a
+// system iterates its instances, or from any job worker, only the handle is
+// created right away. Its instances are created at the start of the next
+// frame.
 QB_API qbResult      qb_entity_create(qbEntity* entity,
                                    qbEntityAttr attr);
 
 // Destroys the specified entity.
 QB_API qbResult      qb_entity_destroy(qbEntity entity);
 
+// Creates "count" entities with the same attributes and writes their ids to
+// "entities". Instance data is bulk-copied into each component and each
+// component's OnCreate is sent once for the whole batch.
+QB_API qbResult      qb_entity_createbatch(size_t count, qbEntityAttr attr,
+                                           qbEntity* entities);
+
+// Destroys all given entities after the current frame has completed. Each
+// component's OnDestroy is sent once for the whole batch.
+QB_API qbResult      qb_entity_destroybatch(const qbEntity* entities,
+                                            size_t count);
+
 // Adds a component with instance data to copied to the entity.
 // This allocates a new instance copies the instance_data to the newly
 // allocated memory. This calls the instance's OnCreate function immediately.
+// When called while a system iterates its instances, or from any job worker,
+// the data is copied and the instance is created at the start of the next
+// frame instead.
 QB_API qbResult      qb_entity_addcomponent(qbEntity entity,
                                          qbComponent component,
                                          void* instance_data);
@@ -332,19 +385,39 @@ QB_API qbResult      qb_entity_getinstance(qbEntity entity,
 QB_API bool          qb_entity_hascomponent(qbEntity entity,
                                          qbComponent component);
 
+// Returns true if the specified entity contains an instance for every given
+// component.
+QB_API bool          qb_entity_hasall(qbEntity entity,
+                                      const qbComponent* components,
+                                      size_t count);
+
+// Returns true if the specified entity contains an instance for at least one
+// of the given components.
+QB_API bool          qb_entity_hasany(qbEntity entity,
+                                      const qbComponent* components,
+                                      size_t count);
+
 ///////////////////////////////////////////////////////////
 ////////////////////////  Systems  ////////////////////////
 ///////////////////////////////////////////////////////////
 
 // ======== qbFrame ========
 // a qbFrame is a struct that is filled in during execution time. If the system
-// was triggered by an event, the "event" member will point to its message. If
-// the system has user state, defined with "setuserstate" this will be filled
-// in.
+// was triggered by an event, the "event" member will point to its message and
+// "events" to the "event_count" messages it was run with, laid out one after
+// the other. Unless the system was created with "batchevents", it is run with
+// a single message. If the system has user state, defined with "setuserstate"
+// this will be filled in. "worker" is the index of the thread running the
+// transform and "scratch" points to that thread's memory set with
+// "setscratch". Both are only meaningful for systems run with "setparallel".
 typedef struct {
   qbSystem system;
   void* event;
+  void* events;
+  size_t event_count;
   void* state;
+  size_t worker;
+  void* scratch;
 } qbFrame;
 
 // ======== qbBarrier ========
@@ -374,10 +447,33 @@ QB_API qbResult      qb_systemattr_addconst(qbSystemAttr attr,
 QB_API qbResult      qb_systemattr_addmutable(qbSystemAttr attr,
                                               qbComponent component);
 
+// Only visits entities that own the component. The component is not given to
+// the transform.
+QB_API qbResult      qb_systemattr_addwith(qbSystemAttr attr,
+                                           qbComponent component);
+
+// Only visits entities that do not own the component.
+QB_API qbResult      qb_systemattr_addwithout(qbSystemAttr attr,
+                                              qbComponent component);
+
+// Also visits entities that do not own the component. Their instance of it is
+// given to the transform with a null data pointer. The component must be one
+// of the system's components. At least one of the system's components has to
+// be required, so the first is if all of them are optional.
+QB_API qbResult      qb_systemattr_addoptional(qbSystemAttr attr,
+                                               qbComponent component);
+
 // ======== qbComponentJoin ========
 typedef enum {
+  // Visits entities that own all components.
   QB_JOIN_INNER = 0,
+
+  // Visits entities that own the first component. All other components are
+  // optional.
   QB_JOIN_LEFT,
+
+  // Visits every combination of instances. Ignores "addwith", "addwithout"
+  // and "addoptional".
   QB_JOIN_CROSS,
 } qbComponentJoin;
 
@@ -397,6 +493,20 @@ typedef void(*qbTransformFn)(qbInstance* instances, qbFrame* frame);
 QB_API qbResult      qb_systemattr_setfunction(qbSystemAttr attr,
                                                qbTransformFn transform);
 
+// Sets a function that is run once per block of instances instead of once per
+// instance. "entities" holds "count" entities. For the i-th component added
+// with "addconst" and "addmutable", "data[i]" points to the first entity's
+// instance and "strides[i]" is the number of bytes between instances.
+// Components stored in the same archetype table are given as one block per
+// table, a single sparse component is given as one block per allocation page,
+// and all other joins are given one entity at a time. The function must not
+// create or destroy instances of the selected components. Takes precedence
+// over "qb_systemattr_setfunction".
+typedef void(*qbBatchFn)(const qbEntity* entities, size_t count, void** data,
+                         const size_t* strides, qbFrame* frame);
+QB_API qbResult      qb_systemattr_setbatchfunction(qbSystemAttr attr,
+                                                    qbBatchFn batch);
+
 // Sets the callback to run after the system finishes executing its transform
 // over all of its components.
 typedef void(*qbCallbackFn)(qbFrame* frame);
@@ -431,10 +541,62 @@ QB_API qbResult      qb_systemattr_setpriority(qbSystemAttr attr,
 QB_API qbResult      qb_systemattr_addbarrier(qbSystemAttr attr,
                                            qbBarrier barrier);
 
+// Runs the system before the given system. Both systems must be in the same
+// program and triggered by the game loop. Takes precedence over priorities.
+QB_API qbResult      qb_systemattr_runbefore(qbSystemAttr attr,
+                                          qbSystem system);
+
+// Runs the system after the given system. Both systems must be in the same
+// program and triggered by the game loop. Takes precedence over priorities.
+QB_API qbResult      qb_systemattr_runafter(qbSystemAttr attr,
+                                         qbSystem system);
+
+// Allows the system to run on a worker thread at the same time as other
+// concurrent systems in its program. Two systems are only run at the same time
+// if neither writes a component that the other reads or writes. The system
+// must only access the components it added with "addconst" and "addmutable".
+// Entities and instances it creates or destroys are applied at the start of
+// the next frame. All other systems are run on the program's thread.
+QB_API qbResult      qb_systemattr_setconcurrent(qbSystemAttr attr);
+
+// Only visits instances whose component changed since the system last ran.
+// The component must be one of the system's components. If called multiple
+// times, an entity is visited if any of the components changed. The system
+// is skipped entirely, including its callback, if none of them changed.
+// Changes are tracked per block of instances, so unchanged instances that
+// share a block with a changed one are visited as well. An instance changes
+// when it is created, when it is fetched with "qb_instance_getmutable", or
+// when its block is visited by a system with mutable access to it. Writes
+// through pointers from "qb_instance_find" are not tracked unless the
+// component is buffered, see "qb_componentattr_setbuffered".
+QB_API qbResult      qb_systemattr_changedsince(qbSystemAttr attr,
+                                             qbComponent component);
+
 // Sets a pointer to be passed in with every execution of the system.
 QB_API qbResult      qb_systemattr_setuserstate(qbSystemAttr attr,
                                              void* state);
 
+// Splits the instances into chunks of "grain_size" and runs the chunks on
+// multiple threads. Each entity is visited by exactly one thread. Entities
+// and instances created or destroyed by the transform are applied at the
+// start of the next frame. Cross joins are always run on a single thread. A
+// "grain_size" of 0 disables parallelism.
+QB_API qbResult      qb_systemattr_setparallel(qbSystemAttr attr,
+                                            size_t grain_size);
+
+// Gives each thread running the system "size" bytes of scratch memory,
+// reachable through "frame->scratch". The memory is zeroed before every
+// execution and can be combined in the callback with "qb_system_scratch".
+QB_API qbResult      qb_systemattr_setscratch(qbSystemAttr attr,
+                                           size_t size);
+
+// Runs the event-triggered system once per flush for each event it is
+// subscribed to, with all of the event's queued messages in "frame->events",
+// instead of once per message. If the event has an entity field, each target
+// is visited with "frame->event" pointing at its own message. Messages sent
+// with "qb_event_sendsync" are still delivered one at a time.
+QB_API qbResult      qb_systemattr_batchevents(qbSystemAttr attr);
+
 // ======== qbSystem ========
 // A qbSystem is the atomic unit of synchronous execution. Systems are run when
 // either: qb_loop() is called, a program is detached and runs continuously, or
@@ -454,6 +616,13 @@ QB_API qbResult      qb_system_enable(qbSystem system);
 // Disables the specified system and stop all execution.
 QB_API qbResult      qb_system_disable(qbSystem system);
 
+// Returns the number of threads that can run the given system. Valid indices
+// for "qb_system_scratch" are less than this.
+QB_API size_t        qb_system_workercount(qbSystem system);
+
+// Returns the scratch memory of the given thread from the last execution.
+QB_API void*         qb_system_scratch(qbSystem system, size_t worker);
+
 // Runs the given system. Not thread-safe when run concurrently with qb_loop().
 // Unimplemented.
 QB_API qbResult      qb_system_run(qbSystem system);
@@ -479,9 +648,18 @@ QB_API qbResult      qb_eventattr_setmessagesize(qbEventAttr attr, size_t size);
 #define qb_eventattr_setmessagetype(attr, type) \
     qb_eventattr_setmessagesize(attr, sizeof(type))
 
+// Marks the qbEntity at "offset" bytes into each message as the message's
+// target. Subscribed systems that select components then only run on the
+// target instead of every entity they match. Systems without components and
+// cross joins are run as usual.
+QB_API qbResult      qb_eventattr_setentityfield(qbEventAttr attr, size_t offset);
+#define qb_eventattr_setentitymember(attr, type, member) \
+    qb_eventattr_setentityfield(attr, offsetof(type, member))
+
 // ======== qbEvent ========
 // A qbEvent is a way of passing messages between systems in a single program.
-// Sending messages is not thread-safe.
+// "qb_event_send", "qb_event_alloc" and "qb_event_commit" are thread-safe and
+// lock-free, all other functions are not.
 // Creates a new qbEvent with the specified attributes.
 QB_API qbResult      qb_event_create(qbEvent* event,
                                      qbEventAttr attr);
@@ -503,10 +681,23 @@ QB_API qbResult      qb_event_unsubscribe(qbEvent event,
                                           qbSystem system);
 
 // Sends a messages on the event. This triggers all subscribed systems before
-// the next frame is run.
+// the next frame is run. Messages sent from the same thread are delivered in
+// the order they were sent. Messages sent by handlers are delivered in the
+// same flush, unless they keep sending for more than a few rounds. The rest
+// is then delivered by the next flush.
 QB_API qbResult      qb_event_send(qbEvent event,
                                    void* message);
 
+// Returns memory for a message to be written in place and sent with
+// "qb_event_commit", avoiding the copy made by "qb_event_send". Every message
+// must be committed. Its memory is reused after it is handled.
+QB_API void*         qb_event_alloc(qbEvent event);
+
+// Sends a message returned by "qb_event_alloc". The message must not be
+// written to afterwards.
+QB_API qbResult      qb_event_commit(qbEvent event,
+                                     void* message);
+
 // Sends a messages on the event. This immediately triggers all subscribed
 // systems.
 QB_API qbResult      qb_event_sendsync(qbEvent event,
@@ -598,22 +789,69 @@ QB_API qbResult      qb_scene_ondeactivate(qbScene scene,
                                                      void* values[]));
 
 
+///////////////////////////////////////////////////////////
+//////////////////////////  Jobs  /////////////////////////
+///////////////////////////////////////////////////////////
+
+// ======== qbJob ========
+// Jobs are run on a fixed number of worker threads shared with the engine.
+// Programs and asynchronous coroutines run on the same workers.
+typedef void(*qbJobFn)(qbVar arg);
+
+// Runs "fn(arg)" on a worker thread. If "group" is not null, the job is added
+// to the group. Thread-safe.
+QB_API qbResult      qb_job_submit(qbJobFn fn, qbVar arg, qbJobGroup group);
+
+// Runs "fn(arg)" after all jobs in "after" have finished. If "group" is not
+// null, the job is added to the group immediately. Thread-safe.
+QB_API qbResult      qb_job_then(qbJobGroup after, qbJobFn fn, qbVar arg,
+                                 qbJobGroup group);
+
+// Calls "fn(begin, end, arg)" with ranges of at most "grain_size" that cover
+// [0, count). Ranges are run on the worker threads and the calling thread.
+// Returns once all ranges have finished.
+typedef void(*qbJobRangeFn)(size_t begin, size_t end, qbVar arg);
+QB_API qbResult      qb_job_parallelfor(size_t count, size_t grain_size,
+                                        qbJobRangeFn fn, qbVar arg);
+
+// Returns the number of worker threads.
+QB_API size_t        qb_job_workercount();
+
+// ======== qbJobGroup ========
+// A job group counts its unfinished jobs.
+QB_API qbResult      qb_jobgroup_create(qbJobGroup* group);
+
+// The group must not have any unfinished jobs.
+QB_API qbResult      qb_jobgroup_destroy(qbJobGroup* group);
+
+// Runs other jobs on the calling thread until all jobs in the group have
+// finished.
+QB_API qbResult      qb_jobgroup_wait(qbJobGroup group);
+
+// Returns true if all jobs in the group have finished.
+QB_API bool          qb_jobgroup_done(qbJobGroup group);
+
 ///////////////////////////////////////////////////////////
 ///////////////////////  Coroutines  //////////////////////
 ///////////////////////////////////////////////////////////
 
 // Creates and returns a new coroutine only valid on the current thread.
-// Cannot be passed between threads.
+// Cannot be passed between threads. Returns null if no stack could be
+// allocated for it.
 QB_API qbCoro      qb_coro_create(qbVar(*entry)(qbVar var));
 
 // Copies a given coroutine only valid on the current thread. Does not copy the
 // coroutine state. Currently, only copies the entry function.
-// Cannot be passed between threads.
+// Cannot be passed between threads. Returns null if no stack could be
+// allocated for it.
 QB_API qbCoro      qb_coro_copy(qbCoro coro);
 
 // A coroutine is safe to destroy only it is finished running. This can be
 // queried with qb_coro_peek or qb_coro_done. A coroutine can be waited upon by
-// using qb_coro_await.
+// using qb_coro_await. Coroutines created with qb_coro_sync may also be
+// destroyed on the main thread while they have not started, are waiting for
+// their turn or are in qb_coro_wait or qb_coro_waitframes. They are never
+// resumed again.
 QB_API qbResult    qb_coro_destroy(qbCoro* coro);
 
 // Immediately runs the given coroutine on the same thread as the caller.
@@ -624,13 +862,61 @@ QB_API qbVar       qb_coro_call(qbCoro coro, qbVar var);
 // Creates a coroutine and schedules the given function to be run on the main
 // thread. All coroutines are then run serially after event dispatch and
 // systems are run. All coroutines are run as cooperative threads. In order to
-// run the next coroutine, the given entry must call qb_coro_yield().
+// run the next coroutine, the given entry must call qb_coro_yield(). If a
+// budget is set with qb_coro_setbudget, coroutines that did not fit into the
+// frame are run first on the next frame. If no stack can be allocated for the
+// coroutine, it is done right away with qbNone as its result.
 // WARNING: A coroutine has its own stack, do not pass in pointers to stack
 // variables. They will be invalid pointers.
 QB_API qbCoro      qb_coro_sync(qbVar(*entry)(qbVar), qbVar var);
 
+// ======== qbCoroPriority ========
+typedef enum {
+  // Always run every frame, not counted against the budget.
+  QB_CORO_PRIORITY_HIGH = 0,
+
+  // Run every frame while the budget lasts. The default.
+  QB_CORO_PRIORITY_NORMAL,
+
+  // Run with what is left of the budget after all normal coroutines ran. At
+  // least one is run every frame.
+  QB_CORO_PRIORITY_LOW,
+} qbCoroPriority;
+
+// Sets the priority of a coroutine created with qb_coro_sync. Takes effect
+// after the coroutine is next resumed. Must be called on the main thread.
+QB_API qbResult    qb_coro_setpriority(qbCoro coro, qbCoroPriority priority);
+
+// Sets the time in seconds spent each frame resuming coroutines created with
+// qb_coro_sync that are not QB_CORO_PRIORITY_HIGH. At least one coroutine of
+// each priority is resumed every frame, even if that goes over the budget. A
+// budget of 0 is unlimited, which is the default.
+// Thread-safe.
+QB_API qbResult    qb_coro_setbudget(double seconds);
+
+// ======== qbCoroStats ========
+typedef struct {
+  // Coroutines resumed on the last frame.
+  uint32_t resumed;
+
+  // Ready coroutines put off to the next frame by the budget on the last
+  // frame.
+  uint32_t deferred;
+
+  // Seconds spent resuming coroutines on the last frame.
+  double elapsed;
+
+  // Frames that went over the budget so far.
+  uint64_t overruns;
+} qbCoroStats_, *qbCoroStats;
+
+// Writes the stats of the coroutines created with qb_coro_sync to "stats".
+// Must be called on the main thread.
+QB_API qbResult    qb_coro_stats(qbCoroStats stats);
+
 // Creates a coroutine and schedules the given function to be run on a
-// background thread. Thread-safe.
+// background thread. If no stack can be allocated for the coroutine, it is done
+// right away with qbNone as its result. Thread-safe.
 // WARNING: A coroutine has its own stack, do not pass in pointers to stack
 // variables. They will be invalid pointers.
 QB_API qbCoro      qb_coro_async(qbVar(*entry)(qbVar), qbVar var);
@@ -640,15 +926,29 @@ QB_API qbCoro      qb_coro_async(qbVar(*entry)(qbVar), qbVar var);
 // variables. They will be invalid pointers.
 QB_API qbVar       qb_coro_yield(qbVar var);
 
-// Yields "qbFuture" until at least the given seconds have elapsed.
+// Yields "qbFuture" until at least the given seconds have elapsed. Coroutines
+// created with qb_coro_sync are not resumed at all until they are due.
 QB_API void        qb_coro_wait(double seconds);
 
-// Yields "qbFuture" until the given frames have elapsed.
+// Yields "qbFuture" until the given frames have elapsed. Coroutines created
+// with qb_coro_sync are not resumed at all until they are due.
 QB_API void        qb_coro_waitframes(uint32_t frames);
 
-// Yields "qbFuture" until coro is done running. 
+// Yields "qbFuture" until coro is done running and returns its result.
+// Coroutines created with qb_coro_sync or qb_coro_async are not resumed until
+// coro is done.
 QB_API qbVar       qb_coro_await(qbCoro coro);
 
+// Same as qb_coro_await for all given coroutines. Writes their results to
+// "results" if it is not null.
+QB_API void        qb_coro_awaitall(qbCoro* coros, size_t count,
+                                    qbVar* results);
+
+// Same as qb_coro_await until one of the given coroutines is done. Returns its
+// result and writes its index to "index" if it is not null.
+QB_API qbVar       qb_coro_awaitany(qbCoro* coros, size_t count,
+                                    size_t* index);
+
 // Peeks at the return value of the scheduled coro. Returns "qbFuture" if the
 // scheduled coro is running.
 QB_API qbVar
@@ -0,0 +1,133 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "archetype.h"
+
+Archetype::Archetype(std::vector<qbComponent> components,
+                     std::vector<size_t> sizes)
+    : components_(std::move(components)), sizes_(std::move(sizes)) {
+  columns_.reserve(components_.size());
+  for (size_t size : sizes_) {
+    columns_.emplace_back(size);
+  }
+  column_stamps_.resize(components_.size());
+}
+
+Archetype::~Archetype() {}
+
+size_t Archetype::Insert(qbEntity entity) {
+  size_t row = entities_.size();
+  entities_.push_back(entity);
+  for (size_t i = 0; i < columns_.size(); ++i) {
+    columns_[i].push_back((const void*)nullptr);
+    memset(At(i, row), 0, sizes_[i]);
+  }
+  TouchRows(row, 1);
+  return row;
+}
+
+size_t Archetype::Insert(const qbEntity* entities, size_t count) {
+  size_t row = entities_.size();
+  entities_.insert(entities_.end(), entities, entities + count);
+  for (size_t i = 0; i < columns_.size(); ++i) {
+    columns_[i].reserve(row + count + 1);
+    for (size_t j = 0; j < count; ++j) {
+      columns_[i].push_back((const void*)nullptr);
+    }
+    memset(At(i, row), 0, count * sizes_[i]);
+  }
+  TouchRows(row, count);
+  return row;
+}
+
+void Archetype::Fill(size_t column, size_t row, size_t count,
+                     const void* value) {
+  if (count == 0) {
+    return;
+  }
+
+  // Double the filled range with every copy.
+  size_t size = sizes_[column];
+  uint8_t* dst = (uint8_t*)At(column, row);
+  memcpy(dst, value, size);
+  size_t filled = 1;
+  while (filled < count) {
+    size_t n = std::min(filled, count - filled);
+    memcpy(dst + filled * size, dst, n * size);
+    filled += n;
+  }
+
+  for (size_t block = row / kBlockRows; block * kBlockRows < row + count; ++block) {
+    BlockStamp(column, block).Touch();
+  }
+  column_stamps_[column].Touch();
+}
+
+qbEntity Archetype::Erase(size_t row) {
+  size_t last = entities_.size() - 1;
+  qbEntity moved = -1;
+  if (row != last) {
+    moved = entities_[last];
+    entities_[row] = moved;
+    for (size_t i = 0; i < columns_.size(); ++i) {
+      memcpy(At(i, row), At(i, last), sizes_[i]);
+    }
+    TouchRows(row, 1);
+  }
+  entities_.pop_back();
+  for (auto& column : columns_) {
+    column.pop_back();
+  }
+  return moved;
+}
+
+void Archetype::TouchRows(size_t row, size_t count) {
+  if (count == 0) {
+    return;
+  }
+  size_t blocks = Blocks() * columns_.size();
+  if (stamps_.size() < blocks) {
+    stamps_.resize(blocks);
+  }
+  size_t end = (row + count - 1) / kBlockRows;
+  for (size_t block = row / kBlockRows; block <= end; ++block) {
+    for (size_t i = 0; i < columns_.size(); ++i) {
+      BlockStamp(i, block).Touch();
+    }
+  }
+  for (auto& stamp : column_stamps_) {
+    stamp.Touch();
+  }
+}
+
+int64_t Archetype::ColumnOf(qbComponent component) const {
+  auto it = std::lower_bound(components_.begin(), components_.end(), component);
+  if (it == components_.end() || *it != component) {
+    return -1;
+  }
+  return it - components_.begin();
+}
+
+bool Archetype::Contains(qbComponent component) const {
+  return ColumnOf(component) >= 0;
+}
+
+bool Archetype::ContainsAll(const std::vector<qbComponent>& components) const {
+  return std::includes(components_.begin(), components_.end(),
+                       components.begin(), components.end());
+}
@@ -0,0 +1,134 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+#ifndef ARCHETYPE__H
+#define ARCHETYPE__H
+
+#include <cubez/cubez.h>
+#include "byte_vector.h"
+#include "change_stamp.h"
+
+#include <unordered_map>
+#include <vector>
+
+// A table of all entities that have exactly the same set of archetype-stored
+// components. Each component is stored in its own densely packed column, rows
+// are entities. Removing a row moves the last row into its place. Changes are
+// tracked per column in blocks of kBlockRows rows.
+// Not thread-safe.
+class Archetype {
+ public:
+  static const size_t kBlockRows = 256;
+
+  // The components must be sorted by id and have matching element sizes.
+  Archetype(std::vector<qbComponent> components, std::vector<size_t> sizes);
+  ~Archetype();
+
+  // Appends a zero-initialized row for the entity. Returns the row index.
+  size_t Insert(qbEntity entity);
+
+  // Appends zero-initialized rows for all entities. Returns the index of the
+  // first row.
+  size_t Insert(const qbEntity* entities, size_t count);
+
+  // Copies the value into "count" consecutive rows of the column.
+  void Fill(size_t column, size_t row, size_t count, const void* value);
+
+  // Removes the row. Returns the entity that was moved into the removed row or
+  // -1 if the removed row was the last row.
+  qbEntity Erase(size_t row);
+
+  // Returns the column index for the given component or -1 if the archetype
+  // does not contain the component.
+  int64_t ColumnOf(qbComponent component) const;
+
+  bool Contains(qbComponent component) const;
+
+  // Returns true if the archetype contains all given components. The given
+  // components must be sorted.
+  bool ContainsAll(const std::vector<qbComponent>& components) const;
+
+  void* At(size_t column, size_t row) {
+    return (uint8_t*)columns_[column].data() + row * sizes_[column];
+  }
+
+  uint8_t* Column(size_t column) {
+    return columns_[column].data();
+  }
+
+  size_t Stride(size_t column) const {
+    return sizes_[column];
+  }
+
+  const qbEntity* Entities() const {
+    return entities_.data();
+  }
+
+  size_t Size() const {
+    return entities_.size();
+  }
+
+  const std::vector<qbComponent>& Components() const {
+    return components_;
+  }
+
+  // Number of change tracking blocks in each column.
+  size_t Blocks() const {
+    return (entities_.size() + kBlockRows - 1) / kBlockRows;
+  }
+
+  ChangeStamp& BlockStamp(size_t column, size_t block) {
+    return stamps_[block * columns_.size() + column];
+  }
+
+  const ChangeStamp& ColumnStamp(size_t column) const {
+    return column_stamps_[column];
+  }
+
+  // Marks the block holding the row as changed.
+  void Touch(size_t column, size_t row) {
+    BlockStamp(column, row / kBlockRows).Touch();
+    column_stamps_[column].Touch();
+  }
+
+  // Cached transitions to the archetype with one more or one less component.
+  std::unordered_map<qbComponent, Archetype*>& AddEdges() {
+    return add_edges_;
+  }
+
+  std::unordered_map<qbComponent, Archetype*>& RemoveEdges() {
+    return remove_edges_;
+  }
+
+ private:
+  const std::vector<qbComponent> components_;
+  const std::vector<size_t> sizes_;
+  std::vector<ByteVector> columns_;
+  std::vector<qbEntity> entities_;
+
+  // Indexed by block * columns + column.
+  std::vector<ChangeStamp> stamps_;
+  std::vector<ChangeStamp> column_stamps_;
+
+  std::unordered_map<qbComponent, Archetype*> add_edges_;
+  std::unordered_map<qbComponent, Archetype*> remove_edges_;
+
+  // Marks all columns of the rows as changed.
+  void TouchRows(size_t row, size_t count);
+};
+
+#endif  // ARCHETYPE__H
@@ -0,0 +1,261 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "archetype_registry.h"
+
+#include "component.h"
+
+#include <algorithm>
+
+ArchetypeRegistry::ArchetypeRegistry() {}
+
+ArchetypeRegistry::~ArchetypeRegistry() {
+  for (Archetype* archetype : archetypes_) {
+    delete archetype;
+  }
+}
+
+void ArchetypeRegistry::Register(Component* component) {
+  components_[component->Id()] = component;
+}
+
+void ArchetypeRegistry::Insert(
+  qbEntity entity, const std::vector<qbComponentInstance_>& instances) {
+  if (instances.empty()) {
+    return;
+  }
+
+  std::vector<qbComponent> components;
+  if (locations_.has(entity)) {
+    components = locations_[entity].archetype->Components();
+  }
+  for (const auto& instance : instances) {
+    components.push_back(instance.component);
+  }
+  std::sort(components.begin(), components.end());
+  components.erase(std::unique(components.begin(), components.end()),
+                   components.end());
+
+  Move(entity, FindOrCreate(components));
+
+  Location& location = locations_[entity];
+  for (const auto& instance : instances) {
+    if (instance.data) {
+      Archetype* archetype = location.archetype;
+      size_t column = archetype->ColumnOf(instance.component);
+      memcpy(archetype->At(column, location.row), instance.data,
+             archetype->Stride(column));
+      archetype->Touch(column, location.row);
+    }
+  }
+}
+
+void ArchetypeRegistry::Insert(
+  const qbEntity* entities, size_t count,
+  const std::vector<qbComponentInstance_>& instances) {
+  if (instances.empty() || count == 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    if (locations_.has(entities[i])) {
+      for (size_t j = 0; j < count; ++j) {
+        Insert(entities[j], instances);
+      }
+      return;
+    }
+  }
+
+  std::vector<qbComponent> components;
+  for (const auto& instance : instances) {
+    components.push_back(instance.component);
+  }
+  std::sort(components.begin(), components.end());
+  components.erase(std::unique(components.begin(), components.end()),
+                   components.end());
+
+  Archetype* archetype = FindOrCreate(components);
+  size_t row = archetype->Insert(entities, count);
+  for (size_t i = 0; i < count; ++i) {
+    locations_.insert(entities[i], { archetype, row + i });
+  }
+
+  for (const auto& instance : instances) {
+    if (instance.data) {
+      archetype->Fill(archetype->ColumnOf(instance.component), row, count,
+                      instance.data);
+    }
+  }
+}
+
+void ArchetypeRegistry::Add(qbEntity entity, qbComponent component,
+                            const void* value) {
+  Archetype* to;
+  if (locations_.has(entity)) {
+    Archetype* from = locations_[entity].archetype;
+    auto& edges = from->AddEdges();
+    auto found = edges.find(component);
+    if (found != edges.end()) {
+      to = found->second;
+    } else {
+      std::vector<qbComponent> components = from->Components();
+      if (!from->Contains(component)) {
+        components.insert(std::upper_bound(components.begin(),
+                                           components.end(), component),
+                          component);
+      }
+      to = FindOrCreate(components);
+      edges[component] = to;
+    }
+  } else {
+    to = FindOrCreate({ component });
+  }
+
+  Move(entity, to);
+  if (value) {
+    const Location& location = locations_[entity];
+    size_t column = to->ColumnOf(component);
+    memcpy(to->At(column, location.row), value, to->Stride(column));
+    to->Touch(column, location.row);
+  }
+}
+
+void ArchetypeRegistry::Remove(qbEntity entity, qbComponent component) {
+  if (!Has(entity, component)) {
+    return;
+  }
+
+  Archetype* from = locations_[entity].archetype;
+  if (from->Components().size() == 1) {
+    Erase(entity);
+    locations_.erase(entity);
+    return;
+  }
+
+  Archetype* to;
+  auto& edges = from->RemoveEdges();
+  auto found = edges.find(component);
+  if (found != edges.end()) {
+    to = found->second;
+  } else {
+    std::vector<qbComponent> components = from->Components();
+    components.erase(std::lower_bound(components.begin(), components.end(),
+                                      component));
+    to = FindOrCreate(components);
+    edges[component] = to;
+  }
+  Move(entity, to);
+}
+
+bool ArchetypeRegistry::Has(qbEntity entity, qbComponent component) {
+  return locations_.has(entity) &&
+         locations_[entity].archetype->Contains(component);
+}
+
+void* ArchetypeRegistry::At(qbEntity entity, qbComponent component) {
+  if (!locations_.has(entity)) {
+    return nullptr;
+  }
+  const Location& location = locations_[entity];
+  int64_t column = location.archetype->ColumnOf(component);
+  if (column < 0) {
+    return nullptr;
+  }
+  return location.archetype->At(column, location.row);
+}
+
+void ArchetypeRegistry::Touch(qbEntity entity, qbComponent component) {
+  const Location& location = locations_[entity];
+  location.archetype->Touch(location.archetype->ColumnOf(component),
+                            location.row);
+}
+
+bool ArchetypeRegistry::ChangedSince(qbEntity entity, qbComponent component,
+                                     uint64_t tick) {
+  const Location& location = locations_[entity];
+  return location.archetype
+    ->BlockStamp(location.archetype->ColumnOf(component),
+                 location.row / Archetype::kBlockRows)
+    .ChangedSince(tick);
+}
+
+void ArchetypeRegistry::Match(const std::vector<qbComponent>& components,
+                              std::vector<Archetype*>* archetypes) const {
+  for (Archetype* archetype : archetypes_) {
+    if (archetype->ContainsAll(components)) {
+      archetypes->push_back(archetype);
+    }
+  }
+}
+
+Archetype* ArchetypeRegistry::FindOrCreate(
+  const std::vector<qbComponent>& components) {
+  auto found = by_components_.find(components);
+  if (found != by_components_.end()) {
+    return found->second;
+  }
+
+  std::vector<size_t> sizes;
+  sizes.reserve(components.size());
+  for (qbComponent component : components) {
+    sizes.push_back(components_[component]->ElementSize());
+  }
+
+  Archetype* archetype = new Archetype(components, std::move(sizes));
+  by_components_[components] = archetype;
+  archetypes_.push_back(archetype);
+  for (qbComponent component : components) {
+    components_[component]->AddArchetype(archetype);
+  }
+  if (on_create_) {
+    on_create_(archetype);
+  }
+  return archetype;
+}
+
+void ArchetypeRegistry::Move(qbEntity entity, Archetype* to) {
+  if (!locations_.has(entity)) {
+    locations_[entity] = { to, to->Insert(entity) };
+    return;
+  }
+
+  Location& location = locations_[entity];
+  Archetype* from = location.archetype;
+  if (from == to) {
+    return;
+  }
+
+  size_t row = to->Insert(entity);
+  const std::vector<qbComponent>& components = to->Components();
+  for (size_t i = 0; i < components.size(); ++i) {
+    int64_t column = from->ColumnOf(components[i]);
+    if (column >= 0) {
+      memcpy(to->At(i, row), from->At(column, location.row), to->Stride(i));
+    }
+  }
+  Erase(entity);
+  location = { to, row };
+}
+
+void ArchetypeRegistry::Erase(qbEntity entity) {
+  const Location& location = locations_[entity];
+  qbEntity moved = location.archetype->Erase(location.row);
+  if (moved != -1) {
+    locations_[moved].row = location.row;
+  }
+}
@@ -0,0 +1,102 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef ARCHETYPE_REGISTRY__H
+#define ARCHETYPE_REGISTRY__H
+
+#include "archetype.h"
+#include "defs.h"
+#include "sparse_map.h"
+
+#include <functional>
+#include <map>
+#include <vector>
+
+class Component;
+
+// Owns all archetype tables for a single InstanceRegistry and tracks which
+// table and row each entity lives in. Not thread-safe.
+class ArchetypeRegistry {
+ public:
+  struct Location {
+    Archetype* archetype;
+    size_t row;
+  };
+
+  ArchetypeRegistry();
+  ~ArchetypeRegistry();
+
+  // Registers an archetype-stored component. Must be called before any
+  // instances of the component are created.
+  void Register(Component* component);
+
+  // Moves the entity into the table with all the given components in a single
+  // step. Instances with a null data pointer are zero-initialized.
+  void Insert(qbEntity entity,
+              const std::vector<qbComponentInstance_>& instances);
+
+  // Same as above for many entities that are not stored in any table yet. All
+  // entities are appended to the same table and each column is filled with
+  // bulk copies.
+  void Insert(const qbEntity* entities, size_t count,
+              const std::vector<qbComponentInstance_>& instances);
+
+  void Add(qbEntity entity, qbComponent component, const void* value);
+  void Remove(qbEntity entity, qbComponent component);
+
+  bool Has(qbEntity entity, qbComponent component);
+
+  // Returns nullptr if the entity does not have the component.
+  void* At(qbEntity entity, qbComponent component);
+
+  // Marks the block holding the entity's instance as changed. The entity must
+  // have the component.
+  void Touch(qbEntity entity, qbComponent component);
+  bool ChangedSince(qbEntity entity, qbComponent component, uint64_t tick);
+
+  // Appends all tables that contain every component in the given sorted list.
+  void Match(const std::vector<qbComponent>& components,
+             std::vector<Archetype*>* archetypes) const;
+
+  const std::vector<Archetype*>& Archetypes() const {
+    return archetypes_;
+  }
+
+  // Called with every table created from now on.
+  void OnCreate(std::function<void(Archetype*)> fn) {
+    on_create_ = std::move(fn);
+  }
+
+ private:
+  Archetype* FindOrCreate(const std::vector<qbComponent>& components);
+
+  // Moves the entity from its current table (if any) to the given table and
+  // copies over all shared columns.
+  void Move(qbEntity entity, Archetype* to);
+
+  // Removes the entity's row from its current table.
+  void Erase(qbEntity entity);
+
+  std::map<std::vector<qbComponent>, Archetype*> by_components_;
+  std::vector<Archetype*> archetypes_;
+  SparseMap<Location, std::vector<Location>> locations_;
+  SparseMap<Component*, std::vector<Component*>> components_;
+  std::function<void(Archetype*)> on_create_;
+};
+
+#endif  // ARCHETYPE_REGISTRY__H
@@ -169,6 +169,26 @@ public:
     return elem_size_;
   }
 
+  // Returns the block that holds the element at "index".
+  size_t block(Index index) const {
+    return elem_size_ == 0 ? 0 : (index * elem_size_) / (page_size_ - elem_size_);
+  }
+
+  // Returns the number of elements starting at "index" that are stored
+  // back-to-back in the same block as "index".
+  size_t contiguous(Index index) const {
+    if (index >= count_) {
+      return 0;
+    }
+    if (elem_size_ == 0) {
+      return count_ - index;
+    }
+    size_t block_size = page_size_ - elem_size_;
+    size_t block = (index * elem_size_) / block_size;
+    size_t block_end = ((block + 1) * block_size + elem_size_ - 1) / elem_size_;
+    return std::min(block_end, count_) - index;
+  }
+
   void reserve(size_t count) {
     if (count > capacity_) {
       resize_capacity(count);
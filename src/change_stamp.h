@@ -0,0 +1,77 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef CHANGE_STAMP__H
+#define CHANGE_STAMP__H
+
+#include <atomic>
+#include <cstdint>
+
+// Global clock for change tracking. Writes to component storage stamp the
+// written block with Now(). A system that filters on changes calls Advance()
+// after it runs and keeps the returned tick, so every later write compares
+// greater than it.
+class ChangeTick {
+ public:
+  static uint64_t Now() {
+    return Tick().load(std::memory_order_relaxed);
+  }
+
+  // Returns the current tick and moves the clock forward.
+  static uint64_t Advance() {
+    return Tick().fetch_add(1, std::memory_order_relaxed);
+  }
+
+ private:
+  static std::atomic<uint64_t>& Tick() {
+    // Starts at 1 so that systems which have never run see every change.
+    static std::atomic<uint64_t> tick{ 1 };
+    return tick;
+  }
+};
+
+// The tick a block of instances was last written at. Safe to touch from
+// multiple workers at once.
+class ChangeStamp {
+ public:
+  ChangeStamp() : tick_(0) {}
+
+  ChangeStamp(const ChangeStamp& other) : tick_(other.Get()) {}
+
+  ChangeStamp& operator=(const ChangeStamp& other) {
+    tick_.store(other.Get(), std::memory_order_relaxed);
+    return *this;
+  }
+
+  uint64_t Get() const {
+    return tick_.load(std::memory_order_relaxed);
+  }
+
+  void Touch() {
+    tick_.store(ChangeTick::Now(), std::memory_order_relaxed);
+  }
+
+  bool ChangedSince(uint64_t tick) const {
+    return Get() > tick;
+  }
+
+ private:
+  std::atomic<uint64_t> tick_;
+};
+
+#endif  // CHANGE_STAMP__H
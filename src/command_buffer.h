@@ -0,0 +1,147 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef COMMAND_BUFFER__H
+#define COMMAND_BUFFER__H
+
+#include <cubez/cubez.h>
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// Records structural changes to a GameState to be applied later by
+// "GameState::Flush". Instance data is copied into the buffer. Every thread
+// records into its own buffer, so recording needs no synchronization.
+// Not thread-safe.
+class CommandBuffer {
+ public:
+  // An instance to create. "data" is an offset into the payload or "kNoData"
+  // if the instance was given no data.
+  static const size_t kNoData = ~(size_t)0;
+
+  struct Instance {
+    qbEntity entity;
+    qbComponent component;
+    size_t data;
+  };
+
+  // An entity to create with "count" instances starting at "begin" in
+  // "CreatedInstances".
+  struct Created {
+    qbEntity entity;
+    size_t begin;
+    size_t count;
+  };
+
+  struct Removed {
+    qbEntity entity;
+    qbComponent component;
+  };
+
+  // The entity handle has to be allocated already.
+  void Create(qbEntity entity) {
+    created_.push_back({ entity, created_instances_.size(), 0 });
+  }
+
+  // Adds an instance to the last entity passed to "Create".
+  void CreateInstance(qbComponent component, const void* data, size_t size) {
+    created_instances_.push_back({ created_.back().entity, component, Copy(data, size) });
+    ++created_.back().count;
+  }
+
+  void Add(qbEntity entity, qbComponent component, const void* data, size_t size) {
+    added_.push_back({ entity, component, Copy(data, size) });
+  }
+
+  void Remove(qbEntity entity, qbComponent component) {
+    removed_.push_back({ entity, component });
+  }
+
+  void Destroy(qbEntity entity) {
+    destroyed_.push_back(entity);
+  }
+
+  void Destroy(const qbEntity* entities, size_t count) {
+    destroyed_.insert(destroyed_.end(), entities, entities + count);
+  }
+
+  const std::vector<Created>& CreatedEntities() const {
+    return created_;
+  }
+
+  const std::vector<Instance>& CreatedInstances() const {
+    return created_instances_;
+  }
+
+  const std::vector<Instance>& Added() const {
+    return added_;
+  }
+
+  const std::vector<Removed>& RemovedInstances() const {
+    return removed_;
+  }
+
+  std::vector<qbEntity>& Destroyed() {
+    return destroyed_;
+  }
+
+  void* Data(const Instance& instance) {
+    return instance.data == kNoData ? nullptr : payload_.data() + instance.data;
+  }
+
+  bool Empty() const {
+    return created_.empty() && added_.empty() && removed_.empty() &&
+           destroyed_.empty();
+  }
+
+  // Keeps the allocated memory for the next frame.
+  void Clear() {
+    created_.resize(0);
+    created_instances_.resize(0);
+    added_.resize(0);
+    removed_.resize(0);
+    destroyed_.resize(0);
+    payload_.resize(0);
+  }
+
+ private:
+  // Copies the data to the end of the payload. Returns its offset.
+  size_t Copy(const void* data, size_t size) {
+    if (!data) {
+      return kNoData;
+    }
+    const size_t align = alignof(std::max_align_t);
+    size_t offset = (payload_.size() + align - 1) & ~(align - 1);
+    payload_.resize(offset + size);
+    memcpy(payload_.data() + offset, data, size);
+    return offset;
+  }
+
+  std::vector<Created> created_;
+  std::vector<Instance> created_instances_;
+  std::vector<Instance> added_;
+  std::vector<Removed> removed_;
+  std::vector<qbEntity> destroyed_;
+
+  // Offsets are rounded up to std::max_align_t so that the instance data
+  // stays aligned.
+  std::vector<uint8_t> payload_;
+};
+
+#endif  // COMMAND_BUFFER__H
@@ -17,56 +17,229 @@
 */
 
 #include "apex_memmove.h"
+#include "archetype_registry.h"
 #include "component.h"
 #include "defs.h"
 
 #include <omp.h>
 
-Component::Component(qbId id, size_t instance_size, bool is_shared, qbComponentType type)
-    : id_(id), instances_(instance_size), is_shared_(is_shared), type_(type) {}
+Component::iterator::iterator(Component* component, InstanceMap::iterator it,
+                              size_t archetype, size_t row)
+    : component_(component), it_(it), archetype_(archetype), row_(row) {
+  Advance();
+}
+
+std::pair<qbId, void*> Component::iterator::operator*() {
+  if (!component_->IsArchetype()) {
+    return *it_;
+  }
+  Archetype* archetype = component_->archetypes_[archetype_];
+  size_t column = archetype->ColumnOf(component_->id_);
+  return{ archetype->Entities()[row_], archetype->At(column, row_) };
+}
+
+Component::iterator& Component::iterator::operator++() {
+  if (!component_->IsArchetype()) {
+    ++it_;
+    return *this;
+  }
+  ++row_;
+  Advance();
+  return *this;
+}
+
+Component::iterator Component::iterator::operator+(size_t delta) const {
+  iterator ret = *this;
+  if (!component_->IsArchetype()) {
+    ret.it_ += delta;
+    return ret;
+  }
+  const auto& archetypes = component_->archetypes_;
+  while (delta > 0 && ret.archetype_ < archetypes.size()) {
+    size_t remaining = archetypes[ret.archetype_]->Size() - ret.row_;
+    if (delta < remaining) {
+      ret.row_ += delta;
+      break;
+    }
+    delta -= remaining;
+    ++ret.archetype_;
+    ret.row_ = 0;
+    ret.Advance();
+  }
+  return ret;
+}
+
+bool Component::iterator::operator==(const iterator& other) const {
+  return it_ == other.it_ && archetype_ == other.archetype_ &&
+         row_ == other.row_;
+}
+
+bool Component::iterator::operator!=(const iterator& other) const {
+  return !(*this == other);
+}
+
+void Component::iterator::Advance() {
+  if (!component_->IsArchetype()) {
+    return;
+  }
+  const auto& archetypes = component_->archetypes_;
+  while (archetype_ < archetypes.size() &&
+         row_ >= archetypes[archetype_]->Size()) {
+    ++archetype_;
+    row_ = 0;
+  }
+}
+
+Component::Component(qbId id, size_t instance_size, bool is_shared,
+                     qbComponentType type, bool is_tag,
+                     ArchetypeRegistry* archetypes)
+    : id_(id), instances_(is_tag ? 0 : instance_size),
+      archetype_registry_(is_tag ? nullptr : archetypes),
+      buffers_(nullptr), published_(0), layout_(0),
+      is_shared_(is_shared), is_tag_(is_tag), type_(type) {}
+
+Component::~Component() {
+  if (buffers_) {
+    for (size_t i = 0; i < kBuffers; ++i) {
+      delete buffers_[i].copy;
+    }
+    delete[] buffers_;
+  }
+}
 
 Component* Component::Clone() {
-  Component* ret = new Component(id_, instances_.element_size(), is_shared_, type_);
-  ret->instances_ = instances_;
+  Component* ret = new Component(id_, instances_.element_size(), is_shared_,
+                                 type_, is_tag_);
+  if (is_tag_) {
+    ret->tags_ = tags_;
+  } else if (IsArchetype()) {
+    // Clones do not share the archetype tables, so the instances are copied
+    // into sparse storage.
+    for (auto pair : *this) {
+      ret->instances_.insert(pair.first, pair.second);
+      ret->TouchSlot(ret->instances_.size() - 1);
+    }
+  } else {
+    ret->instances_ = instances_;
+    ret->stamps_ = stamps_;
+  }
+  ret->stamp_ = stamp_;
+  if (buffers_) {
+    ret->EnableBuffering();
+  }
   return ret;
 }
 
 void Component::Merge(const Component& other) {
+  if (is_tag_) {
+    tags_.Merge(other.tags_);
+    stamp_.Touch();
+    return;
+  }
+
   size_t size = instances_.element_size();
   for (const auto& pair : other) {
     const void* src = pair.second;
-    void* dst = instances_[pair.first];
+    if (!Has(pair.first)) {
+      Create(pair.first, (void*)src);
+      continue;
+    }
+    void* dst = (*this)[pair.first];
     if (memcmp(src, dst, size) != 0) {
       memcpy(dst, src, size);
+      Touch(pair.first);
     }
   }
 }
 
 qbResult Component::Create(qbId entity, void* value) {
+  if (is_tag_) {
+    tags_.Set(entity);
+    stamp_.Touch();
+    return QB_OK;
+  }
+  if (IsArchetype()) {
+    archetype_registry_->Add(entity, id_, value);
+    return QB_OK;
+  }
   instances_.insert(entity, value);
+  TouchSlot(instances_.size() - 1);
+  ++layout_;
+  return QB_OK;
+}
+
+qbResult Component::CreateBatch(const qbId* entities, size_t count,
+                                void* value) {
+  if (is_tag_) {
+    for (size_t i = 0; i < count; ++i) {
+      tags_.Set(entities[i]);
+    }
+    stamp_.Touch();
+    return QB_OK;
+  }
+  if (IsArchetype()) {
+    for (size_t i = 0; i < count; ++i) {
+      archetype_registry_->Add(entities[i], id_, value);
+    }
+    return QB_OK;
+  }
+  instances_.reserve(instances_.size() + count);
+  for (size_t i = 0; i < count; ++i) {
+    instances_.insert(entities[i], value);
+    TouchSlot(instances_.size() - 1);
+  }
+  ++layout_;
   return QB_OK;
 }
 
 qbResult Component::Destroy(qbId entity) {
-  if (instances_.has(entity)) {
-    if (type_ == qbComponentType::QB_COMPONENT_TYPE_COMPOSITE) {
-      qbEntity* entities = (qbEntity*)instances_[entity];
-      for (size_t i = 0; i < instances_.size() / sizeof(qbEntity); ++i) {
-        qb_entity_destroy(entities[i]);
-      }
-    } else if (type_ == qbComponentType::QB_COMPONENT_TYPE_POINTER) {
-      free(*(void**)instances_[entity]);
+  if (is_tag_) {
+    tags_.Reset(entity);
+    stamp_.Touch();
+    return QB_OK;
+  }
+
+  void* data = (*this)[entity];
+  if (type_ == qbComponentType::QB_COMPONENT_TYPE_COMPOSITE) {
+    qbEntity* entities = (qbEntity*)data;
+    for (size_t i = 0; i < ElementSize() / sizeof(qbEntity); ++i) {
+      qb_entity_destroy(entities[i]);
     }
+  } else if (type_ == qbComponentType::QB_COMPONENT_TYPE_POINTER) {
+    free(*(void**)data);
+  }
+
+  if (IsArchetype()) {
+    archetype_registry_->Remove(entity, id_);
+  } else {
+    // The last instance is moved into the erased slot.
+    size_t slot = instances_.slot(entity);
     instances_.erase(entity);
+    if (slot < instances_.size()) {
+      TouchSlot(slot);
+    }
+    ++layout_;
   }
   return QB_OK;
 }
 
 void* Component::operator[](qbId entity) {
-  return instances_[entity];
+  if (is_tag_) {
+    return nullptr;
+  }
+  if (IsArchetype()) {
+    return archetype_registry_->At(entity, id_);
+  }
+  return instances_.at(entity);
 }
 
 const void* Component::operator[](qbId entity) const {
+  if (is_tag_) {
+    return nullptr;
+  }
+  if (IsArchetype()) {
+    return archetype_registry_->At(entity, id_);
+  }
   return instances_[entity];
 }
 
@@ -75,14 +248,30 @@ const void* Component::at(qbId entity) const {
 }
 
 bool Component::Has(qbId entity) const {
+  if (is_tag_) {
+    return tags_.Test(entity);
+  }
+  if (IsArchetype()) {
+    return archetype_registry_->Has(entity, id_);
+  }
   return instances_.has(entity);
 }
 
 bool Component::Empty() const {
-  return instances_.size() == 0;
+  return Size() == 0;
 }
 
 size_t Component::Size() const {
+  if (is_tag_) {
+    return tags_.Count();
+  }
+  if (IsArchetype()) {
+    size_t size = 0;
+    for (Archetype* archetype : archetypes_) {
+      size += archetype->Size();
+    }
+    return size;
+  }
   return instances_.size();
 }
 
@@ -91,6 +280,9 @@ size_t Component::ElementSize() const {
 }
 
 void Component::Reserve(size_t count) {
+  if (is_tag_ || IsArchetype()) {
+    return;
+  }
   return instances_.reserve(count);
 }
 
@@ -98,20 +290,86 @@ qbId Component::Id() const {
   return id_;
 }
 
+bool Component::IsArchetype() const {
+  return archetype_registry_ != nullptr;
+}
+
+bool Component::IsTag() const {
+  return is_tag_;
+}
+
+const EntityBitset& Component::Tags() const {
+  return tags_;
+}
+
+const std::vector<Archetype*>& Component::Archetypes() const {
+  return archetypes_;
+}
+
+void Component::AddArchetype(Archetype* archetype) {
+  archetypes_.push_back(archetype);
+}
+
+ChangeStamp* Component::BlockAt(size_t slot, size_t* end) {
+  *end = slot + instances_.contiguous(slot);
+  return &stamps_[instances_.block(slot)];
+}
+
+uint64_t Component::Version() const {
+  uint64_t version = stamp_.Get();
+  for (Archetype* archetype : archetypes_) {
+    version = std::max(
+      version, archetype->ColumnStamp(archetype->ColumnOf(id_)).Get());
+  }
+  return version;
+}
+
+void Component::Touch(qbId entity) {
+  if (IsArchetype()) {
+    archetype_registry_->Touch(entity, id_);
+  } else if (!is_tag_) {
+    stamps_[instances_.block(instances_.slot(entity))].Touch();
+  }
+  stamp_.Touch();
+}
+
+void Component::Touch() {
+  stamp_.Touch();
+}
+
+bool Component::ChangedSince(qbId entity, uint64_t tick) {
+  if (is_tag_) {
+    return stamp_.ChangedSince(tick);
+  }
+  if (IsArchetype()) {
+    return archetype_registry_->ChangedSince(entity, id_, tick);
+  }
+  return stamps_[instances_.block(instances_.slot(entity))].ChangedSince(tick);
+}
+
+void Component::TouchSlot(size_t slot) {
+  size_t block = instances_.block(slot);
+  if (block >= stamps_.size()) {
+    stamps_.resize(block + 1);
+  }
+  stamps_[block].Touch();
+  stamp_.Touch();
+}
+
 Component::iterator Component::begin() {
-  return instances_.begin();
+  return iterator(this, instances_.begin(), 0, 0);
 }
 
 Component::iterator Component::end() {
-  return instances_.end();
+  return iterator(this, instances_.end(), archetypes_.size(), 0);
 }
 
 Component::const_iterator Component::begin() const {
-  return instances_.begin();
+  return const_cast<Component*>(this)->begin();
 }
 
 Component::const_iterator Component::end() const {
-  return instances_.end();
+  return const_cast<Component*>(this)->end();
 }
 
 void Component::Lock(bool is_mutable) {
@@ -136,4 +394,79 @@ void Component::Unlock(bool is_mutable) {
   } else {
     mu_.unlock_shared();
   }
-}
\ No newline at end of file
+}
+
+void Component::EnableBuffering() {
+  if (buffers_ || is_tag_ || IsArchetype()) {
+    return;
+  }
+  buffers_ = new Buffer[kBuffers];
+  for (size_t i = 0; i < kBuffers; ++i) {
+    buffers_[i].copy = new Component(id_, instances_.element_size(), false, type_);
+  }
+}
+
+bool Component::IsBuffered() const {
+  return buffers_ != nullptr;
+}
+
+void Component::Publish() {
+  if (!buffers_) {
+    return;
+  }
+
+  std::lock_guard<std::shared_mutex> lock(mu_);
+  size_t published = published_.load();
+  for (size_t i = 0; i < kBuffers; ++i) {
+    Buffer& buffer = buffers_[i];
+    if (i == published || buffer.readers.load() != 0) {
+      continue;
+    }
+
+    // Only blocks written since this copy was last written are copied, unless
+    // instances were added or removed in the meantime.
+    Component* copy = buffer.copy;
+    if (buffer.layout != layout_) {
+      copy->instances_ = instances_;
+      copy->stamps_ = stamps_;
+    } else {
+      size_t size = instances_.element_size();
+      for (size_t slot = 0; slot < instances_.size();) {
+        size_t count = instances_.contiguous(slot);
+        size_t block = instances_.block(slot);
+        if (stamps_[block].ChangedSince(buffer.tick)) {
+          memcpy(copy->instances_.value(slot), instances_.value(slot), count * size);
+          copy->stamps_[block] = stamps_[block];
+        }
+        slot += count;
+      }
+    }
+    copy->stamp_ = stamp_;
+    buffer.layout = layout_;
+    buffer.tick = ChangeTick::Advance();
+    published_ = i;
+    return;
+  }
+}
+
+Component* Component::AcquireRead() {
+  for (;;) {
+    // Pin the copy, then check that it was not replaced before the pin.
+    size_t published = published_.load();
+    Buffer& buffer = buffers_[published];
+    buffer.readers.fetch_add(1);
+    if (published == published_.load()) {
+      return buffer.copy;
+    }
+    buffer.readers.fetch_sub(1);
+  }
+}
+
+void Component::ReleaseRead(Component* copy) {
+  for (size_t i = 0; i < kBuffers; ++i) {
+    if (buffers_[i].copy == copy) {
+      buffers_[i].readers.fetch_sub(1);
+      return;
+    }
+  }
+}
@@ -20,26 +20,70 @@
 #define COMPONENT__H
 
 #include <cubez/cubez.h>
+#include "archetype.h"
+#include "change_stamp.h"
+#include "entity_bitset.h"
 #include "sparse_map.h"
 #include "sparse_set.h"
 
+#include <atomic>
 #include <shared_mutex>
+#include <vector>
+
+class ArchetypeRegistry;
 
 // Not thread-safe. 
 class Component {
   typedef SparseMap<void, BlockVector> InstanceMap;
  public:
-  typedef typename InstanceMap::iterator iterator;
-  typedef typename InstanceMap::const_iterator const_iterator;
+  // Iterates over all instances regardless of storage. Archetype-stored
+  // instances are visited table by table.
+  class iterator {
+   public:
+    std::pair<qbId, void*> operator*();
+
+    iterator& operator++();
+    iterator operator+(size_t delta) const;
+
+    bool operator==(const iterator& other) const;
+    bool operator!=(const iterator& other) const;
+
+   private:
+    iterator(Component* component, InstanceMap::iterator it,
+             size_t archetype, size_t row);
+
+    // Skips over empty archetypes.
+    void Advance();
 
-  Component(qbId id, size_t instance_size, bool is_shared, qbComponentType type);
+    Component* component_;
+    InstanceMap::iterator it_;
+    size_t archetype_;
+    size_t row_;
+
+    friend class Component;
+  };
+  typedef iterator const_iterator;
+
+  // If an ArchetypeRegistry is given, instances are stored in its tables
+  // instead of the component's own sparse map. Tags have no instance data and
+  // only store which entities own them in a bitset.
+  Component(qbId id, size_t instance_size, bool is_shared, qbComponentType type,
+            bool is_tag = false, ArchetypeRegistry* archetypes = nullptr);
+  ~Component();
 
   Component* Clone();
   void Merge(const Component& other);
 
   qbResult Create(qbId entity, void* value);
+
+  // Creates an instance with the same value for each entity.
+  qbResult CreateBatch(const qbId* entities, size_t count, void* value);
+  // The entity must own an instance of this component.
   qbResult Destroy(qbId entity);
 
+  // Does not check if the entity owns an instance of this component. Callers
+  // are expected to check the entity's signature first. Always nullptr for
+  // tags.
   void* operator[](qbId entity);
   const void* operator[](qbId entity) const;
   const void* at(qbId entity) const;
@@ -53,9 +97,86 @@ class Component {
   size_t ElementSize() const;
   qbId Id() const;
 
+  bool IsArchetype() const;
+  bool IsTag() const;
+
+  // The entities that own the tag. Only valid for tags.
+  const EntityBitset& Tags() const;
+
+  // All tables that store this component. Only valid for archetype storage.
+  const std::vector<Archetype*>& Archetypes() const;
+  void AddArchetype(Archetype* archetype);
+
+  // Calls "fn(entities, data, stride, count, stamp)" for each block of
+  // instances that are adjacent in memory and share a change stamp:
+  // Archetype::kBlockRows rows of a table for archetype storage and one
+  // BlockVector block for sparse storage. The pointers are invalidated by any
+  // structural change to the component. Tags have no blocks.
+  template<class Fn_>
+  void ForEachBlock(Fn_ fn) {
+    if (is_tag_) {
+      return;
+    }
+    if (IsArchetype()) {
+      for (Archetype* archetype : archetypes_) {
+        size_t column = archetype->ColumnOf(id_);
+        for (size_t block = 0; block < archetype->Blocks(); ++block) {
+          size_t row = block * Archetype::kBlockRows;
+          fn(archetype->Entities() + row, archetype->At(column, row),
+             archetype->Stride(column),
+             std::min((size_t)Archetype::kBlockRows, archetype->Size() - row),
+             &archetype->BlockStamp(column, block));
+        }
+      }
+      return;
+    }
+
+    const qbEntity* entities = (const qbEntity*)instances_.keys();
+    for (size_t slot = 0; slot < instances_.size();) {
+      size_t count = instances_.contiguous(slot);
+      fn(entities + slot, instances_.value(slot), instances_.element_size(),
+         count, &stamps_[instances_.block(slot)]);
+      slot += count;
+    }
+  }
+
+  // Sparse storage only. Returns the change stamp of the block holding the
+  // instance at "slot" and sets "end" to the slot after the block.
+  ChangeStamp* BlockAt(size_t slot, size_t* end);
+
+  // Change tracking. Returns the newest stamp of any instance. Tags are
+  // tracked as a whole instead of per block.
+  uint64_t Version() const;
+
+  // Marks the block holding the entity's instance as changed. The entity must
+  // own an instance.
+  void Touch(qbId entity);
+
+  // Marks the component as changed. Must be called by anyone who touches a
+  // block's stamp directly.
+  void Touch();
+
+  bool ChangedSince(qbId entity, uint64_t tick);
+
   void Lock(bool is_mutable=false);
   void Unlock(bool is_mutable = false);
 
+  // Buffered components keep published copies of their instances for
+  // readers, so readers never wait on writers. Only valid for shared, sparse
+  // components. Must be called before any instance is created.
+  void EnableBuffering();
+  bool IsBuffered() const;
+
+  // Copies the instances changed since a copy was last written into a copy
+  // that no reader holds, and makes it the one returned by "AcquireRead".
+  // Skipped if every copy is held by a reader. Called once per frame.
+  void Publish();
+
+  // Returns the last published copy and keeps it from being written until
+  // "ReleaseRead". Lock-free and safe to call from any thread.
+  Component* AcquireRead();
+  void ReleaseRead(Component* copy);
+
   iterator begin();
   iterator end();
 
@@ -63,11 +184,41 @@ class Component {
   const_iterator end() const;
 
  private:
+  // Stamps the block holding the sparse instance at "slot".
+  void TouchSlot(size_t slot);
+
   qbId id_;
   InstanceMap instances_;
+  ArchetypeRegistry* archetype_registry_;
+  std::vector<Archetype*> archetypes_;
+  EntityBitset tags_;
+
+  // Sparse storage only: one stamp per BlockVector block.
+  std::vector<ChangeStamp> stamps_;
+  ChangeStamp stamp_;
+
+  // Published copies of a buffered component. A copy is only written while
+  // no reader holds it and it is not the published one.
+  struct Buffer {
+    Buffer() : copy(nullptr), readers(0), tick(0), layout(~0ULL) {}
+
+    Component* copy;
+    std::atomic<size_t> readers;
+
+    // When the copy was last written and the layout it was copied with.
+    uint64_t tick;
+    uint64_t layout;
+  };
+  static const size_t kBuffers = 3;
+  Buffer* buffers_;
+  std::atomic<size_t> published_;
+
+  // Bumped whenever sparse instances are added, removed or moved.
+  uint64_t layout_;
 
   std::shared_mutex mu_;
   const bool is_shared_;
+  const bool is_tag_;
   qbComponentType type_;
 };
 
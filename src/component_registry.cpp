@@ -37,67 +37,90 @@ qbResult ComponentRegistry::Create(qbComponent* component, qbComponentAttr attr)
   components_defs_[new_id] = *attr;
   *component = new_id;
 
-  {
-    instance_create_events_.resize(new_id + 1);
-    qbEvent& on_create = instance_create_events_[new_id];
-
-    qbEventAttr attr;
-    qb_eventattr_create(&attr);
-    qb_eventattr_setmessagetype(attr, qbInstanceOnCreateEvent_);
-    qb_event_create(&on_create, attr);
-    qb_eventattr_destroy(&attr);
-  }
-  {
-    instance_destroy_events_.resize(new_id + 1);
-    qbEvent& on_destroy = instance_destroy_events_[new_id];
-
-    qbEventAttr attr;
-    qb_eventattr_create(&attr);
-    qb_eventattr_setmessagetype(attr, qbInstanceOnDestroyEvent_);
-    qb_event_create(&on_destroy, attr);
-    qb_eventattr_destroy(&attr);
-  }
+  // The notification events are only created once someone subscribes.
+  instance_create_events_.resize(new_id + 1, nullptr);
+  instance_destroy_events_.resize(new_id + 1, nullptr);
 
   return QB_OK;
 }
 
-Component* ComponentRegistry::Create(qbComponent component) const {
+Component* ComponentRegistry::Create(qbComponent component,
+                                     ArchetypeRegistry* archetypes) const {
   const qbComponentAttr_& attr = components_defs_[component];
-  return new Component(component, attr.data_size, attr.is_shared, attr.type);
+  if (attr.storage != qbComponentStorage::QB_COMPONENT_STORAGE_ARCHETYPE) {
+    archetypes = nullptr;
+  }
+  Component* ret = new Component(component, attr.data_size, attr.is_shared,
+                                 attr.type, attr.is_tag, archetypes);
+  if (attr.is_buffered) {
+    ret->EnableBuffering();
+  }
+  return ret;
+}
+
+qbEvent ComponentRegistry::CreateNotificationEvent(size_t message_size) {
+  qbEvent event;
+  qbEventAttr attr;
+  qb_eventattr_create(&attr);
+  qb_eventattr_setmessagesize(attr, message_size);
+  qb_event_create(&event, attr);
+  qb_eventattr_destroy(&attr);
+  return event;
+}
+
+qbEvent ComponentRegistry::FindNotificationEvent(
+  const std::vector<qbEvent>& events, qbComponent component) const {
+  return (size_t)component < events.size() ? events[component] : nullptr;
 }
 
 qbResult ComponentRegistry::SubcsribeToOnCreate(qbSystem system,
                                                 qbComponent component) {
-  Create(component);
-  return qb_event_subscribe(
-    instance_create_events_[component], system);
+  qbEvent& on_create = instance_create_events_[component];
+  if (!on_create) {
+    on_create = CreateNotificationEvent(sizeof(qbInstanceOnCreateEvent_));
+  }
+  return qb_event_subscribe(on_create, system);
 }
 
 qbResult ComponentRegistry::SubcsribeToOnDestroy(qbSystem system,
                                                  qbComponent component) {
-  Create(component);
-  return qb_event_subscribe(
-    instance_destroy_events_[component], system);
+  qbEvent& on_destroy = instance_destroy_events_[component];
+  if (!on_destroy) {
+    on_destroy = CreateNotificationEvent(sizeof(qbInstanceOnDestroyEvent_));
+  }
+  return qb_event_subscribe(on_destroy, system);
 }
 
 qbResult ComponentRegistry::SendInstanceCreateNotification(
-  qbEntity entity, Component* component, GameState* state) const {
+  const qbEntity* entities, size_t count, Component* component,
+  GameState* state) const {
+  qbEvent on_create = FindNotificationEvent(instance_create_events_, component->Id());
+  if (!on_create || count == 0) {
+    return QB_OK;
+  }
+
   qbInstanceOnCreateEvent_ event;
-  event.entity = entity;
+  event.entities = entities;
+  event.count = count;
   event.component = component;
   event.state = state;
 
-  return qb_event_sendsync(
-    instance_create_events_[component->Id()], &event);
+  return qb_event_sendsync(on_create, &event);
 }
 
 qbResult ComponentRegistry::SendInstanceDestroyNotification(
-  qbEntity entity, Component* component, GameState* state) const {
+  const qbEntity* entities, size_t count, Component* component,
+  GameState* state) const {
+  qbEvent on_destroy = FindNotificationEvent(instance_destroy_events_, component->Id());
+  if (!on_destroy || count == 0) {
+    return QB_OK;
+  }
+
   qbInstanceOnDestroyEvent_ event;
-  event.entity = entity;
+  event.entities = entities;
+  event.count = count;
   event.component = component;
   event.state = state;
 
-  return qb_event_sendsync(
-    instance_destroy_events_[component->Id()], &event);
+  return qb_event_sendsync(on_destroy, &event);
 }
\ No newline at end of file
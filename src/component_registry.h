@@ -25,6 +25,7 @@
 #include <atomic>
 #include <unordered_map>
 
+class ArchetypeRegistry;
 class GameState;
 class ComponentRegistry {
 public:
@@ -34,14 +35,30 @@ public:
   ComponentRegistry* Clone();
 
   qbResult Create(qbComponent* component, qbComponentAttr attr);
-  Component* Create(qbComponent component) const;
+  // Archetype-stored components are backed by the given registry. Without one
+  // they fall back to sparse storage.
+  Component* Create(qbComponent component,
+                    ArchetypeRegistry* archetypes = nullptr) const;
+
+  // Size of an instance of the component.
+  size_t DataSize(qbComponent component) const {
+    return components_defs_[component].data_size;
+  }
 
   qbResult SubcsribeToOnCreate(qbSystem system, qbComponent component);
   qbResult SubcsribeToOnDestroy(qbSystem system, qbComponent component);
 
-  qbResult SendInstanceCreateNotification(qbEntity entity, Component* component, GameState* state) const;
-  qbResult SendInstanceDestroyNotification(qbEntity entity, Component* component, GameState* state) const;
+  // Notifications are sent once per component for all instances created or
+  // destroyed together. They cost nothing if no system subscribed.
+  qbResult SendInstanceCreateNotification(const qbEntity* entities, size_t count, Component* component, GameState* state) const;
+  qbResult SendInstanceDestroyNotification(const qbEntity* entities, size_t count, Component* component, GameState* state) const;
 private:
+  static qbEvent CreateNotificationEvent(size_t message_size);
+
+  // Returns null if no system subscribed to the component's notification.
+  qbEvent FindNotificationEvent(const std::vector<qbEvent>& events,
+                                qbComponent component) const;
+
   SparseMap<qbComponentAttr_, TypedBlockVector<qbComponentAttr_>> components_defs_;
   std::vector<qbEvent> instance_create_events_;
   std::vector<qbEvent> instance_destroy_events_;
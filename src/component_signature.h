@@ -0,0 +1,78 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef COMPONENT_SIGNATURE__H
+#define COMPONENT_SIGNATURE__H
+
+#include <cubez/cubez.h>
+
+#include <vector>
+
+// A set of components stored as a bitset indexed by qbComponent.
+class ComponentSignature {
+ public:
+  ComponentSignature() {}
+
+  ComponentSignature(const std::vector<qbComponent>& components) {
+    for (qbComponent component : components) {
+      Set(component);
+    }
+  }
+
+  void Set(qbComponent component) {
+    size_t word = component >> 6;
+    if (word >= words_.size()) {
+      words_.resize(word + 1, 0);
+    }
+    words_[word] |= 1ULL << (component & 63);
+  }
+
+  void Reset(qbComponent component) {
+    size_t word = component >> 6;
+    if (word < words_.size()) {
+      words_[word] &= ~(1ULL << (component & 63));
+    }
+  }
+
+  bool Test(qbComponent component) const {
+    size_t word = component >> 6;
+    return word < words_.size() && (words_[word] >> (component & 63)) & 1;
+  }
+
+  bool Empty() const {
+    for (uint64_t w : words_) {
+      if (w) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  size_t Words() const {
+    return words_.size();
+  }
+
+  const uint64_t* Data() const {
+    return words_.data();
+  }
+
+ private:
+  std::vector<uint64_t> words_;
+};
+
+#endif  // COMPONENT_SIGNATURE__H
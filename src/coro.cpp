@@ -49,10 +49,309 @@
 #include <string.h>
 #include "coro.h"
 #include "tls.h"
-#include "ctxt.h"
 #include <cubez/cubez.h>
 #include <cubez/common.h>
 
+#ifdef QB_CORO_NATIVE
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <vector>
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#endif
+
+/*
+* Native backend. Every coroutine owns a stack drawn from a process-wide pool.
+* A switch pushes the callee-saved registers onto the running stack, stores the
+* stack pointer in the coroutine being left and pops the registers of the
+* coroutine being entered. The cost does not depend on how deep either stack
+* is and nothing is allocated after the stack is taken from the pool.
+*/
+
+/* the coroutine structure */
+struct _Coro {
+  Coro parent;
+  _entry start;
+
+  /* stack pointer saved by the last switch away from the coroutine */
+  void* sp;
+
+  /* pooled stack including the guard page, null for a thread's own stack */
+  void* stack;
+
+  /* value passed by the last switch into the coroutine */
+  qbVar value;
+  int is_done;
+};
+
+THREAD_LOCAL Coro _cur;
+THREAD_LOCAL struct _Coro _on_exit;
+
+extern "C" {
+/* Saves the callee-saved registers on the current stack, stores the stack
+   pointer in *from and resumes the stack at "to". */
+void _coro_switch(void** from, void* to);
+
+/* First return address of a new coroutine. Calls the entry in the second
+   callee-saved register with the coroutine in the first. */
+void _coro_trampoline();
+}
+
+#if defined(__x86_64__)
+/* Frame: mxcsr and x87 control word, r15, r14, r13, r12, rbx, rbp, return. */
+asm(R"(
+  .text
+  .globl _coro_switch
+  .type _coro_switch, @function
+_coro_switch:
+  pushq %rbp
+  pushq %rbx
+  pushq %r12
+  pushq %r13
+  pushq %r14
+  pushq %r15
+  subq $8, %rsp
+  stmxcsr (%rsp)
+  fnstcw 4(%rsp)
+  movq %rsp, (%rdi)
+  movq %rsi, %rsp
+  ldmxcsr (%rsp)
+  fldcw 4(%rsp)
+  addq $8, %rsp
+  popq %r15
+  popq %r14
+  popq %r13
+  popq %r12
+  popq %rbx
+  popq %rbp
+  ret
+  .size _coro_switch, .-_coro_switch
+
+  .globl _coro_trampoline
+  .type _coro_trampoline, @function
+_coro_trampoline:
+  movq %r12, %rdi
+  callq *%r13
+  ud2
+  .size _coro_trampoline, .-_coro_trampoline
+)");
+
+enum { FRAME_SIZE = 8 * 8 };
+
+static void _frame_init(void** frame, Coro c, void(*entry)(Coro)) {
+  ((uint32_t*)frame)[0] = 0x1F80;     /* mxcsr: all exceptions masked */
+  ((uint32_t*)frame)[1] = 0x037F;     /* x87: all exceptions masked */
+  frame[3] = (void*)entry;            /* r13 */
+  frame[4] = c;                       /* r12 */
+  frame[7] = (void*)_coro_trampoline; /* return address */
+}
+
+#elif defined(__aarch64__)
+/* Frame: x19-x28, x29, x30 (return address), d8-d15. */
+asm(R"(
+  .text
+  .globl _coro_switch
+  .type _coro_switch, %function
+_coro_switch:
+  sub sp, sp, #160
+  stp x19, x20, [sp, #0]
+  stp x21, x22, [sp, #16]
+  stp x23, x24, [sp, #32]
+  stp x25, x26, [sp, #48]
+  stp x27, x28, [sp, #64]
+  stp x29, x30, [sp, #80]
+  stp d8, d9, [sp, #96]
+  stp d10, d11, [sp, #112]
+  stp d12, d13, [sp, #128]
+  stp d14, d15, [sp, #144]
+  mov x9, sp
+  str x9, [x0]
+  mov sp, x1
+  ldp x19, x20, [sp, #0]
+  ldp x21, x22, [sp, #16]
+  ldp x23, x24, [sp, #32]
+  ldp x25, x26, [sp, #48]
+  ldp x27, x28, [sp, #64]
+  ldp x29, x30, [sp, #80]
+  ldp d8, d9, [sp, #96]
+  ldp d10, d11, [sp, #112]
+  ldp d12, d13, [sp, #128]
+  ldp d14, d15, [sp, #144]
+  add sp, sp, #160
+  ret
+  .size _coro_switch, .-_coro_switch
+
+  .globl _coro_trampoline
+  .type _coro_trampoline, %function
+_coro_trampoline:
+  mov x0, x19
+  blr x20
+  brk #0
+  .size _coro_trampoline, .-_coro_trampoline
+)");
+
+enum { FRAME_SIZE = 160 };
+
+static void _frame_init(void** frame, Coro c, void(*entry)(Coro)) {
+  frame[0] = c;                        /* x19 */
+  frame[1] = (void*)entry;             /* x20 */
+  frame[11] = (void*)_coro_trampoline; /* x30 */
+}
+#endif
+
+/*
+* Stacks are mapped once with a guard page below them and reused. The pages a
+* coroutine touched stay committed while the stack sits in the pool.
+*/
+static std::mutex _stack_pool_mu;
+static std::vector<void*> _stack_pool;
+
+static size_t _guard_size() {
+#if QB_CORO_STACK_GUARD
+  static const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  return page_size;
+#else
+  return 0;
+#endif
+}
+
+static void* _stack_acquire() {
+  {
+    std::lock_guard<std::mutex> l(_stack_pool_mu);
+    if (!_stack_pool.empty()) {
+      void* stack = _stack_pool.back();
+      _stack_pool.pop_back();
+      return stack;
+    }
+  }
+
+  /* fails with ENOMEM once the process is out of mappings */
+  void* stack = mmap(nullptr, _guard_size() + QB_CORO_STACK_SIZE,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stack == MAP_FAILED) {
+    return nullptr;
+  }
+  if (_guard_size() > 0 && mprotect(stack, _guard_size(), PROT_NONE) != 0) {
+    munmap(stack, _guard_size() + QB_CORO_STACK_SIZE);
+    return nullptr;
+  }
+  return stack;
+}
+
+static void _stack_release(void* stack) {
+#if defined(__SANITIZE_ADDRESS__)
+  /* a coroutine destroyed mid-run leaves its frames poisoned on the stack */
+  __asan_unpoison_memory_region((char*)stack + _guard_size(),
+                                QB_CORO_STACK_SIZE);
+#endif
+  std::lock_guard<std::mutex> l(_stack_pool_mu);
+  _stack_pool.push_back(stack);
+}
+
+/*
+* Makes "target" the running coroutine, passing it "value". Returns the value
+* passed by whoever switches back into the current coroutine.
+*/
+static qbVar _coro_transfer(Coro target, qbVar value) {
+  Coro self = _cur;
+  target->value = value;
+  _cur = target;
+  _coro_switch(&self->sp, target->sp);
+  return self->value;
+}
+
+/*
+* Runs on the coroutine's own stack. A finished coroutine returns its result
+* to the coroutine that last called it and is never resumed again.
+*/
+static void _coro_main(Coro c) {
+  qbVar ret = c->start(c->value);
+  c->is_done = 1;
+  _coro_transfer(c->parent, ret);
+}
+
+static Coro _coro_create(_entry fn) {
+  void* stack = _stack_acquire();
+  if (!stack) {
+    return nullptr;
+  }
+  Coro c = (Coro)malloc(sizeof(struct _Coro));
+  c->parent = nullptr;
+  c->start = fn;
+  c->stack = stack;
+  c->value = qbNone;
+  c->is_done = 0;
+
+  uintptr_t top = (uintptr_t)c->stack + _guard_size() + QB_CORO_STACK_SIZE;
+  top &= ~(uintptr_t)15;
+  void** frame = (void**)(top - FRAME_SIZE);
+  memset(frame, 0, FRAME_SIZE);
+  _frame_init(frame, c, _coro_main);
+  c->sp = frame;
+  return c;
+}
+
+Coro coro_initialize(void*) {
+  _on_exit.parent = nullptr;
+  _on_exit.start = nullptr;
+  _on_exit.sp = nullptr;
+  _on_exit.stack = nullptr;
+  _on_exit.is_done = 0;
+  _cur = &_on_exit;
+  return _cur;
+}
+
+Coro coro_new(_entry fn) {
+  return _coro_create(fn);
+}
+
+Coro coro_clone(Coro target) {
+  return _coro_create(target->start);
+}
+
+Coro coro_this() {
+  return _cur == &_on_exit ? nullptr : _cur;
+}
+
+int coro_done(Coro c) {
+  return c == &_on_exit ? 0 : c->is_done;
+}
+
+qbVar coro_call(Coro target, qbVar value) {
+  if (target->is_done) {
+    return qbNone;
+  }
+  target->parent = _cur;
+  return _coro_transfer(target, value);
+}
+
+qbVar coro_yield(qbVar var) {
+  if (_cur->parent) {
+    return _coro_transfer(_cur->parent, var);
+  }
+  return qbNone;
+}
+
+void coro_free(Coro c) {
+  if (c->stack != NULL) {
+    _stack_release(c->stack);
+  }
+  free(c);
+}
+
+const char* coro_backend() {
+  return "native";
+}
+
+#else
+
+#include "ctxt.h"
+
 /*
 * These are thresholds used to grow and shrink the stack. They are scaled by
 * the size of various platform constants. STACK_TGROW is sized to allow
@@ -263,4 +562,10 @@ void coro_free(Coro c) {
     free((void *)c->stack_base);
   }
   free(c);
-}
\ No newline at end of file
+}
+
+const char* coro_backend() {
+  return "stack copy";
+}
+
+#endif  // QB_CORO_NATIVE
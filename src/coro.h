@@ -20,17 +20,28 @@
 #define __CORO_H__
 
 /*
-* Portable coroutines for C. Caveats:
+* Coroutines for C. On x86-64 and aarch64 Linux each coroutine runs on its own
+* fixed-size stack and a switch only saves and restores registers. Elsewhere,
+* or if QB_CORO_STACK_COPY is defined, the portable backend copies the stack in
+* and out on every switch. Caveats:
 *
-* 1. You should not take the address of a stack variable, since stack management
-*    could reallocate the stack, the new stack would reference a variable in the
-*    old stack. Also, cloning a coroutine would cause the cloned coroutine to
-*    reference a variable in the other stack.
+* 1. With the portable backend you should not take the address of a stack
+*    variable, since stack management could reallocate the stack, the new stack
+*    would reference a variable in the old stack. Also, cloning a coroutine
+*    would cause the cloned coroutine to reference a variable in the other
+*    stack. Native stacks are QB_CORO_STACK_SIZE bytes and by default have a
+*    guard page, so deep recursion inside a coroutine faults instead of
+*    growing.
 * 2. You must call coro_init for each kernel thread, since there are thread-local
 *    data structures. This will eventually be exploited to scale coroutines across
 *    CPUs.
 * 3. If setjmp/longjmp inspect the jmp_buf structure before executing a jump, this
 *    library probably will not work.
+* 4. Each native stack is its own mapping and the guard page splits it in two.
+*    Linux limits a process to vm.max_map_count mappings (65530 by default),
+*    which caps the live coroutines at roughly 32k with guard pages. Define
+*    QB_CORO_STACK_GUARD as 0 to drop the guard pages and the split, or raise
+*    the limit. Creating a coroutine fails once no stack can be mapped.
 *
 * Refs:
 * http://www.yl.is.s.u-tokyo.ac.jp/sthreads/
@@ -41,6 +52,21 @@
 #include <stdint.h>
 #include <cubez/cubez.h>
 
+#if !defined(QB_CORO_STACK_COPY) && defined(__linux__) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+#define QB_CORO_NATIVE 1
+#endif
+
+/* usable size of a native coroutine stack, not counting the guard page */
+#ifndef QB_CORO_STACK_SIZE
+#define QB_CORO_STACK_SIZE (256 * 1024)
+#endif
+
+/* set to 0 to map native stacks without a guard page */
+#ifndef QB_CORO_STACK_GUARD
+#define QB_CORO_STACK_GUARD 1
+#endif
+
 /* a coroutine handle */
 typedef struct _Coro *Coro;
 
@@ -53,7 +79,8 @@ typedef qbVar(*_entry)(qbVar var);
 Coro coro_initialize(void* local_sp);
 
 /*
-* Create a new coroutine from the given function.
+* Create a new coroutine from the given function. Returns NULL if there is no
+* memory left for its stack.
 */
 Coro coro_new(_entry fn);
 
@@ -80,4 +107,7 @@ int coro_done(Coro c);
 */
 void coro_free(Coro c);
 
+// Returns the name of the backend coroutines were built with.
+const char* coro_backend();
+
 #endif /* __CORO_H__ */
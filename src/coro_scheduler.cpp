@@ -18,7 +18,10 @@
 
 #include "coro_scheduler.h"
 #include "defs.h"
+#include "job_system.h"
 
+#include <cubez/utils.h>
+#include <algorithm>
 #include <shared_mutex>
 
 // Potential optimizations:
@@ -26,43 +29,143 @@
 //  * if there are performance issues with copying large stacks, maybe put the
 //    sync_coro into its thread.
 
-CoroScheduler::CoroScheduler(size_t num_threads) {
-  thread_pool_.reset(new ThreadPool(num_threads));
+namespace {
+
+// The scheduled coroutine being run by "run_sync" or "RunAsync" on this
+// thread.
+thread_local qbCoro running_coro = nullptr;
+
+// Returns the scheduled coroutine that is running, or null if the caller is
+// not one.
+qbCoro RunningCoro() {
+  qbCoro coro = running_coro;
+  return coro && coro_this() == coro->main ? coro : nullptr;
+}
+
+bool IsDone(qbCoro coro) {
+  std::shared_lock<decltype(coro->ret_mu)> l(coro->ret_mu);
+  return coro->ret.tag != QB_TAG_UNSET;
+}
+
+uint64_t NowMs() {
+  return (uint64_t)qb_timer_query() / 1000000;
+}
+
+}  // namespace
+
+CoroScheduler::CoroScheduler() {
   coros_ = new SyncCoros();
+  coros_->scheduler = this;
 
   sync_coro_ = qb_coro_create([](qbVar var) {
     SyncCoros* coro_state = (SyncCoros*)var.p;
 
     for (;;) {
-      for (qbCoro coro : coro_state->coros) {
-        qbVar ret = qb_coro_call(coro, coro->arg);
+      coro_state->scheduler->run_frame();
+      qb_coro_yield(qbNone);
+    }
+
+    return qbNone;
+  });
+}
+
+void CoroScheduler::run_frame() {
+  SyncCoros* coro_state = coros_;
+  auto ready = [coro_state](qbCoro coro) {
+    coro_state->running[coro->priority].PushBack(&coro->node);
+  };
+  auto wake = [&ready](TimerNode* node) {
+    ready((qbCoro)node->data);
+  };
 
-        if (coro_done(coro->main)) {
-          std::unique_lock<decltype(coro->ret_mu)> l;
-          coro->ret = ret;
-          coro_state->delete_coros.push_back(coro);
+  ++coro_state->frame;
+  coro_state->sleeping.Advance(NowMs(), wake);
+  coro_state->waiting.Advance(coro_state->frame, wake);
+  {
+    std::lock_guard<decltype(coro_state->woken_mu)> l(coro_state->woken_mu);
+    for (qbCoro coro : coro_state->woken) {
+      ready(coro);
+    }
+    coro_state->woken.resize(0);
+  }
+  {
+    std::lock_guard<decltype(coro_state->new_coros_mu)> l(coro_state->new_coros_mu);
+    for (SyncCoro& coro : coro_state->new_coros) {
+      coro.coro->main = coro_new(coro.entry);
+      coro.coro->node.data = coro.coro;
+      if (coro.coro->main) {
+        ready(coro.coro);
+      } else {
+        // Coroutines without a stack never run, they finish right away.
+        complete(coro.coro, qbNone);
+      }
+    }
+    coro_state->new_coros.resize(0);
+  }
+
+  // High priority coroutines always run. The others run in order of priority
+  // while the budget lasts, but at least one of each priority runs every
+  // frame so that no priority starves.
+  uint64_t budget = coro_state->budget_ns.load();
+  int64_t start = qb_timer_query();
+  uint64_t spent = 0;
+  uint32_t resumed = 0;
+  TimerList ran[kPriorities];
+  for (size_t p = 0; p < kPriorities; ++p) {
+    TimerList& queue = coro_state->running[p];
+    bool is_budgeted = budget > 0 && p != QB_CORO_PRIORITY_HIGH;
+    uint32_t budgeted = 0;
+    for (TimerNode* node = queue.Front(); node; node = queue.Front()) {
+      if (is_budgeted) {
+        if (budgeted > 0 && spent >= budget) {
+          break;
         }
+        ++budgeted;
       }
+      qbCoro coro = (qbCoro)node->data;
+      node->Unlink();
 
-      for (qbCoro coro : coro_state->delete_coros) {
-        coro_state->coros.erase(
-          std::find(coro_state->coros.begin(), coro_state->coros.end(), coro));
+      int64_t begin = qb_timer_query();
+      running_coro = coro;
+      qbVar ret = coro_call(coro->main, coro->arg);
+      running_coro = nullptr;
+      ++resumed;
+      if (is_budgeted) {
+        spent += (uint64_t)(qb_timer_query() - begin);
       }
-      coro_state->delete_coros.resize(0);
 
-      {
-        std::lock_guard<decltype(coro_state->new_coros_mu)> l(coro_state->new_coros_mu);
-        for (SyncCoro& coro : coro_state->new_coros) {
-          coro.coro->main = coro_new(coro.entry);
-          coro_state->coros.push_back(coro.coro);
-        }
-        coro_state->new_coros.resize(0);
+      if (coro_done(coro->main)) {
+        complete(coro, ret);
+      } else if (coro->wait == qbCoro_::Wait::AWAIT) {
+        parked(coro);
+      } else if (coro->wait == qbCoro_::Wait::TIME) {
+        coro->wait = qbCoro_::Wait::NONE;
+        coro_state->sleeping.Schedule(node, node->deadline);
+      } else if (coro->wait == qbCoro_::Wait::FRAMES) {
+        coro->wait = qbCoro_::Wait::NONE;
+        coro_state->waiting.Schedule(node, node->deadline);
+      } else {
+        ran[coro->priority].PushBack(node);
       }
-      qb_coro_yield(qbNone);
     }
+  }
 
-    return qbNone;
-  });
+  uint32_t deferred = 0;
+  for (size_t p = 0; p < kPriorities; ++p) {
+    TimerList& queue = coro_state->running[p];
+    for (TimerNode* node = queue.Front(); node; node = queue.Next(node)) {
+      ++deferred;
+    }
+    ran[p].Splice(&queue);
+  }
+
+  qbCoroStats_& stats = coro_state->stats;
+  stats.resumed = resumed;
+  stats.deferred = deferred;
+  stats.elapsed = (double)(qb_timer_query() - start) / 1e9;
+  if (budget > 0 && spent > budget) {
+    ++stats.overruns;
+  }
 }
 
 CoroScheduler::~CoroScheduler() {
@@ -92,35 +195,260 @@ qbCoro CoroScheduler::schedule_async(qbVar(*entry)(qbVar), qbVar var) {
   user_coro->ret = qbFuture;
   user_coro->is_async = true;
 
-  thread_pool_->enqueue([user_coro, entry] (qbVar var) {
-    user_coro->main = coro_new(entry);
-    int is_done = false;
-    qbVar ret = qbFuture;
-    do {
-      ret = qb_coro_call(user_coro, var);
-      is_done = coro_done(user_coro->main);
-    } while (!is_done);
+  user_coro->main = nullptr;
+  user_coro->arg = var;
 
-    std::unique_lock<decltype(user_coro->ret_mu)> l;
-    user_coro->ret = ret;
-  }, var);
+  AsyncCoro* async = new AsyncCoro;
+  async->entry = entry;
+  async->coro = user_coro;
+  async->worker = 0;
+  async->scheduler = this;
+  user_coro->task = async;
+  JobSystem::Get()->SubmitBackground(RunAsync, qbVoid(async), nullptr);
 
   return user_coro;
 }
 
+void CoroScheduler::RunAsync(qbVar arg) {
+  AsyncCoro* async = (AsyncCoro*)arg.p;
+  qbCoro user_coro = async->coro;
+  if (!user_coro->main) {
+    user_coro->main = coro_new(async->entry);
+    async->worker = JobSystem::ThreadIndex();
+    if (!user_coro->main) {
+      CoroScheduler* scheduler = async->scheduler;
+      user_coro->task = nullptr;
+      delete async;
+      scheduler->complete(user_coro, qbNone);
+      return;
+    }
+  }
+
+  running_coro = user_coro;
+  qbVar ret = coro_call(user_coro->main, user_coro->arg);
+  running_coro = nullptr;
+
+  // The coroutine is switched out at this point, so it is safe to let any
+  // worker resume it.
+  if (coro_done(user_coro->main)) {
+    // The coroutine may be destroyed as soon as its result is published.
+    CoroScheduler* scheduler = async->scheduler;
+    user_coro->task = nullptr;
+    delete async;
+    scheduler->complete(user_coro, ret);
+  } else if (user_coro->wait == qbCoro_::Wait::AWAIT) {
+    async->scheduler->parked(user_coro);
+  } else {
+    Resume(async);
+  }
+}
+
+void CoroScheduler::Resume(AsyncCoro* async) {
+#ifdef QB_CORO_NATIVE
+  // Yielded coroutines go to the back of the worker's queue, so they take
+  // turns with every other job and idle workers can steal them.
+  JobSystem::Get()->SubmitBackground(RunAsync, qbVoid(async), nullptr);
+#else
+  // The coroutine's stack can only be restored on the thread it started on.
+  JobSystem::Get()->SubmitPinned(async->worker, RunAsync, qbVoid(async));
+#endif
+}
+
 qbVar CoroScheduler::await(qbCoro coro) {
-  qbVar ret = qbFuture;
-  while ((ret = peek(coro)).tag == QB_TAG_UNSET) {
-    if (coro->is_async) {
-      qb_coro_yield(qbFuture);
-    } else if (!coro_done(coro->main)) {
-      // Calling coro_done is thread-safe with a synchronous coroutine because
-      // it is defined to be on the same thread.
-      ret = qb_coro_call(coro, coro->arg);
+  wait_for(&coro, 1, false);
+  return peek(coro);
+}
+
+void CoroScheduler::await_all(qbCoro* coros, size_t count, qbVar* results) {
+  wait_for(coros, count, false);
+  if (results) {
+    for (size_t i = 0; i < count; ++i) {
+      results[i] = peek(coros[i]);
+    }
+  }
+}
+
+qbVar CoroScheduler::await_any(qbCoro* coros, size_t count, size_t* index) {
+  wait_for(coros, count, true);
+  for (size_t i = 0; i < count; ++i) {
+    qbVar ret = peek(coros[i]);
+    if (ret.tag != QB_TAG_UNSET) {
+      if (index) {
+        *index = i;
+      }
+      return ret;
+    }
+  }
+  return qbFuture;
+}
+
+void CoroScheduler::wait_for(qbCoro* coros, size_t count, bool any) {
+  auto is_ready = [=]() {
+    size_t done = 0;
+    for (size_t i = 0; i < count; ++i) {
+      done += IsDone(coros[i]);
+    }
+    return any ? done > 0 || count == 0 : done == count;
+  };
+
+  while (!is_ready()) {
+    // Coroutines that are not scheduled only run when called, so they are
+    // driven from here and the caller has to poll.
+    bool is_driven = false;
+    for (size_t i = 0; i < count; ++i) {
+      qbCoro coro = coros[i];
+      if (!coro->is_async && !coro_done(coro->main)) {
+        qb_coro_call(coro, coro->arg);
+        is_driven = true;
+      }
+    }
+    if (is_driven) {
+      if (!is_ready()) {
+        qb_coro_yield(qbFuture);
+      }
+    } else if (!park(coros, count, any)) {
       qb_coro_yield(qbFuture);
     }
   }
-  return ret;
+}
+
+bool CoroScheduler::park(qbCoro* coros, size_t count, bool any) {
+  qbCoro self = RunningCoro();
+  if (!self) {
+    return false;
+  }
+
+  CoroWaiter* waiter = new CoroWaiter;
+  waiter->coro = self;
+  waiter->pending = any ? 1 : (int)count;
+  waiter->gate = 2;
+  self->awaiting = waiter;
+  self->awaited.assign(coros, coros + count);
+
+  // Coroutines that finish while registering count like any other.
+  bool is_satisfied = false;
+  for (size_t i = 0; i < count && !is_satisfied; ++i) {
+    qbCoro coro = coros[i];
+    std::unique_lock<decltype(coro->ret_mu)> l(coro->ret_mu);
+    if (coro->ret.tag == QB_TAG_UNSET) {
+      coro->waiters.push_back(waiter);
+    } else {
+      is_satisfied = waiter->pending.fetch_sub(1) == 1;
+    }
+  }
+
+  // The scheduler opens the gate once the coroutine is switched out, so it
+  // can't be resumed somewhere else while it is still running.
+  if (!is_satisfied) {
+    self->wait = qbCoro_::Wait::AWAIT;
+    self->waiter = waiter;
+    qb_coro_yield(qbFuture);
+  }
+
+  // Coroutines that are still running must not find the waiter anymore.
+  for (size_t i = 0; i < count; ++i) {
+    qbCoro coro = coros[i];
+    std::unique_lock<decltype(coro->ret_mu)> l(coro->ret_mu);
+    auto found = std::find(coro->waiters.begin(), coro->waiters.end(), waiter);
+    if (found != coro->waiters.end()) {
+      coro->waiters.erase(found);
+    }
+  }
+  self->awaiting = nullptr;
+  self->awaited.clear();
+  delete waiter;
+  return true;
+}
+
+void CoroScheduler::complete(qbCoro coro, qbVar ret) {
+  std::unique_lock<decltype(coro->ret_mu)> l(coro->ret_mu);
+  if (coro->ret.tag != QB_TAG_UNSET) {
+    return;
+  }
+  coro->ret = ret;
+
+  // "pending" can only reach zero once, after that it keeps going down.
+  for (CoroWaiter* waiter : coro->waiters) {
+    if (waiter->pending.fetch_sub(1) == 1 && waiter->gate.fetch_sub(1) == 1) {
+      wake(waiter->coro);
+    }
+  }
+  coro->waiters.clear();
+}
+
+void CoroScheduler::parked(qbCoro coro) {
+  // The coroutine may be resumed right after the gate opens, so it is not
+  // touched after that unless it is this call that wakes it.
+  CoroWaiter* waiter = coro->waiter;
+  coro->waiter = nullptr;
+  coro->wait = qbCoro_::Wait::NONE;
+  if (waiter->gate.fetch_sub(1) == 1) {
+    wake(coro);
+  }
+}
+
+void CoroScheduler::wake(qbCoro coro) {
+  if (coro->task) {
+    Resume((AsyncCoro*)coro->task);
+    return;
+  }
+  std::lock_guard<decltype(coros_->woken_mu)> l(coros_->woken_mu);
+  coros_->woken.push_back(coro);
+}
+
+bool CoroScheduler::sleep_until(double seconds) {
+  qbCoro coro = RunningCoro();
+  if (!coro || coro->task) {
+    return false;
+  }
+  coro->wait = qbCoro_::Wait::TIME;
+  coro->node.deadline = (uint64_t)(seconds * 1e3) + 1;
+  qb_coro_yield(qbFuture);
+  return true;
+}
+
+bool CoroScheduler::sleep_frames(uint32_t frames) {
+  qbCoro coro = RunningCoro();
+  if (!coro || coro->task) {
+    return false;
+  }
+  coro->wait = qbCoro_::Wait::FRAMES;
+  coro->node.deadline = coros_->frame + frames;
+  qb_coro_yield(qbFuture);
+  return true;
+}
+
+void CoroScheduler::cancel(qbCoro coro) {
+  coro->node.Unlink();
+
+  // A coroutine parked on an await never returns from it, so its waiter is
+  // taken back here. Once it is gone from every awaited coroutine no
+  // completion can wake the coroutine anymore, the ones that already did
+  // are dropped from "woken" below.
+  if (CoroWaiter* waiter = coro->awaiting) {
+    for (qbCoro awaited : coro->awaited) {
+      std::unique_lock<decltype(awaited->ret_mu)> l(awaited->ret_mu);
+      auto& waiters = awaited->waiters;
+      waiters.erase(std::remove(waiters.begin(), waiters.end(), waiter),
+                    waiters.end());
+    }
+    coro->awaiting = nullptr;
+    coro->awaited.clear();
+    coro->waiter = nullptr;
+    delete waiter;
+  }
+  {
+    std::lock_guard<decltype(coros_->new_coros_mu)> l(coros_->new_coros_mu);
+    auto& new_coros = coros_->new_coros;
+    new_coros.erase(std::remove_if(new_coros.begin(), new_coros.end(),
+                                   [coro](const SyncCoro& c) { return c.coro == coro; }),
+                    new_coros.end());
+  }
+  {
+    std::lock_guard<decltype(coros_->woken_mu)> l(coros_->woken_mu);
+    auto& woken = coros_->woken;
+    woken.erase(std::remove(woken.begin(), woken.end(), coro), woken.end());
+  }
 }
 
 qbVar CoroScheduler::peek(qbCoro coro) {
@@ -128,6 +456,14 @@ qbVar CoroScheduler::peek(qbCoro coro) {
   return coro->ret;
 }
 
+void CoroScheduler::set_budget(double seconds) {
+  coros_->budget_ns = seconds > 0 ? (uint64_t)(seconds * 1e9) : 0;
+}
+
+qbCoroStats_ CoroScheduler::stats() const {
+  return coros_->stats;
+}
+
 void CoroScheduler::run_sync() {
   qb_coro_call(sync_coro_, qbVoid(coros_));
 }
\ No newline at end of file
@@ -20,24 +20,71 @@
 #define CORO_SCHEDULER__H
 
 #include <cubez/cubez.h>
+#include "timer_wheel.h"
 
-#include "thread_pool.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// A scheduled coroutine parked until enough of the coroutines it awaits are
+// done. "pending" counts the completions still needed. "gate" is released
+// once by the scheduler after the coroutine is switched out and once by the
+// completion that brings "pending" to zero, whoever is last wakes the
+// coroutine.
+struct CoroWaiter {
+  qbCoro coro;
+  std::atomic<int> pending;
+  std::atomic<int> gate;
+};
 
 class CoroScheduler {
 public:
-  CoroScheduler(size_t num_threads);
+  CoroScheduler();
   ~CoroScheduler();
 
   qbCoro schedule_sync(qbVar(*entry)(qbVar), qbVar var);
 
-  // Creates a coroutine and schedules the given function to be run on a
-  // background thread. Thread-safe.
+  // Creates a coroutine and schedules the given function to be run on a job
+  // worker. Every time it yields it is queued again and may be resumed by any
+  // worker. With the stack-copying coroutine backend it is always resumed on
+  // the worker it started on. Thread-safe.
   qbCoro schedule_async(qbVar(*entry)(qbVar), qbVar var);
 
   qbVar await(qbCoro coro);
 
+  // Waits until all coroutines are done and writes their results to
+  // "results" if it is not null.
+  void await_all(qbCoro* coros, size_t count, qbVar* results);
+
+  // Waits until one of the coroutines is done and returns its result. Writes
+  // its index to "index" if it is not null.
+  qbVar await_any(qbCoro* coros, size_t count, size_t* index);
+
   qbVar peek(qbCoro coro);
 
+  // Publishes the result of a finished coroutine and wakes the coroutines
+  // awaiting it. Only the first call for a coroutine has an effect.
+  // Thread-safe.
+  void complete(qbCoro coro, qbVar ret);
+
+  // Parks the calling sync coroutine until "seconds" on the "qb_timer_query"
+  // clock or until "frames" more frames ran. Returns false without waiting if
+  // the caller is not a coroutine scheduled with "schedule_sync".
+  bool sleep_until(double seconds);
+  bool sleep_frames(uint32_t frames);
+
+  // Stops resuming a sync coroutine before it is destroyed, whether it has
+  // not started yet, is ready, is sleeping or is parked on an await. Must be
+  // called on the main thread and not by the coroutine itself.
+  void cancel(qbCoro coro);
+
+  // Limits the time spent resuming sync coroutines that are not high
+  // priority each frame. 0 means no limit. Thread-safe.
+  void set_budget(double seconds);
+
+  // Returns the stats of the last frame and the overruns so far.
+  qbCoroStats_ stats() const;
+
   void run_sync();
 
 private:
@@ -46,15 +93,65 @@ private:
     qbCoro coro;
   };
 
+  struct AsyncCoro {
+    qbVar(*entry)(qbVar);
+    qbCoro coro;
+
+    // The worker the coroutine started on.
+    size_t worker;
+    CoroScheduler* scheduler;
+  };
+
+  // Runs the coroutine until it yields.
+  static void RunAsync(qbVar arg);
+
+  // Queues an async coroutine to be run by a worker.
+  static void Resume(AsyncCoro* async);
+
+  // Called once a coroutine that parked on a waiter is switched out. Wakes
+  // it if its waiter was already satisfied.
+  void parked(qbCoro coro);
+
+  // Waits until one or all of the coroutines are done. Scheduled callers are
+  // parked, anything else polls.
+  void wait_for(qbCoro* coros, size_t count, bool any);
+
+  // Parks the running scheduled coroutine until one or all of the
+  // coroutines are done. Returns false if the caller can not be parked.
+  bool park(qbCoro* coros, size_t count, bool any);
+
+  // Resumes a parked coroutine where it was scheduled. Thread-safe.
+  void wake(qbCoro coro);
+
+  // Resumes the ready sync coroutines by priority until the budget runs out.
+  void run_frame();
+
+  static const size_t kPriorities = QB_CORO_PRIORITY_LOW + 1;
+
+  // Only coroutines that are ready are in "running", one queue per priority.
+  // Coroutines that ran go to the back of their queue, the ones the budget
+  // left out stay in front for the next frame. Waiting ones are parked on
+  // "sleeping" in milliseconds or on "waiting" in frames and cost nothing
+  // until they are due.
   struct SyncCoros {
-    std::vector<qbCoro> coros;
-    std::vector<qbCoro> delete_coros;
+    TimerList running[kPriorities];
+    TimerWheel sleeping;
+    TimerWheel waiting;
+    uint64_t frame = 0;
 
     std::mutex new_coros_mu;
     std::vector<SyncCoro> new_coros;
+
+    CoroScheduler* scheduler;
+
+    // Parked coroutines that were woken, run from the next frame on.
+    std::mutex woken_mu;
+    std::vector<qbCoro> woken;
+
+    std::atomic<uint64_t> budget_ns{ 0 };
+    qbCoroStats_ stats = {};
   };
 
-  std::unique_ptr<ThreadPool> thread_pool_;
   SyncCoros* coros_;
   qbCoro sync_coro_;
 };
@@ -27,6 +27,7 @@
 #include "system_impl.h"
 #include "utils_internal.h"
 #include "coro_scheduler.h"
+#include "job_system.h"
 #include "input_internal.h"
 #include "log_internal.h"
 #include "render_internal.h"
@@ -65,7 +66,7 @@ qbResult qb_init(qbUniverse* u, qbUniverseAttr attr) {
   coro_main = coro_initialize(u);
   
   universe_->self = new PrivateUniverse();
-  coro_scheduler = new CoroScheduler(4);
+  coro_scheduler = new CoroScheduler();
 
   qbResult ret = AS_PRIVATE(init());
 
@@ -241,11 +242,22 @@ qbResult qb_system_disable(qbSystem system) {
   return AS_PRIVATE(disable_system(system));
 }
 
+size_t qb_system_workercount(qbSystem system) {
+  return AS_PRIVATE(system_workercount(system));
+}
+
+void* qb_system_scratch(qbSystem system, size_t worker) {
+  return AS_PRIVATE(system_scratch(system, worker));
+}
+
 qbResult qb_componentattr_create(qbComponentAttr* attr) {
   *attr = (qbComponentAttr)calloc(1, sizeof(qbComponentAttr_));
   new (*attr) qbComponentAttr_;
   (*attr)->is_shared = false;
   (*attr)->type = qbComponentType::QB_COMPONENT_TYPE_RAW;
+  (*attr)->storage = qbComponentStorage::QB_COMPONENT_STORAGE_SPARSE;
+  (*attr)->is_tag = false;
+  (*attr)->is_buffered = false;
 	return qbResult::QB_OK;
 }
 
@@ -265,11 +277,30 @@ qbResult qb_componentattr_settype(qbComponentAttr attr, qbComponentType type) {
 	return qbResult::QB_OK;
 }
 
+qbResult qb_componentattr_setbuffered(qbComponentAttr attr) {
+  attr->is_shared = true;
+  attr->is_buffered = true;
+  attr->storage = qbComponentStorage::QB_COMPONENT_STORAGE_SPARSE;
+  return qbResult::QB_OK;
+}
+
 qbResult qb_componentattr_setshared(qbComponentAttr attr) {
   attr->is_shared = true;
   return qbResult::QB_OK;
 }
 
+qbResult qb_componentattr_setstorage(qbComponentAttr attr,
+                                     qbComponentStorage storage) {
+  attr->storage = storage;
+  return qbResult::QB_OK;
+}
+
+qbResult qb_componentattr_settag(qbComponentAttr attr) {
+  attr->data_size = 0;
+  attr->is_tag = true;
+  return qbResult::QB_OK;
+}
+
 qbResult qb_component_create(
     qbComponent* component, qbComponentAttr attr) {
   return AS_PRIVATE(component_create(component, attr));
@@ -309,10 +340,29 @@ qbResult qb_entity_destroy(qbEntity entity) {
   return AS_PRIVATE(entity_destroy(entity));
 }
 
+qbResult qb_entity_createbatch(size_t count, qbEntityAttr attr,
+                               qbEntity* entities) {
+  return AS_PRIVATE(entity_createbatch(count, *attr, entities));
+}
+
+qbResult qb_entity_destroybatch(const qbEntity* entities, size_t count) {
+  return AS_PRIVATE(entity_destroybatch(entities, count));
+}
+
 bool qb_entity_hascomponent(qbEntity entity, qbComponent component) {
   return AS_PRIVATE(entity_hascomponent(entity, component));
 }
 
+bool qb_entity_hasall(qbEntity entity, const qbComponent* components,
+                      size_t count) {
+  return AS_PRIVATE(entity_hasall(entity, components, count));
+}
+
+bool qb_entity_hasany(qbEntity entity, const qbComponent* components,
+                      size_t count) {
+  return AS_PRIVATE(entity_hasany(entity, components, count));
+}
+
 qbResult qb_entity_addcomponent(qbEntity entity, qbComponent component,
                                 void* instance_data) {
   return AS_PRIVATE(entity_addcomponent(entity, component, instance_data));
@@ -365,11 +415,31 @@ qbResult qb_systemattr_addmutable(qbSystemAttr attr, qbComponent component) {
 	return qbResult::QB_OK;
 }
 
+qbResult qb_systemattr_addwith(qbSystemAttr attr, qbComponent component) {
+  attr->with.push_back(component);
+  return qbResult::QB_OK;
+}
+
+qbResult qb_systemattr_addwithout(qbSystemAttr attr, qbComponent component) {
+  attr->without.push_back(component);
+  return qbResult::QB_OK;
+}
+
+qbResult qb_systemattr_addoptional(qbSystemAttr attr, qbComponent component) {
+  attr->optional.push_back(component);
+  return qbResult::QB_OK;
+}
+
 qbResult qb_systemattr_setfunction(qbSystemAttr attr, qbTransformFn transform) {
   attr->transform = transform;
 	return qbResult::QB_OK;
 }
 
+qbResult qb_systemattr_setbatchfunction(qbSystemAttr attr, qbBatchFn batch) {
+  attr->batch = batch;
+  return qbResult::QB_OK;
+}
+
 qbResult qb_systemattr_setcallback(qbSystemAttr attr, qbCallbackFn callback) {
   attr->callback = callback;
 	return qbResult::QB_OK;
@@ -401,6 +471,16 @@ qbResult qb_systemattr_setuserstate(qbSystemAttr attr, void* state) {
 	return qbResult::QB_OK;
 }
 
+qbResult qb_systemattr_setparallel(qbSystemAttr attr, size_t grain_size) {
+  attr->grain_size = grain_size;
+  return qbResult::QB_OK;
+}
+
+qbResult qb_systemattr_setscratch(qbSystemAttr attr, size_t size) {
+  attr->scratch_size = size;
+  return qbResult::QB_OK;
+}
+
 qbResult qb_systemattr_addbarrier(qbSystemAttr attr,
                                   qbBarrier barrier) {
   qbTicket_* t = new qbTicket_;
@@ -412,12 +492,37 @@ qbResult qb_systemattr_addbarrier(qbSystemAttr attr,
   return QB_OK;
 }
 
+qbResult qb_systemattr_runbefore(qbSystemAttr attr, qbSystem system) {
+  attr->before.push_back(system);
+  return qbResult::QB_OK;
+}
+
+qbResult qb_systemattr_runafter(qbSystemAttr attr, qbSystem system) {
+  attr->after.push_back(system);
+  return qbResult::QB_OK;
+}
+
+qbResult qb_systemattr_setconcurrent(qbSystemAttr attr) {
+  attr->concurrent = true;
+  return qbResult::QB_OK;
+}
+
+qbResult qb_systemattr_batchevents(qbSystemAttr attr) {
+  attr->batch_events = true;
+  return qbResult::QB_OK;
+}
+
+qbResult qb_systemattr_changedsince(qbSystemAttr attr, qbComponent component) {
+  attr->changed.push_back(component);
+  return qbResult::QB_OK;
+}
+
 qbResult qb_system_create(qbSystem* system, qbSystemAttr attr) {
   if (!attr->program) {
     attr->program = 0;
   }
 #ifdef __ENGINE_DEBUG__
-  DEBUG_ASSERT(attr->transform || attr->callback,
+  DEBUG_ASSERT(attr->transform || attr->batch || attr->callback,
                qbResult::QB_ERROR_SYSTEMATTR_HAS_FUNCTION_OR_CALLBACK);
 #endif
   AS_PRIVATE(system_create(system, *attr));
@@ -450,6 +555,12 @@ qbResult qb_eventattr_setmessagesize(qbEventAttr attr, size_t size) {
 	return qbResult::QB_OK;
 }
 
+qbResult qb_eventattr_setentityfield(qbEventAttr attr, size_t offset) {
+  attr->has_entity = true;
+  attr->entity_offset = offset;
+  return qbResult::QB_OK;
+}
+
 qbResult qb_event_create(qbEvent* event, qbEventAttr attr) {
   if (!attr->program) {
     attr->program = 0;
@@ -481,6 +592,14 @@ qbResult qb_event_send(qbEvent event, void* message) {
   return AS_PRIVATE(event_send(event, message));
 }
 
+void* qb_event_alloc(qbEvent event) {
+  return AS_PRIVATE(event_alloc(event));
+}
+
+qbResult qb_event_commit(qbEvent event, void* message) {
+  return AS_PRIVATE(event_commit(event, message));
+}
+
 qbResult qb_event_sendsync(qbEvent event, void* message) {
   return AS_PRIVATE(event_sendsync(event, message));
 }
@@ -519,22 +638,78 @@ qbResult qb_instance_find(qbComponent component, qbEntity entity, void* pbuffer)
   return AS_PRIVATE(instance_find(component, entity, pbuffer));
 }
 
+qbResult qb_job_submit(qbJobFn fn, qbVar arg, qbJobGroup group) {
+  JobSystem::Get()->Submit(fn, arg, group);
+  return QB_OK;
+}
+
+qbResult qb_job_then(qbJobGroup after, qbJobFn fn, qbVar arg, qbJobGroup group) {
+  JobSystem::Get()->Then(after, fn, arg, group);
+  return QB_OK;
+}
+
+qbResult qb_job_parallelfor(size_t count, size_t grain_size, qbJobRangeFn fn,
+                            qbVar arg) {
+  JobSystem::Get()->ParallelFor(count, grain_size,
+    [fn, arg](size_t begin, size_t end) { fn(begin, end, arg); });
+  return QB_OK;
+}
+
+size_t qb_job_workercount() {
+  return JobSystem::Get()->WorkerCount();
+}
+
+qbResult qb_jobgroup_create(qbJobGroup* group) {
+  *group = new qbJobGroup_;
+  return QB_OK;
+}
+
+qbResult qb_jobgroup_destroy(qbJobGroup* group) {
+  delete *group;
+  *group = nullptr;
+  return QB_OK;
+}
+
+qbResult qb_jobgroup_wait(qbJobGroup group) {
+  JobSystem::Get()->Wait(group);
+  return QB_OK;
+}
+
+bool qb_jobgroup_done(qbJobGroup group) {
+  return group->Done();
+}
+
 qbCoro qb_coro_create(qbVar(*entry)(qbVar var)) {
+  Coro main = coro_new(entry);
+  if (!main) {
+    return nullptr;
+  }
   qbCoro ret = new qbCoro_();
   ret->ret = qbFuture;
-  ret->main = coro_new(entry);
+  ret->main = main;
   return ret;
 }
 
 qbCoro qb_coro_copy(qbCoro coro) {
+  Coro main = coro_clone(coro->main);
+  if (!main) {
+    return nullptr;
+  }
   qbCoro ret = new qbCoro_();
   ret->ret = qbFuture;
-  ret->main = coro_clone(coro->main);
+  ret->main = main;
   return ret;
 }
 
 qbResult qb_coro_destroy(qbCoro* coro) {
-  coro_free((*coro)->main);
+  // Coroutines from qb_coro_sync may still be queued or sleeping. Ones that
+  // never started have no stack yet.
+  if (!(*coro)->task) {
+    coro_scheduler->cancel(*coro);
+  }
+  if ((*coro)->main) {
+    coro_free((*coro)->main);
+  }
   delete *coro;
   *coro = nullptr;
   return QB_OK;
@@ -542,13 +717,32 @@ qbResult qb_coro_destroy(qbCoro* coro) {
 
 qbVar qb_coro_call(qbCoro coro, qbVar var) {
   coro->arg = var;
-  return coro_call(coro->main, var);
+  qbVar ret = coro_call(coro->main, var);
+  if (coro_done(coro->main)) {
+    coro_scheduler->complete(coro, ret);
+  }
+  return ret;
 }
 
 qbCoro qb_coro_sync(qbVar(*entry)(qbVar), qbVar var) {
   return coro_scheduler->schedule_sync(entry, var);
 }
 
+qbResult qb_coro_setpriority(qbCoro coro, qbCoroPriority priority) {
+  coro->priority = priority;
+  return QB_OK;
+}
+
+qbResult qb_coro_setbudget(double seconds) {
+  coro_scheduler->set_budget(seconds);
+  return QB_OK;
+}
+
+qbResult qb_coro_stats(qbCoroStats stats) {
+  *stats = coro_scheduler->stats();
+  return QB_OK;
+}
+
 qbCoro qb_coro_async(qbVar(*entry)(qbVar), qbVar var) {
   return coro_scheduler->schedule_async(entry, var);
 }
@@ -557,6 +751,14 @@ qbVar qb_coro_await(qbCoro coro) {
   return coro_scheduler->await(coro);
 }
 
+void qb_coro_awaitall(qbCoro* coros, size_t count, qbVar* results) {
+  coro_scheduler->await_all(coros, count, results);
+}
+
+qbVar qb_coro_awaitany(qbCoro* coros, size_t count, size_t* index) {
+  return coro_scheduler->await_any(coros, count, index);
+}
+
 qbVar qb_coro_peek(qbCoro coro) {
   return coro_scheduler->peek(coro);
 }
@@ -571,12 +773,21 @@ void qb_coro_wait(double seconds) {
   }
   double start = (double)qb_timer_query() / 1e9;
   double end = start + seconds;
+
+  // Scheduled sync coroutines are parked until they are due, anything else
+  // polls.
+  if (coro_scheduler->sleep_until(end)) {
+    return;
+  }
   while ((double)qb_timer_query() / 1e9 < end) {
     qb_coro_yield(qbFuture);
   }
 }
 
 void qb_coro_waitframes(uint32_t frames) {
+  if (frames == 0 || coro_scheduler->sleep_frames(frames)) {
+    return;
+  }
   volatile uint32_t frames_waited = 0;
   while (frames_waited < frames) {
     qb_coro_yield(qbFuture);
@@ -23,6 +23,7 @@
 #include "component.h"
 #include "sparse_map.h"
 #include "coro.h"
+#include "timer_wheel.h"
 
 #include <vector>
 #include <functional>
@@ -42,23 +43,65 @@ struct qbScene_ {
   std::vector<void*> values;
 };
 
+struct CoroWaiter;
+
 struct qbCoro_ {
   Coro main;
 
   bool is_async;
+
+  // Guards "ret" and "waiters". "ret" is "qbFuture" until the coroutine is
+  // done.
   std::shared_mutex ret_mu;
   qbVar ret;
   qbVar arg;
+
+  // Coroutines parked until this one is done. Each is woken once.
+  std::vector<CoroWaiter*> waiters;
+
+  // Resumes the coroutine on its worker if it was scheduled with
+  // "qb_coro_async", null otherwise.
+  void* task = nullptr;
+
+  // What the coroutine is parked on while "wait" is AWAIT.
+  CoroWaiter* waiter = nullptr;
+
+  // The waiter of a scheduled coroutine in one of the awaits and the
+  // coroutines it is registered with, kept until the await returns.
+  CoroWaiter* awaiting = nullptr;
+  std::vector<qbCoro> awaited;
+
+  // Links a scheduled sync coroutine into the scheduler's run list or one of
+  // its wait queues. "data" points back to the coroutine.
+  TimerNode node;
+
+  // Which run queue a sync coroutine goes back to after it is resumed.
+  qbCoroPriority priority = QB_CORO_PRIORITY_NORMAL;
+
+  // Set by a scheduled coroutine before it yields to be parked. Sync
+  // coroutines can wait until "node.deadline", in milliseconds or frames. Any
+  // scheduled coroutine can wait on a "CoroWaiter".
+  enum class Wait : uint8_t {
+    NONE,
+    TIME,
+    FRAMES,
+    AWAIT,
+  };
+  Wait wait = Wait::NONE;
 };
 
+// Sent once per component for all instances created at the same time.
 struct qbInstanceOnCreateEvent_ {
-  qbId entity;
+  const qbEntity* entities;
+  size_t count;
   Component* component;
   class GameState* state;
 };
 
+// Sent once per component for all instances destroyed at the same time.
 struct qbInstanceOnDestroyEvent_ {
-  qbId entity;
+  const qbEntity* entities;
+  size_t count;
   Component* component;
   class GameState* state;
 };
@@ -68,6 +111,9 @@ struct qbComponentAttr_ {
   size_t data_size;
   bool is_shared;
   qbComponentType type;
+  qbComponentStorage storage;
+  bool is_tag;
+  bool is_buffered;
 };
 
 struct qbBarrier_ {
@@ -84,6 +130,7 @@ struct qbSystemAttr_ {
   qbId program;
   
   qbTransformFn transform;
+  qbBatchFn batch;
   qbCallbackFn callback;
   qbConditionFn condition;
 
@@ -93,10 +140,23 @@ struct qbSystemAttr_ {
   void* state;
   qbComponentJoin join;
 
+  size_t grain_size;
+  size_t scratch_size;
+
   std::vector<qbComponent> constants;
   std::vector<qbComponent> mutables;
   std::vector<qbComponent> components;
+  std::vector<qbComponent> with;
+  std::vector<qbComponent> without;
+  std::vector<qbComponent> optional;
   std::vector<qbTicket_*> tickets;
+
+  std::vector<qbSystem> before;
+  std::vector<qbSystem> after;
+  bool concurrent;
+  bool batch_events;
+
+  std::vector<qbComponent> changed;
 };
 
 enum qbIndexedBy {
@@ -133,7 +193,7 @@ struct qbEntityAttr_ {
 };
 
 struct qbInstance_ {
-  qbInstance_(bool is_mutable = false) : is_mutable(is_mutable) {};
+  qbInstance_(bool is_mutable = false) : is_touched(false), is_mutable(is_mutable) {};
 
   qbSystem system;
   Component* component;
@@ -141,12 +201,18 @@ struct qbInstance_ {
   void* data;
   class GameState* state;
 
+  // True if the system already stamped the instance's block as changed.
+  bool is_touched;
   const bool is_mutable;
 };
 
 struct qbEventAttr_ {
   qbId program;
   size_t message_size;
+
+  // Offset of the target qbEntity in the message, if "has_entity" is set.
+  bool has_entity;
+  size_t entity_offset;
 };
 
 struct qbEvent_ {
@@ -0,0 +1,120 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef ENTITY_BITSET__H
+#define ENTITY_BITSET__H
+
+#include <cubez/cubez.h>
+#include "entity_id_allocator.h"
+
+#include <algorithm>
+#include <vector>
+
+// A set of entities stored as one bit per entity index. The generation of the
+// handle is not stored, so the owner has to clear an entity's bit before its
+// index is reused.
+// Not thread-safe.
+class EntityBitset {
+ public:
+  EntityBitset() : count_(0) {}
+
+  void Set(qbEntity entity) {
+    uint32_t index = EntityIndex(entity);
+    size_t word = index >> 6;
+    if (word >= words_.size()) {
+      words_.resize(word + 1, 0);
+    }
+    uint64_t bit = 1ULL << (index & 63);
+    count_ += (words_[word] & bit) == 0;
+    words_[word] |= bit;
+  }
+
+  void Reset(qbEntity entity) {
+    uint32_t index = EntityIndex(entity);
+    size_t word = index >> 6;
+    if (word < words_.size()) {
+      uint64_t bit = 1ULL << (index & 63);
+      count_ -= (words_[word] & bit) != 0;
+      words_[word] &= ~bit;
+    }
+  }
+
+  bool Test(qbEntity entity) const {
+    uint32_t index = EntityIndex(entity);
+    size_t word = index >> 6;
+    return word < words_.size() && (words_[word] >> (index & 63)) & 1;
+  }
+
+  // Adds all entities in "other".
+  void Merge(const EntityBitset& other) {
+    if (other.words_.size() > words_.size()) {
+      words_.resize(other.words_.size(), 0);
+    }
+    count_ = 0;
+    for (size_t i = 0; i < words_.size(); ++i) {
+      if (i < other.words_.size()) {
+        words_[i] |= other.words_[i];
+      }
+      count_ += __builtin_popcountll(words_[i]);
+    }
+  }
+
+  // Number of entities in the set.
+  size_t Count() const {
+    return count_;
+  }
+
+  size_t Words() const {
+    return words_.size();
+  }
+
+  uint64_t Word(size_t i) const {
+    return i < words_.size() ? words_[i] : 0;
+  }
+
+  // Calls "fn(word, bits)" for every non-zero word of the intersection of all
+  // sets in "with" minus the union of all sets in "without". "with" must not
+  // be empty. Bit "i" of word "w" stands for entity index "w * 64 + i".
+  template<class Fn_>
+  static void ForEachWord(const std::vector<const EntityBitset*>& with,
+                          const std::vector<const EntityBitset*>& without,
+                          Fn_ fn) {
+    size_t words = with[0]->Words();
+    for (const EntityBitset* set : with) {
+      words = std::min(words, set->Words());
+    }
+    for (size_t w = 0; w < words; ++w) {
+      uint64_t bits = ~0ULL;
+      for (const EntityBitset* set : with) {
+        bits &= set->words_[w];
+      }
+      for (const EntityBitset* set : without) {
+        bits &= ~set->Word(w);
+      }
+      if (bits) {
+        fn(w, bits);
+      }
+    }
+  }
+
+ private:
+  std::vector<uint64_t> words_;
+  size_t count_;
+};
+
+#endif  // ENTITY_BITSET__H
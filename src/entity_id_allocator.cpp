@@ -0,0 +1,178 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "entity_id_allocator.h"
+
+#include <cstdlib>
+
+namespace
+{
+
+// A block of never-used indices reserved by one thread.
+struct IdBlock {
+  uint64_t owner;
+  uint32_t next;
+  uint32_t end;
+};
+
+const size_t kCachedBlocks = 4;
+thread_local IdBlock cached_blocks[kCachedBlocks];
+
+std::atomic<uint64_t> next_uid(1);
+
+const uint64_t kTagIncrement = 1ULL << 32;
+
+}  // namespace
+
+EntityIdAllocator::EntityIdAllocator()
+    : uid_(next_uid++), free_head_(0xFFFFFFFF), next_index_(0) {
+  pages_ = (std::atomic<Slot*>*)calloc(kPageCount, sizeof(std::atomic<Slot*>));
+}
+
+EntityIdAllocator::~EntityIdAllocator() {
+  for (uint32_t i = 0; i < kPageCount; ++i) {
+    free(pages_[i].load());
+  }
+  free(pages_);
+}
+
+void EntityIdAllocator::CopyFrom(const EntityIdAllocator& other) {
+  for (uint32_t i = 0; i < kPageCount; ++i) {
+    Slot* page = other.pages_[i].load();
+    if (page) {
+      Slot* copy = pages_[i].load();
+      if (!copy) {
+        copy = (Slot*)calloc(kPageSize, sizeof(Slot));
+        pages_[i] = copy;
+      }
+      for (uint32_t j = 0; j < kPageSize; ++j) {
+        copy[j].generation.store(page[j].generation.load());
+        copy[j].next.store(page[j].next.load());
+      }
+    }
+  }
+  free_head_.store(other.free_head_.load());
+  next_index_.store(other.next_index_.load());
+}
+
+qbEntity EntityIdAllocator::Allocate() {
+  uint32_t index;
+  if (!Pop(&index)) {
+    IdBlock* block = nullptr;
+    for (size_t i = 0; i < kCachedBlocks; ++i) {
+      if (cached_blocks[i].owner == uid_) {
+        block = &cached_blocks[i];
+        break;
+      }
+    }
+
+    if (!block || block->next == block->end) {
+      // Evict the first block of another allocator. Its remaining indices
+      // are never handed out.
+      if (!block) {
+        block = &cached_blocks[0];
+        for (size_t i = 0; i < kCachedBlocks; ++i) {
+          if (cached_blocks[i].next == cached_blocks[i].end) {
+            block = &cached_blocks[i];
+            break;
+          }
+        }
+      }
+      block->owner = uid_;
+      block->next = next_index_.fetch_add(kBlockSize);
+      block->end = block->next + kBlockSize;
+      DEBUG_ASSERT(block->end > block->next, QB_ERROR_OUT_OF_MEMORY);
+    }
+    index = block->next++;
+  }
+
+  return MakeEntity(index, GetSlot(index)->generation.fetch_add(1) + 1);
+}
+
+bool EntityIdAllocator::Free(qbEntity entity) {
+  uint32_t index = EntityIndex(entity);
+  Slot* slot = GetSlot(index);
+  uint32_t generation = EntityGeneration(entity);
+  if ((generation & 1) == 0 ||
+      !slot->generation.compare_exchange_strong(generation, generation + 1)) {
+    return false;
+  }
+  Push(index);
+  return true;
+}
+
+bool EntityIdAllocator::IsValid(qbEntity entity) const {
+  // Indices that were reserved but never handed out still have an even
+  // generation.
+  const Slot* slot = FindSlot(EntityIndex(entity));
+  uint32_t generation = EntityGeneration(entity);
+  return slot && (generation & 1) && slot->generation.load() == generation;
+}
+
+qbEntity EntityIdAllocator::Handle(uint32_t index) const {
+  const Slot* slot = FindSlot(index);
+  return MakeEntity(index, slot ? slot->generation.load() : 0);
+}
+
+EntityIdAllocator::Slot* EntityIdAllocator::GetSlot(uint32_t index) {
+  std::atomic<Slot*>& page = pages_[index >> kPageBits];
+  Slot* p = page.load(std::memory_order_acquire);
+  if (!p) {
+    Slot* new_page = (Slot*)calloc(kPageSize, sizeof(Slot));
+    if (page.compare_exchange_strong(p, new_page, std::memory_order_acq_rel)) {
+      p = new_page;
+    } else {
+      free(new_page);
+    }
+  }
+  return &p[index & (kPageSize - 1)];
+}
+
+const EntityIdAllocator::Slot* EntityIdAllocator::FindSlot(
+    uint32_t index) const {
+  Slot* p = pages_[index >> kPageBits].load(std::memory_order_acquire);
+  return p ? &p[index & (kPageSize - 1)] : nullptr;
+}
+
+bool EntityIdAllocator::Pop(uint32_t* index) {
+  uint64_t head = free_head_.load(std::memory_order_acquire);
+  while ((uint32_t)head != kNone) {
+    uint32_t top = (uint32_t)head;
+    uint32_t next = GetSlot(top)->next.load(std::memory_order_relaxed);
+    uint64_t new_head = ((head & ~0xFFFFFFFFULL) + kTagIncrement) | next;
+    if (free_head_.compare_exchange_weak(head, new_head,
+                                         std::memory_order_acq_rel,
+                                         std::memory_order_acquire)) {
+      *index = top;
+      return true;
+    }
+  }
+  return false;
+}
+
+void EntityIdAllocator::Push(uint32_t index) {
+  Slot* slot = GetSlot(index);
+  uint64_t head = free_head_.load(std::memory_order_relaxed);
+  uint64_t new_head;
+  do {
+    slot->next.store((uint32_t)head, std::memory_order_relaxed);
+    new_head = ((head & ~0xFFFFFFFFULL) + kTagIncrement) | index;
+  } while (!free_head_.compare_exchange_weak(head, new_head,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+}
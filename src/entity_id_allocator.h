@@ -0,0 +1,102 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef ENTITY_ID_ALLOCATOR__H
+#define ENTITY_ID_ALLOCATOR__H
+
+#include <cubez/cubez.h>
+
+#include <atomic>
+
+// A qbEntity is a 32-bit index in the low bits and a 32-bit generation in the
+// high bits. The generation is bumped every time the index is allocated and
+// every time it is freed, so it is odd while the index is in use and stale
+// handles never alias a newer entity.
+inline uint32_t EntityIndex(qbEntity entity) {
+  return (uint32_t)entity;
+}
+
+inline uint32_t EntityGeneration(qbEntity entity) {
+  return (uint32_t)((uint64_t)entity >> 32);
+}
+
+inline qbEntity MakeEntity(uint32_t index, uint32_t generation) {
+  return (qbEntity)(((uint64_t)generation << 32) | index);
+}
+
+// Lock-free allocator for generational entity handles. Freed indices are kept
+// on a lock-free stack and reused first. New indices are reserved in blocks
+// that are cached per thread, so threads only touch shared state once per
+// block.
+class EntityIdAllocator {
+ public:
+  EntityIdAllocator();
+  ~EntityIdAllocator();
+
+  // Not thread-safe. Copies all allocations, does not copy per-thread caches.
+  void CopyFrom(const EntityIdAllocator& other);
+
+  qbEntity Allocate();
+
+  // Frees the handle if it is valid. Returns false otherwise.
+  bool Free(qbEntity entity);
+
+  // True if the handle was allocated and has not been freed since.
+  bool IsValid(qbEntity entity) const;
+
+  // Returns the current handle for the index. Only meaningful if the index is
+  // allocated.
+  qbEntity Handle(uint32_t index) const;
+
+ private:
+  struct Slot {
+    std::atomic<uint32_t> generation;
+    std::atomic<uint32_t> next;
+  };
+
+  static const uint32_t kPageBits = 16;
+  static const uint32_t kPageSize = 1 << kPageBits;
+  static const uint32_t kPageCount = 1 << (32 - kPageBits);
+  static const uint32_t kBlockSize = 64;
+  static const uint32_t kNone = 0xFFFFFFFF;
+
+  // Returns the slot for the index, allocating its page if needed.
+  Slot* GetSlot(uint32_t index);
+
+  // Returns nullptr if the page was never allocated.
+  const Slot* FindSlot(uint32_t index) const;
+
+  bool Pop(uint32_t* index);
+  void Push(uint32_t index);
+
+  // Identifies this allocator in the per-thread caches.
+  const uint64_t uid_;
+
+  // Paged generations and free list links. Pages are never freed until the
+  // allocator is destroyed, so readers never see a dangling slot.
+  std::atomic<Slot*>* pages_;
+
+  // Head of the free list: a tag in the high bits to avoid ABA and the index
+  // of the top slot in the low bits.
+  std::atomic<uint64_t> free_head_;
+
+  // First index that has never been reserved.
+  std::atomic<uint32_t> next_index_;
+};
+
+#endif  // ENTITY_ID_ALLOCATOR__H
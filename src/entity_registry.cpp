@@ -23,9 +23,8 @@
 
 #include "game_state.h"
 EntityRegistry::EntityRegistry()
-    : id_(0) {
+    : words_(1) {
   entities_.reserve(100000);
-  free_entity_ids_.reserve(10000);
 }
 
 void EntityRegistry::Init() {
@@ -33,10 +32,10 @@ void EntityRegistry::Init() {
 
 EntityRegistry* EntityRegistry::Clone() {
   EntityRegistry* ret = new EntityRegistry();
-  long id = id_;
-  ret->id_ = id;
+  ret->ids_.CopyFrom(ids_);
   ret->entities_ = entities_;
-  ret->free_entity_ids_ = free_entity_ids_;
+  ret->words_ = words_;
+  ret->signatures_ = signatures_;
   return ret;
 }
 
@@ -44,7 +43,7 @@ EntityRegistry* EntityRegistry::Clone() {
 // ComponentCreateEvent after all components have been created.
 qbResult EntityRegistry::CreateEntity(qbEntity* entity,
                                       const qbEntityAttr_& /** attr */) {
-  qbId new_id = AllocEntity();
+  qbEntity new_id = ids_.Allocate();
   entities_.insert(new_id);
 
   INFO("CreateEntity " << new_id << "\n");
@@ -53,6 +52,20 @@ qbResult EntityRegistry::CreateEntity(qbEntity* entity,
   return qbResult::QB_OK;
 }
 
+qbResult EntityRegistry::CreateEntities(size_t count, qbEntity* entities) {
+  for (size_t i = 0; i < count; ++i) {
+    entities[i] = ids_.Allocate();
+  }
+
+  entities_.reserve(entities_.size() + count);
+  for (size_t i = 0; i < count; ++i) {
+    entities_.insert(entities[i]);
+  }
+
+  INFO("CreateEntities " << count << "\n");
+  return qbResult::QB_OK;
+}
+
 // Destroys an entity and frees all components. Entity and components will be
 // destroyed next frame. Sends a ComponentDestroyEvent before components are
 // removed. Frees entity memory after all components have been destroyed.
@@ -60,7 +73,7 @@ qbResult EntityRegistry::DestroyEntity(qbEntity entity) {
   INFO("Destroying instances for " << (entity) << "\n");
   if (entities_.has(entity)) {
     entities_.erase(entity);
-    free_entity_ids_.push_back(entity);
+    ids_.Free(entity);
   }
   return QB_OK;
 }
@@ -73,8 +86,8 @@ qbResult EntityRegistry::Find(qbEntity entity, qbEntity* found) {
   return QB_OK;
 }
 
-bool EntityRegistry::Has(qbEntity entity) {
-  return entities_.has(entity);
+bool EntityRegistry::Has(qbEntity entity) const {
+  return ids_.IsValid(entity);
 }
 
 void EntityRegistry::Resolve(const std::vector<qbEntity>& created,
@@ -82,7 +95,7 @@ void EntityRegistry::Resolve(const std::vector<qbEntity>& created,
   for (qbEntity entity : destroyed) {
     if (entities_.has(entity)) {
       entities_.erase(entity);
-      free_entity_ids_.push_back(entity);
+      ids_.Free(entity);
     }
   }
   for (qbEntity entity : created) {
@@ -90,14 +103,71 @@ void EntityRegistry::Resolve(const std::vector<qbEntity>& created,
   }
 }
 
-qbId EntityRegistry::AllocEntity() {
-  qbId new_id;
-  if (free_entity_ids_.empty()) {
-    new_id = id_++;
-  } else {
-    new_id = free_entity_ids_.back();
-    free_entity_ids_.pop_back();
+void EntityRegistry::AddComponent(qbEntity entity, qbComponent component) {
+  size_t word = component >> 6;
+  if (word >= words_) {
+    // Widen every signature to fit the new component.
+    size_t words = word + 1;
+    size_t count = signatures_.size() / words_;
+    std::vector<uint64_t> signatures(count * words, 0);
+    for (size_t i = 0; i < count; ++i) {
+      std::copy(signatures_.begin() + i * words_,
+                signatures_.begin() + (i + 1) * words_,
+                signatures.begin() + i * words);
+    }
+    signatures_ = std::move(signatures);
+    words_ = words;
+  }
+
+  size_t index = (size_t)EntityIndex(entity) * words_ + word;
+  if (index >= signatures_.size()) {
+    signatures_.resize(((size_t)EntityIndex(entity) + 1) * words_, 0);
+  }
+  signatures_[index] |= 1ULL << (component & 63);
+}
+
+void EntityRegistry::RemoveComponent(qbEntity entity, qbComponent component) {
+  size_t word = component >> 6;
+  size_t index = (size_t)EntityIndex(entity) * words_ + word;
+  if (word < words_ && index < signatures_.size()) {
+    signatures_[index] &= ~(1ULL << (component & 63));
+  }
+}
+
+void EntityRegistry::ClearComponents(qbEntity entity) {
+  size_t begin = (size_t)EntityIndex(entity) * words_;
+  if (begin < signatures_.size()) {
+    std::fill(signatures_.begin() + begin,
+              signatures_.begin() + begin + words_, 0);
+  }
+}
+
+bool EntityRegistry::HasAll(qbEntity entity,
+                            const ComponentSignature& signature) const {
+  size_t begin = (size_t)EntityIndex(entity) * words_;
+  const uint64_t* words = signature.Data();
+  for (size_t i = 0; i < signature.Words(); ++i) {
+    uint64_t owned = (i < words_ && begin < signatures_.size())
+        ? signatures_[begin + i] : 0;
+    if ((owned & words[i]) != words[i]) {
+      return false;
+    }
   }
+  return true;
+}
 
-  return new_id;
+bool EntityRegistry::HasAny(qbEntity entity,
+                            const ComponentSignature& signature) const {
+  size_t begin = (size_t)EntityIndex(entity) * words_;
+  if (begin >= signatures_.size()) {
+    return false;
+  }
+  const uint64_t* words = signature.Data();
+  size_t n = std::min(words_, signature.Words());
+  for (size_t i = 0; i < n; ++i) {
+    if (signatures_[begin + i] & words[i]) {
+      return true;
+    }
+  }
+  return false;
 }
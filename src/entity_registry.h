@@ -22,6 +22,8 @@
 #include "defs.h"
 #include "memory_pool.h"
 #include "component_registry.h"
+#include "component_signature.h"
+#include "entity_id_allocator.h"
 #include "sparse_set.h"
 
 #include <algorithm>
@@ -44,6 +46,20 @@ class EntityRegistry {
   // ComponentCreateEvent after all components have been created.
   qbResult CreateEntity(qbEntity* entity, const qbEntityAttr_& attr);
 
+  // Creates "count" entities at once. Ids are allocated one at a time, reusing
+  // freed ids first and otherwise taking them from a per-thread block of 64.
+  qbResult CreateEntities(size_t count, qbEntity* entities);
+
+  // Allocates a handle without creating the entity. Thread-safe. The entity
+  // is created by passing the handle to "Insert".
+  qbEntity Reserve() {
+    return ids_.Allocate();
+  }
+
+  void Insert(qbEntity entity) {
+    entities_.insert(entity);
+  }
+
   // Destroys an entity and frees all components. Entity and components will be
   // destroyed next frame. Sends a ComponentDestroyEvent before components are
   // removed. Frees entity memory after all components have been destroyed.
@@ -67,7 +83,50 @@ class EntityRegistry {
     return entities_.end();
   }
 
-  bool Has(qbEntity entity);
+  // True if the handle refers to a live entity. Lock-free and safe to call
+  // from any thread.
+  bool Has(qbEntity entity) const;
+
+  // Returns the live entity with the given index.
+  qbEntity HandleOf(uint32_t index) const {
+    return ids_.Handle(index);
+  }
+
+  // Component signatures. Every entity has a bitset of the components it
+  // owns, stored in a flat array with a fixed number of words per entity.
+  void AddComponent(qbEntity entity, qbComponent component);
+  void RemoveComponent(qbEntity entity, qbComponent component);
+  void ClearComponents(qbEntity entity);
+
+  bool HasComponent(qbEntity entity, qbComponent component) const {
+    size_t word = component >> 6;
+    size_t index = (size_t)EntityIndex(entity) * words_ + word;
+    return word < words_ && index < signatures_.size() &&
+           (signatures_[index] >> (component & 63)) & 1;
+  }
+
+  // True if the entity owns all components in the signature.
+  bool HasAll(qbEntity entity, const ComponentSignature& signature) const;
+
+  // True if the entity owns at least one component in the signature.
+  bool HasAny(qbEntity entity, const ComponentSignature& signature) const;
+
+  // Calls fn(qbComponent) for every component the entity owns.
+  template<class Fn_>
+  void ForEachComponent(qbEntity entity, Fn_ fn) const {
+    size_t begin = (size_t)EntityIndex(entity) * words_;
+    if (begin >= signatures_.size()) {
+      return;
+    }
+    for (size_t i = 0; i < words_; ++i) {
+      uint64_t word = signatures_[begin + i];
+      while (word) {
+        int bit = __builtin_ctzll(word);
+        fn((qbComponent)(i * 64 + bit));
+        word &= word - 1;
+      }
+    }
+  }
 
   void Resolve(const std::vector<qbEntity>& created,
                const std::vector<qbEntity>& destroyed);
@@ -78,7 +137,7 @@ class EntityRegistry {
     for (qbEntity entity : destroyed) {
       if (entities_.has(entity)) {
         entities_.erase(entity);
-        free_entity_ids_.push_back(entity);
+        ids_.Free(entity);
       }
     }
     for (qbEntity entity : created) {
@@ -87,11 +146,12 @@ class EntityRegistry {
   }
 
  private:
-  qbId AllocEntity();
-
-  std::atomic_long id_;
+  EntityIdAllocator ids_;
   SparseSet entities_;
-  std::vector<size_t> free_entity_ids_;
+
+  // Number of 64-bit words per signature.
+  size_t words_;
+  std::vector<uint64_t> signatures_;
 
 };
 
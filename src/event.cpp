@@ -21,43 +21,93 @@
 
 #include <cstring>
 
-Event::Event(qbId program, qbId id, ByteQueue* message_queue,
-             size_t size)
+Event::Event(qbId program, qbId id, size_t size, bool has_entity,
+             size_t entity_offset)
   : program_(program),
     id_(id),
-    message_queue_(message_queue),
     size_(size),
-    mem_buffer_(size) {
-  mem_buffer_.reserve(1000);
-  free_mem_.reserve(1000);
+    stride_(kSlotHeader +
+            ((size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1))),
+    has_entity_(has_entity),
+    entity_offset_(entity_offset),
+    current_(nullptr),
+    batch_(size) {
+  current_ = NewSlab();
 }
 
-Event::Message Event::AllocMessage(void* initial_val) {
-  size_t ret_index = 0;
-  if (free_mem_.empty()) {
-    ret_index = mem_buffer_.size();
-    mem_buffer_.push_back(initial_val);
-    initial_val = nullptr;
-  } else {
-    ret_index = free_mem_.back();
-    free_mem_.pop_back();
+Event::~Event() {
+  Slab* slab;
+  while (free_slabs_.try_dequeue(slab)) {
+    delete slab;
   }
-  if (initial_val) {
-    void* val = mem_buffer_[ret_index];
-    memmove(val, initial_val, size_);
+  while (full_slabs_.try_dequeue(slab)) {
+    delete slab;
   }
-  return{ id_, ret_index };
+  for (Slab* retired : retired_) {
+    delete retired;
+  }
+  delete current_.load();
+}
+
+Event::Slab* Event::NewSlab() {
+  Slab* slab;
+  if (free_slabs_.try_dequeue(slab)) {
+    return slab;
+  }
+  slab = new Slab(kSlabMessages * stride_);
+  for (size_t i = 0; i < kSlabMessages; ++i) {
+    *(Slab**)(slab->data.get() + i * stride_) = slab;
+  }
+  return slab;
 }
 
 qbResult Event::SendMessage(void* message) {
-  Event::Message new_message = AllocMessage(message);
-  message_queue_->push(&new_message);
+  void* data = AllocMessage();
+  memcpy(data, message, size_);
+  return CommitMessage(data);
+}
+
+void* Event::AllocMessage() {
+  for (;;) {
+    // Pin the slab before claiming a slot so that it can't be recycled in
+    // between. If it was replaced before the pin, try again on the new one.
+    Slab* slab = current_.load();
+    slab->writers.fetch_add(1);
+    if (slab != current_.load()) {
+      slab->writers.fetch_sub(1);
+      continue;
+    }
+
+    // The slab stays pinned until the message is committed.
+    size_t slot = slab->next.fetch_add(1);
+    if (slot < kSlabMessages) {
+      return slab->data.get() + slot * stride_ + kSlotHeader;
+    }
+
+    // The slab is full. Only one sender gets to replace it, the others give
+    // back their new slab and retry.
+    Slab* fresh = NewSlab();
+    Slab* expected = slab;
+    if (current_.compare_exchange_strong(expected, fresh)) {
+      full_slabs_.enqueue(slab);
+    } else {
+      free_slabs_.enqueue(fresh);
+    }
+    slab->writers.fetch_sub(1);
+  }
+}
+
+qbResult Event::CommitMessage(void* message) {
+  uint8_t* data = (uint8_t*)message;
+  Slab* slab = *(Slab**)(data - kSlotHeader);
+  messages_.enqueue({ slab, data });
+  slab->writers.fetch_sub(1);
   return qbResult::QB_OK;
 }
 
 qbResult Event::SendMessageSync(void* message, GameState* state) {
   for (const auto& handler : handlers_) {
-    (SystemImpl::FromRaw(handler))->Run(state, message);
+    RunHandler(handler, message, state);
   }
 
   return qbResult::QB_OK;
@@ -71,14 +121,94 @@ void Event::RemoveHandler(qbSystem s) {
   handlers_.erase(std::find(handlers_.begin(), handlers_.end(), s));
 }
 
-void Event::Flush(size_t index, GameState* state) {
+bool Event::Flush(GameState* state) {
+  // Only the messages queued when the flush started are run. Messages sent by
+  // the handlers or by other threads in the meantime are run by the next
+  // flush.
+  read_.resize(0);
+  size_t remaining = messages_.size_approx();
+  while (remaining > 0) {
+    size_t begin = read_.size();
+    read_.resize(begin + std::min(remaining, kSlabMessages));
+    size_t count = messages_.try_dequeue_bulk(read_.begin() + begin, read_.size() - begin);
+    read_.resize(begin + count);
+    if (count == 0) {
+      break;
+    }
+    remaining -= count;
+  }
+  if (read_.empty()) {
+    return false;
+  }
+
   for (const auto& handler : handlers_) {
-    void* m = mem_buffer_[index];
-    SystemImpl::FromRaw(handler)->Run(state, m);
+    SystemImpl* system = SystemImpl::FromRaw(handler);
+    if (system->BatchesEvents()) {
+      system->Run(state, Batch());
+      continue;
+    }
+    for (const Message& m : read_) {
+      RunHandler(handler, m.data, state);
+    }
   }
-  FreeMessage(index);
+
+  // The slots are only given back once every handler is done with them.
+  for (const Message& m : read_) {
+    ++m.slab->read;
+  }
+  batch_.clear();
+  RecycleSlabs();
+  return true;
+}
+
+SystemImpl::Events Event::Batch() {
+  if (batch_.empty()) {
+    targets_.resize(0);
+    for (const Message& m : read_) {
+      batch_.push_back(m.data);
+      if (has_entity_) {
+        targets_.push_back(TargetOf(m.data));
+      }
+    }
+  }
+  return { batch_.front(), batch_.size(), size_,
+           has_entity_ ? targets_.data() : nullptr };
+}
+
+void Event::RecycleSlabs() {
+  Slab* slab;
+  while (full_slabs_.try_dequeue(slab)) {
+    retired_.push_back(slab);
+  }
+
+  // A full slab is no longer current, so once no sender is pinning it no one
+  // can claim a slot in it anymore.
+  for (size_t i = 0; i < retired_.size();) {
+    slab = retired_[i];
+    if (slab->writers.load() == 0 && slab->read == kSlabMessages) {
+      slab->next = 0;
+      slab->read = 0;
+      free_slabs_.enqueue(slab);
+      retired_[i] = retired_.back();
+      retired_.pop_back();
+    } else {
+      ++i;
+    }
+  }
+}
+
+void Event::RunHandler(qbSystem handler, void* message, GameState* state) {
+  if (!has_entity_) {
+    SystemImpl::FromRaw(handler)->Run(state, message);
+    return;
+  }
+
+  qbEntity target = TargetOf(message);
+  SystemImpl::FromRaw(handler)->Run(state, { message, 1, size_, &target });
 }
 
-void Event::FreeMessage(size_t index) {
-  free_mem_.push_back(index);
+qbEntity Event::TargetOf(const void* message) const {
+  qbEntity target;
+  memcpy(&target, (const uint8_t*)message + entity_offset_, sizeof(qbEntity));
+  return target;
 }
@@ -22,27 +22,37 @@
 #include "concurrentqueue.h"
 #include "defs.h"
 #include "byte_vector.h"
-#include "byte_queue.h"
-#include "memory_pool.h"
 #include "game_state.h"
+#include "system_impl.h"
 
-#include <mutex>
-#include <queue>
-#include <set>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
 
+// Messages are written into slabs of fixed-size slots that are shared by all
+// senders. A slot is claimed with a single atomic increment and the message is
+// published through a lock-free queue, so any thread can send at any time. The
+// program that owns the event drains the queue in "Flush", runs the handlers
+// directly on the slots and recycles slabs once every message in them was
+// handled.
 class Event {
  public:
-  struct Message {
-    qbId handler;
-    size_t index;
-  };
-
-  Event(qbId program, qbId id, ByteQueue* message_queue, size_t size = 1);
+  Event(qbId program, qbId id, size_t size = 1, bool has_entity = false,
+        size_t entity_offset = 0);
+  ~Event();
 
   // Thread-safe.
   qbResult SendMessage(void* message);
 
-  // Thread-safe.
+  // Thread-safe. Claims a slot for a message to be written in place. The slot
+  // must be published with "CommitMessage" and can't be recycled until then.
+  void* AllocMessage();
+
+  // Thread-safe. Publishes a slot from "AllocMessage".
+  qbResult CommitMessage(void* message);
+
+  // Not thread-safe.
   qbResult SendMessageSync(void* message, GameState* state);
 
   // Not thread-safe.
@@ -51,24 +61,77 @@ class Event {
   // Not thread-safe.
   void RemoveHandler(qbSystem s);
 
-  // Not thread-safe.
-  void Flush(size_t index, GameState* state);
+  // Not thread-safe. Only called by the program that owns the event. Runs
+  // every handler over all messages sent since the last flush. Handlers that
+  // batch events are run once with all of them. Returns false if there were
+  // no messages.
+  bool Flush(GameState* state);
 
  private:
-  // Allocates a message to send. Moves the data pointed to by initial_val
-  // to a new message. Returns pointer to the newly allocated message.
-   Message AllocMessage(void* initial_val);
+  static const size_t kSlabMessages = 256;
 
-  // Thread-safe.
-  void FreeMessage(size_t index);
+  struct Slab {
+    Slab(size_t bytes) : data(new uint8_t[bytes]), next(0), writers(0), read(0) {}
+
+    std::unique_ptr<uint8_t[]> data;
+
+    // Index of the next free slot. Keeps growing past the end once full.
+    std::atomic<size_t> next;
+
+    // Number of senders currently holding on to the slab.
+    std::atomic<size_t> writers;
+
+    // Number of messages read by "Flush". Only used by the owning program.
+    size_t read;
+  };
+
+  struct Message {
+    Slab* slab;
+    uint8_t* data;
+  };
+
+  // Each slot starts with a pointer to its slab, padded to keep the message
+  // aligned.
+  static const size_t kSlotHeader = alignof(std::max_align_t);
+
+  // Returns a clean slab from the free list or allocates a new one.
+  Slab* NewSlab();
+
+  // Moves full slabs that no sender holds on to and that were completely read
+  // back to the free list.
+  void RecycleSlabs();
+
+  // Copies the messages being flushed back to back for handlers that batch
+  // events. Only copies them on first use in each flush.
+  SystemImpl::Events Batch();
+
+  // Runs the handler on the message. If the event has an entity field, the
+  // handler only visits the targeted entity.
+  void RunHandler(qbSystem handler, void* message, GameState* state);
+
+  qbEntity TargetOf(const void* message) const;
 
   std::vector<qbSystem> handlers_;
   qbId program_;
   qbId id_;
-  ByteQueue* message_queue_;
   size_t size_;
-  ByteVector mem_buffer_;
-  std::vector<size_t> free_mem_;
+  size_t stride_;
+  bool has_entity_;
+  size_t entity_offset_;
+
+  std::atomic<Slab*> current_;
+  moodycamel::ConcurrentQueue<Message> messages_;
+  moodycamel::ConcurrentQueue<Slab*> free_slabs_;
+  moodycamel::ConcurrentQueue<Slab*> full_slabs_;
+
+  // Full slabs waiting for their last messages to be read.
+  std::vector<Slab*> retired_;
+
+  // The messages being flushed. Copies of them are only laid out back to back
+  // in "batch_" if a handler batches events.
+  std::vector<Message> read_;
+  ByteVector batch_;
+  std::vector<qbEntity> targets_;
 };
 
 #endif  // EVENT__H
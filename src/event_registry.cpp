@@ -18,18 +18,26 @@
 
 #include "event_registry.h"
 
+namespace
+{
+
+// Rounds of handlers sending more messages that are delivered in one flush.
+// Anything sent after that waits for the next flush, so senders on other
+// threads can't keep the owning program flushing forever.
+const size_t kMaxFlushRounds = 16;
+
+}  // namespace
+
 EventRegistry::EventRegistry(qbId program)
-  : program_(program),
-    message_queue_(
-      new ByteQueue(sizeof(Event::Message))) { }
+  : program_(program) { }
 
 EventRegistry::~EventRegistry() { }
 
 qbResult EventRegistry::CreateEvent(qbEvent* event, qbEventAttr attr) {
   std::lock_guard<decltype(state_mutex_)> lock(state_mutex_);
   qbId event_id = events_.size();
-  events_.push_back(new Event(program_, event_id, message_queue_,
-                              attr->message_size));
+  events_.push_back(new Event(program_, event_id, attr->message_size,
+                              attr->has_entity, attr->entity_offset));
   AllocEvent(event_id, event, events_[event_id]);
   return qbResult::QB_OK;
 }
@@ -45,11 +53,15 @@ void EventRegistry::Unsubscribe(qbEvent event, qbSystem system) {
 }
 
 void EventRegistry::FlushAll(GameState* state) {
-  Event::Message msg;
-  while (!message_queue_->empty()) {
-    msg = *(Event::Message*)message_queue_->front();
-    events_[msg.handler]->Flush(msg.index, state);
-    message_queue_->pop();
+  // Messages are grouped by event so that each handler is run once per event
+  // per round. Keeps flushing until a round finds no messages, so messages
+  // sent by the handlers are delivered as well, up to "kMaxFlushRounds".
+  bool is_flushed = true;
+  for (size_t round = 0; is_flushed && round < kMaxFlushRounds; ++round) {
+    is_flushed = false;
+    for (size_t i = 0; i < events_.size(); ++i) {
+      is_flushed |= events_[i]->Flush(state);
+    }
   }
 }
 
@@ -21,7 +21,6 @@
 
 #include "event.h"
 #include "defs.h"
-#include "byte_queue.h"
 #include "game_state.h"
 
 #include <mutex>
@@ -41,6 +40,7 @@ class EventRegistry {
   // Thread-safe.
   void Unsubscribe(qbEvent event, qbSystem system);
 
+  // Not thread-safe. Only called by the program that owns the events.
   void FlushAll(GameState* state);
 
  private:
@@ -52,7 +52,6 @@ class EventRegistry {
   qbId program_;
   std::mutex state_mutex_;
   std::vector<Event*> events_;
-  ByteQueue* message_queue_;
 };
 
 #endif  // EVENT_REGISTRY__H
@@ -17,16 +17,36 @@
 */
 
 #include "game_state.h"
+#include "job_system.h"
 #include "private_universe.h"
 
+namespace
+{
+
+// The last command buffers used by this thread, keyed by the state's uid.
+struct CachedCommands {
+  uint64_t owner;
+  void* commands;
+};
+
+const size_t kCachedCommands = 4;
+thread_local CachedCommands cached_commands[kCachedCommands];
+thread_local size_t next_cached_commands = 0;
+
+std::atomic<uint64_t> next_uid(1);
+
+}  // namespace
+
 GameState::GameState(std::unique_ptr<EntityRegistry> entities,
                      std::unique_ptr<InstanceRegistry> instances,
                      ComponentRegistry* components)
   : entities_(std::move(entities)),
     instances_(std::move(instances)),
-    components_(components) {
-  destroyed_entities_.resize(10);
-  removed_components_.resize(10);
+    components_(components),
+    uid_(next_uid++) {
+  instances_->Archetypes()->OnCreate([this](Archetype* archetype) {
+    queries_.OnCreateArchetype(archetype);
+  });
 }
 
 GameState::~GameState() {
@@ -36,39 +56,266 @@ GameState::~GameState() {
 }
 
 void GameState::Flush() {
-  for (auto& removed_components : removed_components_) {
-    while (!removed_components.empty()) {
-      auto& removed = removed_components.back();
-      EntityRemoveComponentInternal(removed.first, removed.second);
-      removed_components.pop_back();
+  // Notifications sent while applying can record more changes, for example
+  // destroying composite components destroys more entities, so keep flushing
+  // until nothing is left.
+  while (TakeCommands()) {
+    ApplyCreated();
+    ApplyAdded();
+    ApplyRemoved();
+    ApplyDestroyed();
+    for (CommandBuffer& commands : flushing_) {
+      commands.Clear();
+    }
+  }
+
+  // The frame's writes are final, hand them to the buffered readers.
+  instances_->Publish();
+}
+
+bool GameState::IsDeferred() {
+  return JobSystem::ThreadIndex() != 0 || Commands()->deferred > 0;
+}
+
+GameState::ThreadCommands* GameState::Commands() {
+  for (const CachedCommands& cached : cached_commands) {
+    if (cached.owner == uid_) {
+      return (ThreadCommands*)cached.commands;
     }
   }
 
-  for (auto& destroyed_entities : destroyed_entities_) {
-    while (!destroyed_entities.empty()) {
-      auto& destroyed = destroyed_entities.back();
-      EntityDestroyInternal(destroyed);
-      destroyed_entities.pop_back();
+  ThreadCommands* commands;
+  {
+    std::lock_guard<std::mutex> lock(buffers_mu_);
+    ThreadCommands*& found = thread_buffers_[std::this_thread::get_id()];
+    if (!found) {
+      buffers_.emplace_back(new ThreadCommands);
+      found = buffers_.back().get();
     }
+    commands = found;
+  }
+  cached_commands[next_cached_commands++ % kCachedCommands] = { uid_, commands };
+  return commands;
+}
+
+bool GameState::TakeCommands() {
+  std::lock_guard<std::mutex> lock(buffers_mu_);
+  flushing_.resize(buffers_.size());
+  bool has_commands = false;
+  for (size_t i = 0; i < buffers_.size(); ++i) {
+    std::lock_guard<std::mutex> buffer_lock(buffers_[i]->mu);
+    if (!buffers_[i]->commands.Empty()) {
+      std::swap(flushing_[i], buffers_[i]->commands);
+      has_commands = true;
+    }
+  }
+  return has_commands;
+}
+
+void GameState::ApplyCreated() {
+  thread_local static std::vector<qbComponentInstance_> instances;
+  for (CommandBuffer& commands : flushing_) {
+    for (const CommandBuffer::Created& created : commands.CreatedEntities()) {
+      if (!entities_->Has(created.entity)) {
+        continue;
+      }
+      instances.resize(0);
+      for (size_t i = created.begin; i < created.begin + created.count; ++i) {
+        const CommandBuffer::Instance& instance = commands.CreatedInstances()[i];
+        instances.push_back({ instance.component, commands.Data(instance) });
+      }
+      entities_->Insert(created.entity);
+      for (const auto& instance : instances) {
+        entities_->AddComponent(created.entity, instance.component);
+      }
+      for (const auto& instance : instances) {
+        queries_.OnAdd(&created.entity, 1, instance.component, *entities_);
+      }
+      instances_->CreateInstancesFor(created.entity, instances, this);
+    }
+  }
+}
+
+void GameState::ApplyAdded() {
+  pending_.resize(0);
+  for (CommandBuffer& commands : flushing_) {
+    for (const CommandBuffer::Instance& added : commands.Added()) {
+      pending_.push_back({ added.component, added.entity, commands.Data(added) });
+    }
+  }
+  std::stable_sort(pending_.begin(), pending_.end(),
+                   [](const PendingInstance& a, const PendingInstance& b) {
+                     return a.component < b.component;
+                   });
+
+  for (size_t begin = 0; begin < pending_.size();) {
+    qbComponent component = pending_[begin].component;
+    pending_entities_.resize(0);
+    pending_data_.resize(0);
+    size_t end = begin;
+    for (; end < pending_.size() && pending_[end].component == component; ++end) {
+      qbEntity entity = pending_[end].entity;
+      if (entities_->Has(entity) && !entities_->HasComponent(entity, component)) {
+        entities_->AddComponent(entity, component);
+        pending_entities_.push_back(entity);
+        pending_data_.push_back(pending_[end].data);
+      }
+    }
+    begin = end;
+    if (pending_entities_.empty()) {
+      continue;
+    }
+    queries_.OnAdd(pending_entities_.data(), pending_entities_.size(), component, *entities_);
+    instances_->CreateInstancesFor(component, pending_entities_.data(),
+                                   pending_data_.data(), pending_entities_.size(), this);
+  }
+}
+
+void GameState::ApplyRemoved() {
+  pending_.resize(0);
+  for (CommandBuffer& commands : flushing_) {
+    for (const CommandBuffer::Removed& removed : commands.RemovedInstances()) {
+      pending_.push_back({ removed.component, removed.entity, nullptr });
+    }
+  }
+  std::sort(pending_.begin(), pending_.end(),
+            [](const PendingInstance& a, const PendingInstance& b) {
+              return a.component < b.component ||
+                     (a.component == b.component && a.entity < b.entity);
+            });
+
+  for (size_t begin = 0; begin < pending_.size();) {
+    qbComponent component = pending_[begin].component;
+    pending_entities_.resize(0);
+    size_t end = begin;
+    for (; end < pending_.size() && pending_[end].component == component; ++end) {
+      qbEntity entity = pending_[end].entity;
+      if ((pending_entities_.empty() || pending_entities_.back() != entity) &&
+          EntityHasComponent(entity, component)) {
+        pending_entities_.push_back(entity);
+      }
+    }
+    begin = end;
+    if (pending_entities_.empty()) {
+      continue;
+    }
+    instances_->DestroyInstancesFor(component, pending_entities_.data(),
+                                    pending_entities_.size(), this);
+    for (qbEntity entity : pending_entities_) {
+      queries_.OnRemove(entity, component);
+      entities_->RemoveComponent(entity, component);
+    }
+  }
+}
+
+void GameState::ApplyDestroyed() {
+  std::vector<qbEntity>& destroyed = pending_entities_;
+  destroyed.resize(0);
+  for (CommandBuffer& commands : flushing_) {
+    destroyed.insert(destroyed.end(), commands.Destroyed().begin(),
+                     commands.Destroyed().end());
+  }
+  if (!destroyed.empty()) {
+    EntityDestroyBatchInternal(&destroyed);
   }
 }
 
 qbResult GameState::EntityCreate(qbEntity* entity, const qbEntityAttr_& attr) {
+  if (IsDeferred()) {
+    *entity = entities_->Reserve();
+    Record([this, entity, &attr](CommandBuffer* commands) {
+      commands->Create(*entity);
+      for (const auto& instance : attr.component_list) {
+        commands->CreateInstance(instance.component, instance.data,
+                                 components_->DataSize(instance.component));
+      }
+    });
+    return QB_OK;
+  }
+
   qbResult result = entities_->CreateEntity(entity, attr);
+  for (const auto& instance : attr.component_list) {
+    entities_->AddComponent(*entity, instance.component);
+  }
+  for (const auto& instance : attr.component_list) {
+    queries_.OnAdd(entity, 1, instance.component, *entities_);
+  }
   instances_->CreateInstancesFor(*entity, attr.component_list, this);
   return result;
 }
 
 qbResult GameState::EntityDestroy(qbEntity entity) {
-  destroyed_entities_.resize(std::max(destroyed_entities_.size(), (size_t)PrivateUniverse::program_id + 1));
-  destroyed_entities_[PrivateUniverse::program_id].push_back(entity);
+  Record([entity](CommandBuffer* commands) {
+    commands->Destroy(entity);
+  });
+  return QB_OK;
+}
+
+qbResult GameState::EntityCreateBatch(size_t count, const qbEntityAttr_& attr,
+                                     qbEntity* entities) {
+  if (IsDeferred()) {
+    for (size_t i = 0; i < count; ++i) {
+      entities[i] = entities_->Reserve();
+    }
+    Record([this, count, entities, &attr](CommandBuffer* commands) {
+      for (size_t i = 0; i < count; ++i) {
+        commands->Create(entities[i]);
+        for (const auto& instance : attr.component_list) {
+          commands->CreateInstance(instance.component, instance.data,
+                                   components_->DataSize(instance.component));
+        }
+      }
+    });
+    return QB_OK;
+  }
+
+  qbResult result = entities_->CreateEntities(count, entities);
+  for (size_t i = 0; i < count; ++i) {
+    for (const auto& instance : attr.component_list) {
+      entities_->AddComponent(entities[i], instance.component);
+    }
+  }
+  for (const auto& instance : attr.component_list) {
+    queries_.OnAdd(entities, count, instance.component, *entities_);
+  }
+  instances_->CreateInstancesFor(entities, count, attr.component_list, this);
+  return result;
+}
+
+qbResult GameState::EntityDestroyBatch(const qbEntity* entities,
+                                      size_t count) {
+  Record([entities, count](CommandBuffer* commands) {
+    commands->Destroy(entities, count);
+  });
+  return QB_OK;
+}
+
+qbResult GameState::EntityDestroyBatchInternal(std::vector<qbEntity>* entities) {
+  // Drop duplicates and entities that were already destroyed.
+  std::sort(entities->begin(), entities->end());
+  entities->erase(std::unique(entities->begin(), entities->end()),
+                  entities->end());
+  entities->erase(
+    std::remove_if(entities->begin(), entities->end(),
+                   [this](qbEntity e) { return !entities_->Has(e); }),
+    entities->end());
+
+  instances_->DestroyInstancesFor(entities->data(), entities->size(),
+                                  *entities_, this);
+  for (qbEntity entity : *entities) {
+    queries_.OnClear(entity, *entities_);
+    entities_->ClearComponents(entity);
+    entities_->DestroyEntity(entity);
+  }
   return QB_OK;
 }
 
 qbResult GameState::EntityDestroyInternal(qbEntity entity) {
   qbResult result = QB_OK;
   if (entities_->Has(entity)) {
-    instances_->DestroyInstancesFor(entity, this);
+    instances_->DestroyInstancesFor(entity, *entities_, this);
+    queries_.OnClear(entity, *entities_);
+    entities_->ClearComponents(entity);
     result = entities_->DestroyEntity(entity);
   }
   return result;
@@ -79,24 +326,46 @@ qbResult GameState::EntityFind(qbEntity* entity, qbId entity_id) {
 }
 
 bool GameState::EntityHasComponent(qbEntity entity, qbComponent component) {
-  return (*instances_)[component].Has(entity);
+  return entities_->Has(entity) && entities_->HasComponent(entity, component);
+}
+
+bool GameState::EntityHasAll(qbEntity entity,
+                             const ComponentSignature& signature) {
+  return entities_->Has(entity) && entities_->HasAll(entity, signature);
+}
+
+bool GameState::EntityHasAny(qbEntity entity,
+                             const ComponentSignature& signature) {
+  return entities_->Has(entity) && entities_->HasAny(entity, signature);
+}
+
+qbEntity GameState::EntityHandleOf(uint32_t index) const {
+  return entities_->HandleOf(index);
 }
 
 qbResult GameState::EntityAddComponent(qbEntity entity, qbComponent component,
                                        void* instance_data) {
+  if (!entities_->Has(entity)) {
+    return QB_ERROR_NOT_FOUND;
+  }
+  if (IsDeferred()) {
+    Record([this, entity, component, instance_data](CommandBuffer* commands) {
+      commands->Add(entity, component, instance_data, components_->DataSize(component));
+    });
+    return QB_OK;
+  }
+  entities_->AddComponent(entity, component);
+  queries_.OnAdd(&entity, 1, component, *entities_);
   return instances_->CreateInstanceFor(entity, component, instance_data, this);
 }
 
 qbResult GameState::EntityRemoveComponent(qbEntity entity, qbComponent component) {
-  removed_components_.resize(std::max(removed_components_.size(), (size_t)PrivateUniverse::program_id + 1));
-  removed_components_[PrivateUniverse::program_id].emplace_back(entity, component);
+  Record([entity, component](CommandBuffer* commands) {
+    commands->Remove(entity, component);
+  });
   return QB_OK;
 }
 
-qbResult GameState::EntityRemoveComponentInternal(qbEntity entity, qbComponent component) {
-  return instances_->DestroyInstanceFor(entity, component, this) == 1 ? QB_OK : QB_UNKNOWN;
-}
-
 qbResult GameState::ComponentSubscribeToOnCreate(qbSystem system,
                                                  qbComponent component) {
   return components_->SubcsribeToOnCreate(system, component);
@@ -112,9 +381,75 @@ Component* GameState::ComponentGet(qbComponent component) {
 }
 
 void* GameState::ComponentGetEntityData(qbComponent component, qbEntity entity) {
-  return (*instances_)[component][entity];
+  if (!EntityHasComponent(entity, component)) {
+    return nullptr;
+  }
+  Component& c = (*instances_)[component];
+
+  // The caller may write through the pointer, so buffered components stamp
+  // the instance for the next publish to copy it.
+  if (c.IsBuffered()) {
+    c.Touch(entity);
+  }
+  return c[entity];
 }
 
 size_t GameState::ComponentGetCount(qbComponent component) {
   return (*instances_)[component].Size();
-}
\ No newline at end of file
+}
+Query* GameState::QueryFind(const std::vector<qbComponent>& components) {
+  std::lock_guard<std::mutex> lock(queries_mu_);
+  Query* query = queries_.Find(components);
+  if (query) {
+    return query;
+  }
+
+  // Tags are only filters, so the entities are read from the smallest
+  // component with instances.
+  Component* source = nullptr;
+  bool is_archetype = false;
+  bool is_sparse = false;
+  std::vector<qbComponent> tags;
+  std::vector<const EntityBitset*> tag_sets;
+  for (qbComponent component : components) {
+    Component* c = ComponentGet(component);
+    if (c->IsTag()) {
+      tags.push_back(component);
+      tag_sets.push_back(&c->Tags());
+      continue;
+    }
+    is_archetype |= c->IsArchetype();
+    is_sparse |= !c->IsArchetype();
+    if (!source || c->Size() < source->Size()) {
+      source = c;
+    }
+  }
+  is_archetype &= !is_sparse;
+
+  query = queries_.Create(components, tags, is_archetype);
+  if (is_archetype) {
+    for (Archetype* archetype : Archetypes()->Archetypes()) {
+      query->AddArchetype(archetype);
+    }
+    return query;
+  }
+  if (source) {
+    for (auto id_component : *source) {
+      if (entities_->HasAll(id_component.first, query->Signature())) {
+        query->Insert(id_component.first);
+      }
+    }
+  } else if (!tag_sets.empty()) {
+    EntityBitset::ForEachWord(tag_sets, {}, [this, query](size_t w, uint64_t bits) {
+      while (bits) {
+        query->Insert(entities_->HandleOf((uint32_t)(w * 64 + __builtin_ctzll(bits))));
+        bits &= bits - 1;
+      }
+    });
+  }
+  return query;
+}
+
+ArchetypeRegistry* GameState::Archetypes() {
+  return instances_->Archetypes();
+}
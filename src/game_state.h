@@ -19,9 +19,15 @@
 #ifndef GAME_STATE__H
 #define GAME_STATE__H
 
+#include "command_buffer.h"
 #include "instance_registry.h"
 #include "entity_registry.h"
+#include "query.h"
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include "sparse_map.h"
 
 // Not thread-safe. Assumed to run in a single program.
@@ -32,13 +38,33 @@ public:
             ComponentRegistry* components);
   ~GameState();
 
+  // Applies all recorded structural changes: creates, then added instances,
+  // removed instances and destroyed entities, each grouped by component.
   void Flush();
 
+  // While deferred, entities and instances created on the calling thread are
+  // recorded and only created by the next "Flush". Entity handles are still
+  // returned right away. Other threads are not affected. Changes made on job
+  // workers are always deferred. Thread-safe.
+  void BeginDeferred() {
+    ++Commands()->deferred;
+  }
+
+  void EndDeferred() {
+    --Commands()->deferred;
+  }
+
   // Entity manipulation.
   qbResult EntityCreate(qbEntity* entity, const qbEntityAttr_& attr);
   qbResult EntityDestroy(qbEntity entity);
+  qbResult EntityCreateBatch(size_t count, const qbEntityAttr_& attr,
+                             qbEntity* entities);
+  qbResult EntityDestroyBatch(const qbEntity* entities, size_t count);
   qbResult EntityFind(qbEntity* entity, qbId entity_id);
   bool EntityHasComponent(qbEntity entity, qbComponent component);
+  bool EntityHasAll(qbEntity entity, const ComponentSignature& signature);
+  bool EntityHasAny(qbEntity entity, const ComponentSignature& signature);
+  qbEntity EntityHandleOf(uint32_t index) const;
   qbResult EntityAddComponent(qbEntity entity, qbComponent component,
                                void* instance_data);
   qbResult EntityRemoveComponent(qbEntity entity, qbComponent component);
@@ -47,20 +73,75 @@ public:
   qbResult ComponentSubscribeToOnCreate(qbSystem system, qbComponent component);
   qbResult ComponentSubscribeToOnDestroy(qbSystem system, qbComponent component);
   Component* ComponentGet(qbComponent component);
+  // Returns the entity's instance or nullptr. Marks the instance as changed if
+  // the component is buffered.
   void* ComponentGetEntityData(qbComponent component, qbEntity entity);
   size_t ComponentGetCount(qbComponent component);
 
+  // Returns the cached inner join over the given sorted components, creating
+  // and filling it on first use. Thread-safe.
+  Query* QueryFind(const std::vector<qbComponent>& components);
+  ArchetypeRegistry* Archetypes();
+
 private:
-  qbResult EntityRemoveComponentInternal(qbEntity entity, qbComponent component);
   qbResult EntityDestroyInternal(qbEntity entity);
+  qbResult EntityDestroyBatchInternal(std::vector<qbEntity>* entities);
+
+  // A command buffer owned by a single thread. The lock is only contended
+  // while "Flush" takes the buffer's commands.
+  struct ThreadCommands {
+    std::mutex mu;
+    CommandBuffer commands;
+
+    // Nesting depth of "BeginDeferred" on the owning thread.
+    int deferred = 0;
+  };
+
+  bool IsDeferred();
+
+  // Returns the calling thread's buffer.
+  ThreadCommands* Commands();
+
+  template<class Fn_>
+  void Record(Fn_ fn) {
+    ThreadCommands* t = Commands();
+    std::lock_guard<std::mutex> lock(t->mu);
+    fn(&t->commands);
+  }
+
+  // Moves the commands of all threads into "flushing_". Returns false if
+  // there were none.
+  bool TakeCommands();
+  void ApplyCreated();
+  void ApplyAdded();
+  void ApplyRemoved();
+  void ApplyDestroyed();
 
   std::unique_ptr<EntityRegistry> entities_;
   std::unique_ptr<InstanceRegistry> instances_;
   ComponentRegistry* components_;
+  QueryRegistry queries_;
+  std::mutex queries_mu_;
   SparseSet mutable_components_;
 
-  TypedBlockVector<std::vector<qbEntity>> destroyed_entities_;
-  TypedBlockVector<std::vector<std::pair<qbEntity, qbComponent>>> removed_components_;
+  // Identifies this state in the per-thread buffer caches.
+  const uint64_t uid_;
+
+  std::mutex buffers_mu_;
+  std::vector<std::unique_ptr<ThreadCommands>> buffers_;
+  std::unordered_map<std::thread::id, ThreadCommands*> thread_buffers_;
+
+  // The commands being applied, one buffer per thread, and scratch space to
+  // group them by component.
+  std::vector<CommandBuffer> flushing_;
+  struct PendingInstance {
+    qbComponent component;
+    qbEntity entity;
+    void* data;
+  };
+  std::vector<PendingInstance> pending_;
+  std::vector<qbEntity> pending_entities_;
+  std::vector<void*> pending_data_;
 
   friend class StateDelta;
 };
@@ -19,6 +19,7 @@
 #include "instance_registry.h"
 
 #include "component.h"
+#include "entity_registry.h"
 #include "game_state.h"
 InstanceRegistry::InstanceRegistry(const ComponentRegistry& component_registry) :
   component_registry_(component_registry) {}
@@ -32,30 +33,62 @@ InstanceRegistry::~InstanceRegistry() {
 InstanceRegistry* InstanceRegistry::Clone() {
   InstanceRegistry* ret = new InstanceRegistry(component_registry_);
   for (auto c_pair : components_) {
-    ret->components_[c_pair.first] = c_pair.second->Clone();
+    Component* c = c_pair.second->Clone();
+    ret->components_[c_pair.first] = c;
+    if (c->IsBuffered()) {
+      ret->buffered_.push_back(c);
+    }
   }
   return ret;
 }
 
+void InstanceRegistry::Publish() {
+  for (Component* c : buffered_) {
+    c->Publish();
+  }
+}
+
 void InstanceRegistry::Create(qbComponent component) {
   if (components_.has(component)) {
     return;
   }
-  components_[component] = component_registry_.Create(component);
+  Component* c = component_registry_.Create(component, &archetypes_);
+  if (c->IsArchetype()) {
+    archetypes_.Register(c);
+  }
+  if (c->IsBuffered()) {
+    buffered_.push_back(c);
+  }
+  components_[component] = c;
 }
 
 qbResult InstanceRegistry::CreateInstancesFor(
   qbEntity entity, const std::vector<qbComponentInstance_>& instances,
   GameState* state) {
+  return CreateInstancesFor(&entity, 1, instances, state);
+}
+
+qbResult InstanceRegistry::CreateInstancesFor(
+  const qbEntity* entities, size_t count,
+  const std::vector<qbComponentInstance_>& instances, GameState* state) {
+  // Archetype-stored instances are moved into their table together instead
+  // of one component at a time.
+  thread_local static std::vector<qbComponentInstance_> archetype_instances;
+  archetype_instances.resize(0);
   for (auto& instance : instances) {
     Create(instance.component);
     Component* component = components_[instance.component];
-    component->Create(entity, instance.data);
+    if (component->IsArchetype()) {
+      archetype_instances.push_back(instance);
+    } else {
+      component->CreateBatch(entities, count, instance.data);
+    }
   }
+  archetypes_.Insert(entities, count, archetype_instances);
 
   for (auto& instance : instances) {
     Component* component = components_[instance.component];
-    SendInstanceCreateNotification(entity, component, state);
+    SendInstanceCreateNotification(entities, count, component, state);
   }
 
   return QB_OK;
@@ -68,26 +101,65 @@ qbResult InstanceRegistry::CreateInstanceFor(qbEntity entity,
   Create(component);
   Component* c = components_[component];
   c->Create(entity, instance_data);
-  SendInstanceCreateNotification(entity, c, state);
+  SendInstanceCreateNotification(&entity, 1, c, state);
   return QB_OK;
 }
 
-int InstanceRegistry::DestroyInstancesFor(qbEntity entity, GameState* state) {
-  int destroyed_instances = 0;
-  for (auto component_pair : components_) {
-    Component* component = component_pair.second;
-    if (component->Has(entity)) {
-      SendInstanceDestroyNotification(entity, component, state);
-    }
+qbResult InstanceRegistry::CreateInstancesFor(qbComponent component,
+                                              const qbEntity* entities,
+                                              void* const* instance_data,
+                                              size_t count, GameState* state) {
+  Create(component);
+  Component* c = components_[component];
+  for (size_t i = 0; i < count; ++i) {
+    c->Create(entities[i], instance_data[i]);
+  }
+  SendInstanceCreateNotification(entities, count, c, state);
+  return QB_OK;
+}
+
+int InstanceRegistry::DestroyInstancesFor(qbEntity entity,
+                                          const EntityRegistry& owners,
+                                          GameState* state) {
+  return DestroyInstancesFor(&entity, 1, owners, state);
+}
+
+int InstanceRegistry::DestroyInstancesFor(const qbEntity* entities,
+                                          size_t count,
+                                          const EntityRegistry& owners,
+                                          GameState* state) {
+  // Group the entities by the components they own, so each component is only
+  // visited if at least one entity has an instance of it.
+  for (size_t i = 0; i < count; ++i) {
+    qbEntity entity = entities[i];
+    owners.ForEachComponent(entity, [this, entity](qbComponent component) {
+      if ((size_t)component >= destroyed_.size()) {
+        destroyed_.resize(component + 1);
+      }
+      if (destroyed_[component].empty()) {
+        destroyed_components_.push_back(component);
+      }
+      destroyed_[component].push_back(entity);
+    });
   }
 
-  for (auto component_pair : components_) {
-    Component* component = component_pair.second;
-    if (component->Has(entity)) {
-      component->Destroy(entity);
-      ++destroyed_instances;
+  for (qbComponent component : destroyed_components_) {
+    const std::vector<qbEntity>& owned = destroyed_[component];
+    SendInstanceDestroyNotification(owned.data(), owned.size(),
+                                    components_[component], state);
+  }
+
+  int destroyed_instances = 0;
+  for (qbComponent component : destroyed_components_) {
+    std::vector<qbEntity>& owned = destroyed_[component];
+    Component* c = components_[component];
+    for (qbEntity entity : owned) {
+      c->Destroy(entity);
     }
+    destroyed_instances += (int)owned.size();
+    owned.resize(0);
   }
+  destroyed_components_.resize(0);
   return destroyed_instances;
 }
 
@@ -95,18 +167,26 @@ int InstanceRegistry::DestroyInstanceFor(qbEntity entity,
                                           qbComponent component,
                                           GameState* state) {
   Component* c = components_[component];
-  if (c->Has(entity)) {
-    SendInstanceDestroyNotification(entity, c, state);
-    c->Destroy(entity);
-    return 1;
+  SendInstanceDestroyNotification(&entity, 1, c, state);
+  c->Destroy(entity);
+  return 1;
+}
+
+int InstanceRegistry::DestroyInstancesFor(qbComponent component,
+                                          const qbEntity* entities,
+                                          size_t count, GameState* state) {
+  Component* c = components_[component];
+  SendInstanceDestroyNotification(entities, count, c, state);
+  for (size_t i = 0; i < count; ++i) {
+    c->Destroy(entities[i]);
   }
-  return 0;
+  return (int)count;
 }
 
-qbResult InstanceRegistry::SendInstanceCreateNotification(qbEntity entity, Component* component, GameState* state) const {
-  return component_registry_.SendInstanceCreateNotification(entity, component, state);
+qbResult InstanceRegistry::SendInstanceCreateNotification(const qbEntity* entities, size_t count, Component* component, GameState* state) const {
+  return component_registry_.SendInstanceCreateNotification(entities, count, component, state);
 }
 
-qbResult InstanceRegistry::SendInstanceDestroyNotification(qbEntity entity, Component* component, GameState* state) const {
-  return component_registry_.SendInstanceDestroyNotification(entity, component, state);
-}
\ No newline at end of file
+qbResult InstanceRegistry::SendInstanceDestroyNotification(const qbEntity* entities, size_t count, Component* component, GameState* state) const {
+  return component_registry_.SendInstanceDestroyNotification(entities, count, component, state);
+}
@@ -19,6 +19,7 @@
 #ifndef INSTANCE_REGISTRY__H
 #define INSTANCE_REGISTRY__H
 
+#include "archetype_registry.h"
 #include "defs.h"
 #include "sparse_map.h"
 #include "component_registry.h"
@@ -26,6 +27,7 @@
 #include <atomic>
 #include <unordered_map>
 
+class EntityRegistry;
 class GameState;
 class InstanceRegistry {
 public:
@@ -47,21 +49,60 @@ public:
     qbEntity entity, const std::vector<qbComponentInstance_>& instances,
     GameState* state);
 
+  // Creates the same instances for every given entity. Sends a single create
+  // notification per component.
+  qbResult CreateInstancesFor(
+    const qbEntity* entities, size_t count,
+    const std::vector<qbComponentInstance_>& instances, GameState* state);
+
   qbResult CreateInstanceFor(qbEntity entity, qbComponent component,
                              void* instance_data, GameState* state);
 
-  int DestroyInstancesFor(qbEntity entity, GameState* state);
+  // Creates an instance of the component for every entity, each from its own
+  // data. Sends a single create notification.
+  qbResult CreateInstancesFor(qbComponent component, const qbEntity* entities,
+                              void* const* instance_data, size_t count,
+                              GameState* state);
+
+  // Publishes the instances of every buffered component to its readers.
+  void Publish();
+
+  ArchetypeRegistry* Archetypes() {
+    return &archetypes_;
+  }
+
+  // Destroys all instances the entity owns according to its signature.
+  int DestroyInstancesFor(qbEntity entity, const EntityRegistry& owners,
+                          GameState* state);
+
+  // Destroys all instances of the given entities. Sends a single destroy
+  // notification per component.
+  int DestroyInstancesFor(const qbEntity* entities, size_t count,
+                          const EntityRegistry& owners, GameState* state);
+  // The entity must own an instance of the component.
   int DestroyInstanceFor(qbEntity entity, qbComponent component,
                          GameState* state);
 
-  qbResult SendInstanceCreateNotification(qbEntity entity, Component* component, GameState* state) const;
-  qbResult SendInstanceDestroyNotification(qbEntity entity, Component* component, GameState* state) const;
+  // Every entity must own an instance of the component. Sends a single
+  // destroy notification.
+  int DestroyInstancesFor(qbComponent component, const qbEntity* entities,
+                          size_t count, GameState* state);
+
+  qbResult SendInstanceCreateNotification(const qbEntity* entities, size_t count, Component* component, GameState* state) const;
+  qbResult SendInstanceDestroyNotification(const qbEntity* entities, size_t count, Component* component, GameState* state) const;
 
 private:
   void Create(qbComponent component);
 
   const ComponentRegistry& component_registry_;
+
+  // Scratch space for grouping destroyed entities by component.
+  std::vector<std::vector<qbEntity>> destroyed_;
+  std::vector<qbComponent> destroyed_components_;
+
   SparseMap<Component*, TypedBlockVector<Component*>> components_;
+  std::vector<Component*> buffered_;
+  ArchetypeRegistry archetypes_;
 };
 
 #endif  // INSTANCE_REGISTRY__H
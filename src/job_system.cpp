@@ -0,0 +1,373 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "job_system.h"
+#include "coro.h"
+
+#include <algorithm>
+
+namespace {
+
+const size_t kMaxFreeJobs = 1024;
+
+thread_local JobSystem* tls_system = nullptr;
+thread_local size_t tls_index = 0;
+
+// Finished jobs are kept per thread to be reused by the next submit.
+struct FreeJobs {
+  ~FreeJobs() {
+    for (Job* job : jobs) {
+      delete job;
+    }
+  }
+
+  std::vector<Job*> jobs;
+};
+thread_local FreeJobs free_jobs;
+
+// Used to pick the first victim to steal from.
+size_t NextRandom() {
+  thread_local uint64_t state = 0x9E3779B97F4A7C15ull ^ (uint64_t)&state;
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return (size_t)state;
+}
+
+}
+
+JobSystem::JobSystem(size_t worker_count)
+  : pending_(0), sleeping_(0), stop_(false) {
+  worker_count = std::max(worker_count, (size_t)1);
+  for (size_t i = 0; i < worker_count; ++i) {
+    workers_.emplace_back(new Worker);
+    workers_.back()->pinned_count = 0;
+  }
+  for (size_t i = 0; i < worker_count; ++i) {
+    workers_[i]->thread = std::thread([this, i]() { WorkerLoop(i); });
+  }
+}
+
+JobSystem::~JobSystem() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mu_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+
+  // Unfinished jobs are dropped.
+  Job* job;
+  for (auto& worker : workers_) {
+    while ((job = worker->deque.Pop())) {
+      FreeJob(job);
+    }
+    while (worker->background.try_dequeue(job)) {
+      FreeJob(job);
+    }
+    while (worker->pinned.try_dequeue(job)) {
+      FreeJob(job);
+    }
+  }
+  while (shared_.try_dequeue(job)) {
+    FreeJob(job);
+  }
+  while (background_.try_dequeue(job)) {
+    FreeJob(job);
+  }
+}
+
+JobSystem* JobSystem::Get() {
+  static JobSystem jobs([]() {
+    unsigned count = std::thread::hardware_concurrency();
+    return count > 1 ? count - 1 : 1;
+  }());
+  return &jobs;
+}
+
+size_t JobSystem::WorkerCount() const {
+  return workers_.size();
+}
+
+size_t JobSystem::ThreadIndex() {
+  return tls_index;
+}
+
+void JobSystem::Submit(qbJobFn fn, qbVar arg, qbJobGroup group) {
+  if (group) {
+    group->count.fetch_add(1);
+  }
+  Push(AllocJob(fn, arg, group));
+}
+
+void JobSystem::Then(qbJobGroup after, qbJobFn fn, qbVar arg, qbJobGroup group) {
+  if (group) {
+    group->count.fetch_add(1);
+  }
+  Job* job = AllocJob(fn, arg, group);
+  {
+    std::lock_guard<std::mutex> lock(after->continuations_mu);
+    if (after->count.load() > 0) {
+      after->continuations.push_back(job);
+      return;
+    }
+  }
+  Push(job);
+}
+
+void JobSystem::SubmitBackground(qbJobFn fn, qbVar arg, qbJobGroup group) {
+  if (group) {
+    group->count.fetch_add(1);
+  }
+  pending_.fetch_add(1);
+  if (tls_system == this && tls_index > 0) {
+    workers_[tls_index - 1]->background.enqueue(AllocJob(fn, arg, group));
+  } else {
+    background_.enqueue(AllocJob(fn, arg, group));
+  }
+  Notify(false);
+}
+
+void JobSystem::SubmitPinned(size_t worker, qbJobFn fn, qbVar arg) {
+  Worker* w = workers_[worker - 1].get();
+  w->pinned_count.fetch_add(1);
+  w->pinned.enqueue(AllocJob(fn, arg, nullptr));
+  Notify(true);
+}
+
+void JobSystem::Wait(qbJobGroup group) {
+  while (!group->Done()) {
+    if (!RunOne()) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+bool JobSystem::RunOne() {
+  Worker* self = tls_system == this && tls_index > 0
+    ? workers_[tls_index - 1].get() : nullptr;
+  Job* job = Take(self);
+  if (!job) {
+    return false;
+  }
+  Execute(job);
+  return true;
+}
+
+void JobSystem::ParallelFor(size_t count, size_t grain_size,
+                            const std::function<void(size_t, size_t)>& fn) {
+  if (count == 0) {
+    return;
+  }
+  grain_size = std::max(grain_size, (size_t)1);
+
+  struct Ranges {
+    const std::function<void(size_t, size_t)>* fn;
+    std::atomic<size_t> next;
+    size_t count;
+    size_t grain_size;
+  } ranges;
+  ranges.fn = &fn;
+  ranges.next = 0;
+  ranges.count = count;
+  ranges.grain_size = grain_size;
+
+  // Every job keeps taking ranges until there are none left, so at most one
+  // job per worker is needed.
+  qbJobFn run = [](qbVar arg) {
+    Ranges* r = (Ranges*)arg.p;
+    for (;;) {
+      size_t begin = r->next.fetch_add(r->grain_size);
+      if (begin >= r->count) {
+        return;
+      }
+      (*r->fn)(begin, std::min(begin + r->grain_size, r->count));
+    }
+  };
+
+  size_t range_count = (count + grain_size - 1) / grain_size;
+  size_t job_count = std::min(range_count, workers_.size() + 1);
+  qbJobGroup_ group;
+  for (size_t i = 1; i < job_count; ++i) {
+    Submit(run, qbVoid(&ranges), &group);
+  }
+  run(qbVoid(&ranges));
+  Wait(&group);
+}
+
+void JobSystem::WorkerLoop(size_t index) {
+  Coro main = coro_initialize(&main);
+  tls_system = this;
+  tls_index = index + 1;
+  Worker* self = workers_[index].get();
+
+  // Rotates the order the sources are checked in so that jobs that keep
+  // resubmitting themselves can't starve the others.
+  size_t tick = 0;
+  while (!stop_) {
+    Job* job = nullptr;
+    for (size_t i = 0; i < 3 && !job; ++i) {
+      switch ((tick + i) % 3) {
+        case 0:
+          job = Take(self);
+          break;
+        case 1:
+          if (self->pinned.try_dequeue(job)) {
+            self->pinned_count.fetch_sub(1);
+          }
+          break;
+        case 2:
+          job = TakeBackground(self);
+          break;
+      }
+    }
+    ++tick;
+
+    if (job) {
+      Execute(job);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleep_mu_);
+    sleeping_.fetch_add(1);
+    wake_.wait(lock, [this, self]() {
+      return stop_ || pending_.load() > 0 || self->pinned_count.load() > 0;
+    });
+    sleeping_.fetch_sub(1);
+  }
+}
+
+Job* JobSystem::Take(Worker* self) {
+  Job* job = nullptr;
+  if (self && (job = self->deque.Pop())) {
+    pending_.fetch_sub(1);
+    return job;
+  }
+
+  if (shared_.try_dequeue(job)) {
+    pending_.fetch_sub(1);
+    return job;
+  }
+
+  size_t count = workers_.size();
+  size_t start = NextRandom();
+  for (size_t i = 0; i < count; ++i) {
+    Worker* victim = workers_[(start + i) % count].get();
+    if (victim != self && (job = victim->deque.Steal())) {
+      pending_.fetch_sub(1);
+      return job;
+    }
+  }
+  return nullptr;
+}
+
+Job* JobSystem::TakeBackground(Worker* self) {
+  Job* job = nullptr;
+  if (self->background.try_dequeue(job) || background_.try_dequeue(job)) {
+    pending_.fetch_sub(1);
+    return job;
+  }
+
+  size_t count = workers_.size();
+  size_t start = NextRandom();
+  for (size_t i = 0; i < count; ++i) {
+    Worker* victim = workers_[(start + i) % count].get();
+    if (victim != self && victim->background.try_dequeue(job)) {
+      pending_.fetch_sub(1);
+      return job;
+    }
+  }
+  return nullptr;
+}
+
+void JobSystem::Push(Job* job) {
+  pending_.fetch_add(1);
+  if (tls_system == this && tls_index > 0) {
+    workers_[tls_index - 1]->deque.Push(job);
+  } else {
+    shared_.enqueue(job);
+  }
+  Notify(false);
+}
+
+void JobSystem::Execute(Job* job) {
+  job->fn(job->arg);
+  qbJobGroup group = job->group;
+  FreeJob(job);
+  if (group) {
+    Finish(group);
+  }
+}
+
+void JobSystem::Finish(qbJobGroup group) {
+  // The group may be destroyed as soon as it is done, so "finishing" is the
+  // last thing touched.
+  group->finishing.fetch_add(1);
+  if (group->count.fetch_sub(1) != 1) {
+    group->finishing.fetch_sub(1, std::memory_order_release);
+    return;
+  }
+
+  std::vector<Job*> continuations;
+  {
+    std::lock_guard<std::mutex> lock(group->continuations_mu);
+    continuations.swap(group->continuations);
+  }
+  group->finishing.fetch_sub(1, std::memory_order_release);
+  for (Job* job : continuations) {
+    Push(job);
+  }
+}
+
+void JobSystem::Notify(bool all) {
+  if (sleeping_.load() == 0) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(sleep_mu_);
+  }
+  if (all) {
+    wake_.notify_all();
+  } else {
+    wake_.notify_one();
+  }
+}
+
+Job* JobSystem::AllocJob(qbJobFn fn, qbVar arg, qbJobGroup group) {
+  Job* job;
+  if (free_jobs.jobs.empty()) {
+    job = new Job;
+  } else {
+    job = free_jobs.jobs.back();
+    free_jobs.jobs.pop_back();
+  }
+  job->fn = fn;
+  job->arg = arg;
+  job->group = group;
+  return job;
+}
+
+void JobSystem::FreeJob(Job* job) {
+  if (free_jobs.jobs.size() < kMaxFreeJobs) {
+    free_jobs.jobs.push_back(job);
+  } else {
+    delete job;
+  }
+}
@@ -0,0 +1,151 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef JOB_SYSTEM__H
+#define JOB_SYSTEM__H
+
+#include <cubez/cubez.h>
+
+#include "concurrentqueue.h"
+#include "work_stealing_deque.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Job {
+  qbJobFn fn;
+  qbVar arg;
+  qbJobGroup group;
+};
+
+// Counts the unfinished jobs submitted to it. Continuations are submitted once
+// the count reaches zero.
+struct qbJobGroup_ {
+  qbJobGroup_() : count(0), finishing(0) {}
+
+  // True once all jobs have finished and no thread touches the group anymore.
+  // Only then is it safe to destroy.
+  bool Done() const {
+    return count.load(std::memory_order_acquire) == 0 &&
+           finishing.load(std::memory_order_acquire) == 0;
+  }
+
+  std::atomic<size_t> count;
+
+  // Threads that are finishing a job of the group. The last job still has to
+  // take the continuations after the count reached zero.
+  std::atomic<size_t> finishing;
+  std::mutex continuations_mu;
+  std::vector<Job*> continuations;
+};
+
+// A fixed number of worker threads, each with its own work-stealing deque.
+// Jobs submitted from a worker are pushed to that worker's deque, jobs from
+// any other thread go to a shared queue. Idle workers steal from each other.
+class JobSystem {
+ public:
+  explicit JobSystem(size_t worker_count);
+  ~JobSystem();
+
+  // The job system shared by the engine. Starts max(1, cores - 1) workers on
+  // first use.
+  static JobSystem* Get();
+
+  // Runs "fn(arg)" on any thread that runs jobs. If "group" is not null the
+  // job is counted by the group until it finishes.
+  void Submit(qbJobFn fn, qbVar arg, qbJobGroup group);
+
+  // Submits "fn(arg)" once all jobs in "after" have finished. The job is
+  // counted by "group" from the time of this call.
+  void Then(qbJobGroup after, qbJobFn fn, qbVar arg, qbJobGroup group);
+
+  // Runs "fn(arg)" on a worker thread. Jobs submitted from a worker are queued
+  // on that worker in FIFO order and stolen by idle workers. Once started, a
+  // job can resubmit itself with "SubmitPinned" to keep running on the same
+  // worker. These jobs are never run by threads waiting on a group. If "group"
+  // is not null the job is counted by the group until it finishes.
+  void SubmitBackground(qbJobFn fn, qbVar arg, qbJobGroup group);
+  void SubmitPinned(size_t worker, qbJobFn fn, qbVar arg);
+
+  // Runs other jobs on the calling thread until the group has no unfinished
+  // jobs.
+  void Wait(qbJobGroup group);
+
+  // Runs one pending job on the calling thread. Returns false if there was no
+  // job to run.
+  bool RunOne();
+
+  // Calls "fn(begin, end)" with ranges of at most "grain_size" covering
+  // [0, count). The calling thread runs ranges as well. Returns once all
+  // ranges have finished.
+  void ParallelFor(size_t count, size_t grain_size,
+                   const std::function<void(size_t, size_t)>& fn);
+
+  size_t WorkerCount() const;
+
+  // 0 on threads that are not workers, otherwise 1 + the worker's index.
+  static size_t ThreadIndex();
+
+ private:
+  struct Worker {
+    WorkStealingDeque<Job> deque;
+
+    // Background jobs submitted by this worker. Other workers steal from it.
+    moodycamel::ConcurrentQueue<Job*> background;
+
+    // Jobs that may only be run by this worker.
+    moodycamel::ConcurrentQueue<Job*> pinned;
+    std::atomic<size_t> pinned_count;
+
+    std::thread thread;
+  };
+
+  void WorkerLoop(size_t index);
+
+  // Takes a job that any thread may run.
+  Job* Take(Worker* self);
+
+  // Takes a background job, preferring the worker's own.
+  Job* TakeBackground(Worker* self);
+
+  void Push(Job* job);
+  void Execute(Job* job);
+  void Finish(qbJobGroup group);
+  void Notify(bool all);
+
+  static Job* AllocJob(qbJobFn fn, qbVar arg, qbJobGroup group);
+  static void FreeJob(Job* job);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  moodycamel::ConcurrentQueue<Job*> shared_;
+  moodycamel::ConcurrentQueue<Job*> background_;
+
+  // Number of jobs in the deques and shared queues.
+  std::atomic<size_t> pending_;
+  std::atomic<size_t> sleeping_;
+  std::atomic<bool> stop_;
+  std::mutex sleep_mu_;
+  std::condition_variable wake_;
+};
+
+#endif  // JOB_SYSTEM__H
@@ -208,6 +208,14 @@ qbResult PrivateUniverse::disable_system(qbSystem system) {
   return ProgramImpl::FromRaw(p)->DisableSystem(system);
 }
 
+size_t PrivateUniverse::system_workercount(qbSystem system) {
+  return SystemImpl::FromRaw(system)->WorkerCount();
+}
+
+void* PrivateUniverse::system_scratch(qbSystem system, size_t worker) {
+  return SystemImpl::FromRaw(system)->Scratch(worker);
+}
+
 qbResult PrivateUniverse::event_create(qbEvent* event, qbEventAttr attr) {
   qbProgram* p = programs_->GetProgram(attr->program);
   DEBUG_ASSERT(p, QB_ERROR_NULL_POINTER);
@@ -248,6 +256,14 @@ qbResult PrivateUniverse::event_send(qbEvent event, void* message) {
   return ((Event*)event->event)->SendMessage(message);
 }
 
+void* PrivateUniverse::event_alloc(qbEvent event) {
+  return ((Event*)event->event)->AllocMessage();
+}
+
+qbResult PrivateUniverse::event_commit(qbEvent event, void* message) {
+  return ((Event*)event->event)->CommitMessage(message);
+}
+
 qbResult PrivateUniverse::event_sendsync(qbEvent event, void* message) {
   return ((Event*)event->event)->SendMessageSync(message, WorkingScene());
 }
@@ -260,6 +276,17 @@ qbResult PrivateUniverse::entity_destroy(qbEntity entity) {
   return WorkingScene()->EntityDestroy(entity);
 }
 
+qbResult PrivateUniverse::entity_createbatch(size_t count,
+                                             const qbEntityAttr_& attr,
+                                             qbEntity* entities) {
+  return WorkingScene()->EntityCreateBatch(count, attr, entities);
+}
+
+qbResult PrivateUniverse::entity_destroybatch(const qbEntity* entities,
+                                              size_t count) {
+  return WorkingScene()->EntityDestroyBatch(entities, count);
+}
+
 qbResult PrivateUniverse::entity_find(qbEntity* entity, qbId entity_id) {
   return WorkingScene()->EntityFind(entity, entity_id);
 }
@@ -269,6 +296,26 @@ bool PrivateUniverse::entity_hascomponent(qbEntity entity,
   return WorkingScene()->EntityHasComponent(entity, component);
 }
 
+bool PrivateUniverse::entity_hasall(qbEntity entity,
+                                    const qbComponent* components,
+                                    size_t count) {
+  ComponentSignature signature;
+  for (size_t i = 0; i < count; ++i) {
+    signature.Set(components[i]);
+  }
+  return WorkingScene()->EntityHasAll(entity, signature);
+}
+
+bool PrivateUniverse::entity_hasany(qbEntity entity,
+                                    const qbComponent* components,
+                                    size_t count) {
+  ComponentSignature signature;
+  for (size_t i = 0; i < count; ++i) {
+    signature.Set(components[i]);
+  }
+  return WorkingScene()->EntityHasAny(entity, signature);
+}
+
 qbResult PrivateUniverse::entity_addcomponent(qbEntity entity,
                                               qbComponent component,
                                               void* instance_data) {
@@ -299,9 +346,12 @@ qbResult PrivateUniverse::instance_oncreate(qbComponent component,
     qbInstanceOnCreateEvent_* event =
       (qbInstanceOnCreateEvent_*)frame->event;
     qbInstanceOnCreate on_create = (qbInstanceOnCreate)frame->state;
-    qbInstance_ instance = SystemImpl::FromRaw(frame->system)->FindInstance(
-      event->entity, event->component, event->state);
-    on_create(&instance);
+    SystemImpl* self = SystemImpl::FromRaw(frame->system);
+    for (size_t i = 0; i < event->count; ++i) {
+      qbInstance_ instance = self->FindInstance(
+        event->entities[i], event->component, event->state);
+      on_create(&instance);
+    }
   });
   qbSystem system;
   qb_system_create(&system, attr);
@@ -321,9 +371,12 @@ qbResult PrivateUniverse::instance_ondestroy(qbComponent component,
     qbInstanceOnDestroyEvent_* event =
       (qbInstanceOnDestroyEvent_*)frame->event;
     qbInstanceOnDestroy on_destroy = (qbInstanceOnDestroy)frame->state;
-    qbInstance_ instance = SystemImpl::FromRaw(frame->system)->FindInstance(
-      event->entity, event->component, event->state);
-    on_destroy(&instance);
+    SystemImpl* self = SystemImpl::FromRaw(frame->system);
+    for (size_t i = 0; i < event->count; ++i) {
+      qbInstance_ instance = self->FindInstance(
+        event->entities[i], event->component, event->state);
+      on_destroy(&instance);
+    }
   });
   qbSystem system;
   qb_system_create(&system, attr);
@@ -345,6 +398,10 @@ qbResult PrivateUniverse::instance_getconst(qbInstance instance, void* pbuffer)
 
 qbResult PrivateUniverse::instance_getmutable(qbInstance instance, void* pbuffer) {
   if (instance->is_mutable) {
+    if (!instance->is_touched && instance->data) {
+      instance->component->Touch(instance->entity);
+      instance->is_touched = true;
+    }
     *(void**)pbuffer = instance->data;
   } else {
     *(void**)pbuffer = nullptr;
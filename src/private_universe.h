@@ -108,6 +108,9 @@ class PrivateUniverse {
   qbResult enable_system(qbSystem system);
   qbResult disable_system(qbSystem system);
 
+  size_t system_workercount(qbSystem system);
+  void* system_scratch(qbSystem system, size_t worker);
+
 
   // Events.
   qbResult event_create(qbEvent* event, qbEventAttr attr);
@@ -120,13 +123,22 @@ class PrivateUniverse {
   qbResult event_unsubscribe(qbEvent event, qbSystem system);
 
   qbResult event_send(qbEvent event, void* message);
+  void* event_alloc(qbEvent event);
+  qbResult event_commit(qbEvent event, void* message);
   qbResult event_sendsync(qbEvent event, void* message);
 
   // Entity manipulation.
   qbResult entity_create(qbEntity* entity, const qbEntityAttr_& attr);
   qbResult entity_destroy(qbEntity entity);
+  qbResult entity_createbatch(size_t count, const qbEntityAttr_& attr,
+                              qbEntity* entities);
+  qbResult entity_destroybatch(const qbEntity* entities, size_t count);
   qbResult entity_find(qbEntity* entity, qbId entity_id);
   bool entity_hascomponent(qbEntity entity, qbComponent component);
+  bool entity_hasall(qbEntity entity, const qbComponent* components,
+                     size_t count);
+  bool entity_hasany(qbEntity entity, const qbComponent* components,
+                     size_t count);
   qbResult entity_addcomponent(qbEntity entity, qbComponent component,
                                void* instance_data);
   qbResult entity_removecomponent(qbEntity entity, qbComponent component);
@@ -42,6 +42,7 @@ qbSystem ProgramImpl::CreateSystem(const qbSystemAttr_& attr) {
 
   qbSystem system = AllocSystem(systems_.size(), attr);
   systems_.push_back(system);
+  loop_systems_.Register(system, attr);
   EnableSystem(system);
   return system;
 }
@@ -54,8 +55,7 @@ qbResult ProgramImpl::EnableSystem(qbSystem system) {
   DisableSystem(system);
 
   if (system->policy.trigger == qbTrigger::QB_TRIGGER_LOOP) {
-    loop_systems_.push_back(system);
-    std::sort(loop_systems_.begin(), loop_systems_.end());
+    loop_systems_.Enable(system);
   } else if (system->policy.trigger == qbTrigger::QB_TRIGGER_EVENT) {
     event_systems_.insert(system);
   } else {
@@ -66,12 +66,8 @@ qbResult ProgramImpl::EnableSystem(qbSystem system) {
 }
 
 qbResult ProgramImpl::DisableSystem(qbSystem system) {
-  auto found = std::find(loop_systems_.begin(), loop_systems_.end(), system);
-  if (found != loop_systems_.end()) {
-    loop_systems_.erase(found);
-  } else {
-    event_systems_.erase(system);
-  }
+  loop_systems_.Disable(system);
+  event_systems_.erase(system);
   return QB_OK;
 }
 
@@ -101,9 +97,7 @@ void ProgramImpl::Ready() {
 
 void ProgramImpl::Run(GameState* state) {
   events_.FlushAll(state);
-  for(qbSystem p : loop_systems_) {
-    SystemImpl::FromRaw(p)->Run(state);
-  }
+  loop_systems_.Run(state);
 }
 
 void ProgramImpl::Done() {
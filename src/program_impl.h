@@ -23,6 +23,9 @@
 #include "component_registry.h"
 #include "event_registry.h"
 #include "game_state.h"
+#include "system_scheduler.h"
+
+#include <set>
 
 class ProgramImpl {
  public:
@@ -62,7 +65,7 @@ class ProgramImpl {
 
   std::set<qbComponent> mutables_;
   std::vector<qbSystem> systems_;
-  std::vector<qbSystem> loop_systems_;
+  SystemScheduler loop_systems_;
   std::set<qbSystem> event_systems_;
 };
 
@@ -21,8 +21,7 @@
 
 #include <cstring>
 
-ProgramRegistry::ProgramRegistry() :
-    program_threads_(std::thread::hardware_concurrency()) {
+ProgramRegistry::ProgramRegistry() {
   id_ = 0;
 }
 
@@ -33,7 +32,7 @@ qbId ProgramRegistry::CreateProgram(const char* program) {
   programs_[id] = p;
 
   if (id > 0) {
-    program_threads_[id] = new Task(p);
+    program_jobs_[id] = p;
   } else {
     main_program_ = p;
   }
@@ -42,21 +41,28 @@ qbId ProgramRegistry::CreateProgram(const char* program) {
 
 qbResult ProgramRegistry::DetatchProgram(qbId program, const std::function<GameState*()>& game_state_fn) {
   if (programs_.has(program)) {
-    qbProgram* to_detach = GetProgram(program);
-    std::unique_ptr<ProgramThread> program_thread(
-      new ProgramThread(to_detach));
-    program_thread->Run(game_state_fn);
-    detached_[program] = std::move(program_thread);
+    std::unique_ptr<DetachedProgram> detached(new DetachedProgram);
+    detached->program = GetProgram(program);
+    detached->game_state_fn = game_state_fn;
+    detached->is_running = true;
+    JobSystem::Get()->SubmitBackground(RunDetached, qbVoid(detached.get()), &detached->group);
+
+    detached_[program] = std::move(detached);
     programs_.erase(program);
-    program_threads_.erase(program);
+    program_jobs_.erase(program);
   }
   return QB_OK;
 }
 
 qbResult ProgramRegistry::JoinProgram(qbId program) {  
-  qbProgram* prog = programs_[program] = detached_.find(program)->second->Release();
-  program_threads_[program] = new Task(prog);
-  detached_.erase(detached_.find(program));
+  auto found = detached_.find(program);
+  DetachedProgram* detached = found->second.get();
+  detached->is_running = false;
+  JobSystem::Get()->Wait(&detached->group);
+
+  qbProgram* prog = programs_[program] = detached->program;
+  program_jobs_[program] = prog;
+  detached_.erase(found);
   return QB_OK;
 }
 
@@ -68,22 +74,41 @@ qbProgram* ProgramRegistry::GetProgram(qbId id) {
 }
 
 void ProgramRegistry::Run(GameState* state) {
-  for (auto& task : program_threads_) {
-    task.second->Ready();
+  for (auto& program : program_jobs_) {
+    ProgramImpl::FromRaw(program.second)->Ready();
+  }
+
+  frame_jobs_.resize(0);
+  for (auto& program : program_jobs_) {
+    frame_jobs_.push_back({ program.second, state });
   }
 
-  for (auto& task : program_threads_) {
-    task.second->Run(state);
+  qbJobGroup_ group;
+  for (ProgramJob& job : frame_jobs_) {
+    JobSystem::Get()->Submit(RunProgramJob, qbVoid(&job), &group);
   }
 
   RunProgram(main_program_->id, state);
 
-  for (auto& task : program_threads_) {
-    task.second->Wait();
+  JobSystem::Get()->Wait(&group);
+
+  for (auto& program : program_jobs_) {
+    ProgramImpl::FromRaw(program.second)->Done();
   }
+}
+
+void ProgramRegistry::RunProgramJob(qbVar arg) {
+  ProgramJob* job = (ProgramJob*)arg.p;
+  ProgramImpl::FromRaw(job->program)->Run(job->state);
+}
 
-  for (auto& task : program_threads_) {
-    task.second->Done();
+void ProgramRegistry::RunDetached(qbVar arg) {
+  DetachedProgram* detached = (DetachedProgram*)arg.p;
+  ProgramImpl::FromRaw(detached->program)->Run(detached->game_state_fn());
+  // Background jobs are never run by threads waiting on a group, so a frame
+  // of the program can't stall the main loop.
+  if (detached->is_running) {
+    JobSystem::Get()->SubmitBackground(RunDetached, arg, &detached->group);
   }
 }
 
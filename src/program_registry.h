@@ -20,14 +20,15 @@
 #define PROGRAM_REGISTRY__H
 
 #include "defs.h"
+#include "job_system.h"
 #include "program_impl.h"
-#include "program_thread.h"
-#include "thread_pool.h"
-#include "task.h"
 
 #include <algorithm>
-#include <future>
+#include <atomic>
+#include <functional>
 #include <map>
+#include <memory>
+#include <unordered_map>
 
 class ProgramRegistry {
  public:
@@ -46,6 +47,22 @@ class ProgramRegistry {
   qbResult RunProgram(qbId program, GameState* state);
 
  private:
+  // A program that reruns itself as a job until it is joined.
+  struct DetachedProgram {
+    qbProgram* program;
+    std::function<GameState*()> game_state_fn;
+    std::atomic_bool is_running;
+    qbJobGroup_ group;
+  };
+
+  struct ProgramJob {
+    qbProgram* program;
+    GameState* state;
+  };
+
+  static void RunProgramJob(qbVar arg);
+  static void RunDetached(qbVar arg);
+
   void RunMain(GameState* state);
 
   qbProgram* AllocProgram(qbId id, const char* name);
@@ -53,8 +70,11 @@ class ProgramRegistry {
   std::atomic_long id_;
   qbProgram* main_program_;
   SparseMap<qbProgram*, std::vector<qbProgram*>> programs_;
-  std::unordered_map<size_t, std::unique_ptr<ProgramThread>> detached_;
-  std::unordered_map<size_t, Task*> program_threads_;
+  std::unordered_map<size_t, std::unique_ptr<DetachedProgram>> detached_;
+
+  // Programs other than the main program. Each is run as a job every frame.
+  std::unordered_map<size_t, qbProgram*> program_jobs_;
+  std::vector<ProgramJob> frame_jobs_;
 };
 
 #endif  // PROGRAM_REGISTRY__H
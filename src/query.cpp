@@ -0,0 +1,122 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "query.h"
+
+#include "archetype_registry.h"
+#include "entity_registry.h"
+
+#include <algorithm>
+
+Query::Query(const std::vector<qbComponent>& components,
+             const std::vector<qbComponent>& tags, bool is_archetype)
+    : components_(components),
+      signature_(components),
+      is_archetype_(is_archetype) {
+  for (qbComponent component : components) {
+    if (std::find(tags.begin(), tags.end(), component) == tags.end()) {
+      columns_.push_back(component);
+    }
+  }
+}
+
+void Query::Insert(qbEntity entity) {
+  if (!entities_.has(entity)) {
+    entities_.insert(entity);
+  }
+}
+
+void Query::Erase(qbEntity entity) {
+  if (entities_.has(entity)) {
+    entities_.erase(entity);
+  }
+}
+
+void Query::AddArchetype(Archetype* archetype) {
+  if (archetype->ContainsAll(columns_)) {
+    archetypes_.push_back(archetype);
+  }
+}
+
+QueryRegistry::~QueryRegistry() {
+  for (auto& query : queries_) {
+    delete query.second;
+  }
+}
+
+Query* QueryRegistry::Find(const std::vector<qbComponent>& components) const {
+  auto found = queries_.find(components);
+  return found == queries_.end() ? nullptr : found->second;
+}
+
+Query* QueryRegistry::Create(const std::vector<qbComponent>& components,
+                             const std::vector<qbComponent>& tags,
+                             bool is_archetype) {
+  Query* query = new Query(components, tags, is_archetype);
+  queries_[components] = query;
+  if (is_archetype) {
+    archetype_queries_.push_back(query);
+  } else {
+    for (qbComponent component : components) {
+      if ((size_t)component >= by_component_.size()) {
+        by_component_.resize(component + 1);
+      }
+      by_component_[component].push_back(query);
+    }
+  }
+  return query;
+}
+
+void QueryRegistry::OnAdd(const qbEntity* entities, size_t count,
+                          qbComponent component,
+                          const EntityRegistry& owners) {
+  if ((size_t)component >= by_component_.size()) {
+    return;
+  }
+  for (Query* query : by_component_[component]) {
+    for (size_t i = 0; i < count; ++i) {
+      if (owners.HasAll(entities[i], query->Signature())) {
+        query->Insert(entities[i]);
+      }
+    }
+  }
+}
+
+void QueryRegistry::OnRemove(qbEntity entity, qbComponent component) {
+  if ((size_t)component >= by_component_.size()) {
+    return;
+  }
+  for (Query* query : by_component_[component]) {
+    query->Erase(entity);
+  }
+}
+
+void QueryRegistry::OnClear(qbEntity entity, const EntityRegistry& owners) {
+  if (by_component_.empty()) {
+    return;
+  }
+  owners.ForEachComponent(entity, [this, entity](qbComponent component) {
+    OnRemove(entity, component);
+  });
+}
+
+void QueryRegistry::OnCreateArchetype(Archetype* archetype) {
+  for (Query* query : archetype_queries_) {
+    query->AddArchetype(archetype);
+  }
+}
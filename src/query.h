@@ -0,0 +1,137 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef QUERY__H
+#define QUERY__H
+
+#include <cubez/cubez.h>
+#include "component_signature.h"
+#include "sparse_set.h"
+
+#include <map>
+#include <vector>
+
+class Archetype;
+class ArchetypeRegistry;
+class EntityRegistry;
+
+// The cached result of an inner join over a set of components. If all
+// components other than tags are archetype-stored, the query holds the
+// matching tables and the tags have to be checked per row. Otherwise it holds
+// the matching entities, which the owning QueryRegistry keeps up to date as
+// instances are created and destroyed.
+// Not thread-safe.
+class Query {
+ public:
+  // The components must be sorted and unique. "tags" are the components that
+  // are tags.
+  Query(const std::vector<qbComponent>& components,
+        const std::vector<qbComponent>& tags, bool is_archetype);
+
+  const std::vector<qbComponent>& Components() const {
+    return components_;
+  }
+
+  const ComponentSignature& Signature() const {
+    return signature_;
+  }
+
+  bool IsArchetype() const {
+    return is_archetype_;
+  }
+
+  // Matching entities. Only valid if the query is not archetype-stored. The
+  // pointer is invalidated by any structural change.
+  const qbEntity* Entities() const {
+    return (const qbEntity*)entities_.data();
+  }
+
+  size_t Size() const {
+    return entities_.size();
+  }
+
+  bool Has(qbEntity entity) {
+    return entities_.has(entity);
+  }
+
+  void Insert(qbEntity entity);
+  void Erase(qbEntity entity);
+
+  // Matching tables, including empty ones. Only valid if the query is
+  // archetype-stored.
+  const std::vector<Archetype*>& Archetypes() const {
+    return archetypes_;
+  }
+
+  // Adds the table if it holds every component the query joins over.
+  void AddArchetype(Archetype* archetype);
+
+ private:
+  const std::vector<qbComponent> components_;
+  // The components stored in archetype columns.
+  std::vector<qbComponent> columns_;
+  const ComponentSignature signature_;
+  const bool is_archetype_;
+
+  SparseSet entities_;
+
+  std::vector<Archetype*> archetypes_;
+};
+
+// Owns all queries for a single GameState. Queries are shared between systems
+// that join over the same components.
+class QueryRegistry {
+ public:
+  QueryRegistry() {}
+  ~QueryRegistry();
+
+  QueryRegistry(const QueryRegistry&) = delete;
+  QueryRegistry& operator=(const QueryRegistry&) = delete;
+
+  // Returns nullptr if there is no query for the components.
+  Query* Find(const std::vector<qbComponent>& components) const;
+
+  // Creates an empty query. The caller is responsible for filling it with the
+  // entities that already match.
+  Query* Create(const std::vector<qbComponent>& components,
+                const std::vector<qbComponent>& tags, bool is_archetype);
+
+  // Called after the component was added to the entities' signatures.
+  void OnAdd(const qbEntity* entities, size_t count, qbComponent component,
+             const EntityRegistry& owners);
+
+  // Called before the component is removed from the entity's signature.
+  void OnRemove(qbEntity entity, qbComponent component);
+
+  // Called before the entity's signature is cleared.
+  void OnClear(qbEntity entity, const EntityRegistry& owners);
+
+  // Called after a table was created. Tables are only created by structural
+  // changes, so archetype queries are never changed while systems read them.
+  void OnCreateArchetype(Archetype* archetype);
+
+ private:
+  std::map<std::vector<qbComponent>, Query*> queries_;
+
+  std::vector<Query*> archetype_queries_;
+
+  // Entity queries indexed by every component they join over.
+  std::vector<std::vector<Query*>> by_component_;
+};
+
+#endif  // QUERY__H
@@ -0,0 +1,150 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef SPARSE_INDEX__H
+#define SPARSE_INDEX__H
+
+#include <cubez/cubez.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// Maps keys to 32-bit dense slots. Only the low 32 bits of a key are used, so
+// containers have to verify that the dense key at the returned slot matches.
+// The key space is split into fixed-size pages that are allocated on the first
+// write. Unallocated pages all point to a single shared page of empty slots,
+// so lookups never have to check for a missing page.
+class SparseIndex {
+ public:
+  static const uint32_t kEmpty = 0xFFFFFFFF;
+  static const size_t kPageBits = 10;
+  static const size_t kPageSize = (size_t)1 << kPageBits;
+  static const size_t kPageMask = kPageSize - 1;
+
+  SparseIndex() {}
+
+  SparseIndex(const SparseIndex& other) {
+    copy(other);
+  }
+
+  SparseIndex(SparseIndex&& other) : pages_(std::move(other.pages_)) {}
+
+  ~SparseIndex() {
+    clear();
+  }
+
+  SparseIndex& operator=(const SparseIndex& other) {
+    if (this != &other) {
+      clear();
+      copy(other);
+    }
+    return *this;
+  }
+
+  SparseIndex& operator=(SparseIndex&& other) {
+    if (this != &other) {
+      clear();
+      pages_ = std::move(other.pages_);
+    }
+    return *this;
+  }
+
+  // Returns the slot for the key or kEmpty.
+  uint32_t get(uint64_t key) const {
+    size_t page = (uint32_t)key >> kPageBits;
+    if (page >= pages_.size()) {
+      return kEmpty;
+    }
+    return pages_[page][key & kPageMask];
+  }
+
+  void set(uint64_t key, uint32_t slot) {
+    size_t page = (uint32_t)key >> kPageBits;
+    if (page >= pages_.size()) {
+      if (slot == kEmpty) {
+        return;
+      }
+      pages_.resize(page + 1, empty_page());
+    }
+
+    uint32_t* p = pages_[page];
+    if (p == empty_page()) {
+      if (slot == kEmpty) {
+        return;
+      }
+      p = alloc_page();
+      pages_[page] = p;
+    }
+    p[key & kPageMask] = slot;
+  }
+
+  // Reserves room in the page table for keys up to the given count. Pages are
+  // still allocated lazily.
+  void reserve(size_t count) {
+    pages_.reserve((count + kPageSize - 1) >> kPageBits);
+  }
+
+  // Frees all pages.
+  void clear() {
+    for (uint32_t* page : pages_) {
+      if (page != empty_page()) {
+        delete[] page;
+      }
+    }
+    pages_.clear();
+  }
+
+  // Number of pages that have been allocated.
+  size_t page_count() const {
+    return std::count_if(pages_.begin(), pages_.end(),
+                         [](uint32_t* p) { return p != empty_page(); });
+  }
+
+  // Number of bytes used by the page table and the allocated pages.
+  size_t memory_usage() const {
+    return pages_.capacity() * sizeof(uint32_t*) +
+           page_count() * kPageSize * sizeof(uint32_t);
+  }
+
+ private:
+  static uint32_t* empty_page() {
+    static const std::vector<uint32_t> empty(kPageSize, (uint32_t)kEmpty);
+    return (uint32_t*)empty.data();
+  }
+
+  static uint32_t* alloc_page() {
+    uint32_t* page = new uint32_t[kPageSize];
+    memset(page, 0xFF, kPageSize * sizeof(uint32_t));
+    return page;
+  }
+
+  void copy(const SparseIndex& other) {
+    pages_.resize(other.pages_.size(), empty_page());
+    for (size_t i = 0; i < other.pages_.size(); ++i) {
+      if (other.pages_[i] != empty_page()) {
+        pages_[i] = alloc_page();
+        memcpy(pages_[i], other.pages_[i], kPageSize * sizeof(uint32_t));
+      }
+    }
+  }
+
+  std::vector<uint32_t*> pages_;
+};
+
+#endif  // SPARSE_INDEX__H
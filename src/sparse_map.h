@@ -23,6 +23,7 @@
 #include <vector>
 #include "block_vector.h"
 #include "byte_vector.h"
+#include "sparse_index.h"
 
 template<class Value_, class Container_>
 class SparseMap {
@@ -104,7 +105,7 @@ public:
     friend class SparseMap;
   };
 
-  SparseMap() : sparse_(16, -1) {}
+  SparseMap() {}
 
   SparseMap(const SparseMap& other) {
     copy(other);
@@ -138,11 +139,11 @@ public:
     if (!has(key)) {
       insert(key, Value{});
     }
-    return dense_values_[sparse_[key]];
+    return dense_values_[sparse_.get(key)];
   }
 
   const Value& operator[](uint64_t key) const {
-    return dense_values_[sparse_[key]];
+    return dense_values_[sparse_.get(key)];
   }
 
   iterator begin() {
@@ -162,46 +163,39 @@ public:
   }
 
   void insert(uint64_t key, const Value& value) {
-    if (key >= sparse_.size()) {
-      sparse_.resize(key + 1, -1);
-    }
-    sparse_[key] = dense_.size();
+    sparse_.set(key, (uint32_t)dense_.size());
     dense_.push_back(key);
     dense_values_.push_back(value);
   }
 
   void insert(uint64_t key, Value&& value) {
-    if (key >= sparse_.size()) {
-      sparse_.resize(key + 1, -1);
-    }
-    sparse_[key] = dense_.size();
+    sparse_.set(key, (uint32_t)dense_.size());
     dense_.push_back(key);
     dense_values_.push_back(std::move(value));
   }
 
   void erase(uint64_t key) {
     // Erase the old value.
-    dense_values_[sparse_[key]] = std::move(dense_values_.back());
+    dense_values_[sparse_.get(key)] = std::move(dense_values_.back());
     dense_values_.pop_back();
 
     // Erase from the sparse set.
-    dense_[sparse_[key]] = dense_.back();
-    sparse_[dense_.back()] = sparse_[key];
+    uint32_t slot = sparse_.get(key);
+    dense_[slot] = dense_.back();
+    sparse_.set(dense_.back(), slot);
     dense_.pop_back();
-    sparse_[key] = -1;
+    sparse_.set(key, SparseIndex::kEmpty);
   }
 
   void clear() {
     dense_values_.resize(0);
-    sparse_.resize(0);
+    sparse_.clear();
     dense_.resize(0);
   }
 
   bool has(uint64_t key) {
-    if (key >= sparse_.size()) {
-      return false;
-    }
-    return sparse_[key] != -1;
+    uint32_t slot = sparse_.get(key);
+    return slot != SparseIndex::kEmpty && dense_[slot] == key;
   }
 
   uint64_t size() const {
@@ -209,8 +203,13 @@ public:
   }
 
   size_t capacity() const {
-    return std::max(std::max(sparse_.capacity(), dense_values_.capacity()), 
-                    dense_.capacity());
+    return std::max(dense_values_.capacity(), dense_.capacity());
+  }
+
+  // Number of bytes used by the sparse index and the dense keys. Does not
+  // include the values.
+  size_t memory_usage() const {
+    return sparse_.memory_usage() + dense_.capacity() * sizeof(uint64_t);
   }
 
 private:
@@ -227,7 +226,7 @@ private:
   }
 
   Container_ dense_values_;
-  std::vector<qbId> sparse_;
+  SparseIndex sparse_;
   std::vector<uint64_t> dense_;
 };
 
@@ -311,7 +310,7 @@ public:
   };
 
   SparseMap(size_t element_size)
-    : element_size_(element_size), sparse_(16, -1),
+    : element_size_(element_size),
     dense_values_(element_size) {}
 
   SparseMap(const SparseMap& other) : dense_values_(other.element_size_) {
@@ -346,11 +345,40 @@ public:
     if (!has(key)) {
       insert(key, nullptr);
     }
-    return dense_values_[sparse_[key]];
+    return dense_values_[sparse_.get(key)];
   }
 
   const void* operator[](uint64_t key) const {
-    return dense_values_[sparse_[key]];
+    return dense_values_[sparse_.get(key)];
+  }
+
+  // Returns the value for a key that is known to be in the map.
+  void* at(uint64_t key) {
+    return dense_values_[sparse_.get(key)];
+  }
+
+  // Dense keys and values, indexed by insertion slot.
+  const uint64_t* keys() const {
+    return dense_.data();
+  }
+
+  void* value(size_t slot) {
+    return dense_values_[slot];
+  }
+
+  // Number of values starting at "slot" that are adjacent in memory.
+  size_t contiguous(size_t slot) const {
+    return dense_values_.contiguous(slot);
+  }
+
+  // The slot of a key that is known to be in the map.
+  size_t slot(uint64_t key) const {
+    return sparse_.get(key);
+  }
+
+  // The storage block holding the value at "slot".
+  size_t block(size_t slot) const {
+    return dense_values_.block(slot);
   }
 
   iterator begin() {
@@ -370,37 +398,33 @@ public:
   }
 
   void insert(uint64_t key, void* value) {
-    if (key >= sparse_.size()) {
-      sparse_.resize(key + 1, -1);
-    }
-    sparse_[key] = dense_.size();
+    sparse_.set(key, (uint32_t)dense_.size());
     dense_.push_back(key);
     dense_values_.push_back(value);
   }
 
   void erase(uint64_t key) {
     // Erase the old value.
-    memmove(dense_values_[sparse_[key]], dense_values_.back(), element_size_);
+    memmove(dense_values_[sparse_.get(key)], dense_values_.back(), element_size_);
     dense_values_.pop_back();
 
     // Erase from the sparse set.
-    dense_[sparse_[key]] = dense_.back();
-    sparse_[dense_.back()] = sparse_[key];
+    uint32_t slot = sparse_.get(key);
+    dense_[slot] = dense_.back();
+    sparse_.set(dense_.back(), slot);
     dense_.pop_back();
-    sparse_[key] = -1;
+    sparse_.set(key, SparseIndex::kEmpty);
   }
 
   void clear() {
     dense_values_.resize(0);
-    sparse_.resize(0);
+    sparse_.clear();
     dense_.resize(0);
   }
 
   bool has(uint64_t key) const {
-    if (key >= sparse_.size()) {
-      return false;
-    }
-    return sparse_[key] != -1;
+    uint32_t slot = sparse_.get(key);
+    return slot != SparseIndex::kEmpty && dense_[slot] == key;
   }
 
   uint64_t size() const {
@@ -408,8 +432,13 @@ public:
   }
 
   size_t capacity() const {
-    return std::max(std::max(sparse_.capacity(), dense_values_.capacity()),
-                    dense_.capacity());
+    return std::max(dense_values_.capacity(), dense_.capacity());
+  }
+
+  // Number of bytes used by the sparse index and the dense keys. Does not
+  // include the values.
+  size_t memory_usage() const {
+    return sparse_.memory_usage() + dense_.capacity() * sizeof(uint64_t);
   }
 
   size_t element_size() const {
@@ -430,7 +459,7 @@ private:
   }
 
   size_t element_size_;
-  std::vector<qbId> sparse_;
+  SparseIndex sparse_;
   Container_ dense_values_;
   std::vector<uint64_t> dense_;
 };
@@ -22,6 +22,7 @@
 #include <vector>
 
 #include <cubez/cubez.h>
+#include "sparse_index.h"
 
 class SparseSet {
 public:
@@ -98,7 +99,7 @@ public:
     friend class SparseSet;
   };
 
-  SparseSet() : sparse_(16, -1) {
+  SparseSet() {
     dense_.reserve(16);
   }
 
@@ -108,36 +109,41 @@ public:
   }
 
   void insert(uint64_t value) {
-    if (value >= sparse_.size()) {
-      sparse_.resize(value + 1, -1);
-    }
-    sparse_[value] = dense_.size();
+    sparse_.set(value, (uint32_t)dense_.size());
     dense_.push_back(value);
   }
 
   void erase(uint64_t value) {
-    dense_[sparse_[value]] = dense_.back();
-    sparse_[dense_.back()] = sparse_[value];
+    uint32_t slot = sparse_.get(value);
+    dense_[slot] = dense_.back();
+    sparse_.set(dense_.back(), slot);
     dense_.pop_back();
-    sparse_[value] = -1;
+    sparse_.set(value, SparseIndex::kEmpty);
   }
 
   void clear() {
-    sparse_.resize(0);
+    sparse_.clear();
     dense_.resize(0);
   }
 
   bool has(uint64_t value) {
-    if (value >= sparse_.size()) {
-      return false;
-    }
-    return sparse_[value] != -1;
+    uint32_t slot = sparse_.get(value);
+    return slot != SparseIndex::kEmpty && dense_[slot] == value;
   }
 
   uint64_t size() const {
     return dense_.size();
   }
 
+  const uint64_t* data() const {
+    return dense_.data();
+  }
+
+  // Number of bytes used by the sparse index and the dense values.
+  size_t memory_usage() const {
+    return sparse_.memory_usage() + dense_.capacity() * sizeof(uint64_t);
+  }
+
   iterator begin() {
     return iterator(this, 0);
   }
@@ -155,7 +161,7 @@ public:
   }
 
 private:
-  std::vector<qbHandle> sparse_;
+  SparseIndex sparse_;
   std::vector<uint64_t> dense_;
 };
 
@@ -17,73 +17,246 @@
 */
 
 #include "system_impl.h"
-#include <omp.h>
+#include "job_system.h"
 
 SystemImpl::SystemImpl(const qbSystemAttr_& attr, qbSystem system, std::vector<qbComponent> components) :
   system_(system), 
   components_(components), join_(attr.join),
   user_state_(attr.state),
+  batch_events_(attr.batch_events),
   tickets_(attr.tickets),
+  query_(nullptr),
+  query_state_(nullptr),
+  grain_size_(attr.grain_size),
+  scratch_size_(attr.scratch_size),
   transform_(attr.transform),
+  batch_(attr.batch),
   callback_(attr.callback),
-  condition_(attr.condition) {
+  condition_(attr.condition),
+  has_row_without_(false),
+  has_sparse_optional_(false),
+  has_snapshot_(false),
+  last_run_(0) {
 
   for(auto component : components_) {
-    qbInstance_ instance;
-    instance.data = nullptr;
-    instance.system = system_;
-    if (std::find(attr.constants.begin(), attr.constants.end(), component) != attr.constants.end()) {
-      *(bool*)&instance.is_mutable = false;
-    } else {
-      *(bool*)&instance.is_mutable = true;
-    }
+    is_mutable_.push_back(
+      std::find(attr.constants.begin(), attr.constants.end(), component) == attr.constants.end());
+  }
+
+  // Terms only apply to joins that visit each entity once.
+  bool has_terms = join_ != qbComponentJoin::QB_JOIN_CROSS;
+  for (size_t j = 0; j < components_.size(); ++j) {
+    is_optional_.push_back(has_terms &&
+      ((join_ == qbComponentJoin::QB_JOIN_LEFT && j > 0) ||
+       std::find(attr.optional.begin(), attr.optional.end(), components_[j]) != attr.optional.end()));
+  }
+  if (!is_optional_.empty() &&
+      std::find(is_optional_.begin(), is_optional_.end(), false) == is_optional_.end()) {
+    is_optional_[0] = false;
+  }
 
-    instances_.push_back(instance);
+  for (qbComponent component : attr.changed) {
+    auto found = std::find(components_.begin(), components_.end(), component);
+    if (found != components_.end()) {
+      changed_.push_back(found - components_.begin());
+    }
   }
 
-  for (auto& element : instances_) {
-    instance_data_.push_back(&element);
+  for (size_t j = 0; j < components_.size(); ++j) {
+    if (!is_optional_[j]) {
+      sorted_components_.push_back(components_[j]);
+    }
+  }
+  if (has_terms) {
+    sorted_components_.insert(sorted_components_.end(), attr.with.begin(), attr.with.end());
+    without_ = attr.without;
   }
+  std::sort(sorted_components_.begin(), sorted_components_.end());
+  sorted_components_.erase(
+    std::unique(sorted_components_.begin(), sorted_components_.end()),
+    sorted_components_.end());
+  std::sort(without_.begin(), without_.end());
+  without_.erase(std::unique(without_.begin(), without_.end()), without_.end());
+  without_signature_ = ComponentSignature(without_);
+  required_signature_ = ComponentSignature(sorted_components_);
+
+  is_plain_ = components_.size() == 1 && sorted_components_.size() == 1 &&
+              without_.empty();
+
+  ResizeWorkers(grain_size_ > 0 ? JobSystem::Get()->WorkerCount() + 1 : 1);
 }
 
 SystemImpl* SystemImpl::FromRaw(qbSystem system) {
   return (SystemImpl*)(((char*)system) + sizeof(qbSystem_));
 }
 
+void SystemImpl::ResizeWorkers(size_t count) {
+  size_t old_count = workers_.size();
+  if (count <= old_count) {
+    return;
+  }
+
+  workers_.resize(count);
+  for (size_t i = old_count; i < count; ++i) {
+    Worker& worker = workers_[i];
+    for (size_t j = 0; j < components_.size(); ++j) {
+      qbInstance_ instance(is_mutable_[j]);
+      instance.data = nullptr;
+      instance.system = system_;
+      worker.instances.push_back(instance);
+    }
+    for (auto& element : worker.instances) {
+      worker.instance_data.push_back(&element);
+    }
+    worker.batch_data.resize(components_.size());
+    worker.batch_strides.resize(components_.size());
+    worker.columns.resize(components_.size());
+    worker.scratch.resize(scratch_size_);
+  }
+}
+
+void SystemImpl::Prepare(GameState* game_state) {
+  if (!is_plain_ && !sorted_components_.empty() &&
+      join_ != qbComponentJoin::QB_JOIN_CROSS) {
+    QueryFor(game_state);
+  }
+}
+
+Query* SystemImpl::QueryFor(GameState* state) {
+  if (state != query_state_) {
+    query_ = state->QueryFind(sorted_components_);
+    query_state_ = state;
+  }
+  return query_;
+}
+
+size_t SystemImpl::WorkerCount() const {
+  return workers_.size();
+}
+
+void* SystemImpl::Scratch(size_t worker) {
+  if (worker >= workers_.size() || scratch_size_ == 0) {
+    return nullptr;
+  }
+  return workers_[worker].scratch.data();
+}
+
 void SystemImpl::Run(GameState* game_state, void* event) {
+  Run(game_state, Events{ event, event ? 1u : 0u, 0, nullptr });
+}
+
+void SystemImpl::Run(GameState* game_state, const Events& events) {
   size_t source_size = components_.size();
   qbFrame frame;
   frame.system = system_;
-  frame.event = event;
+  frame.event = events.messages;
+  frame.events = events.messages;
+  frame.event_count = events.count;
   frame.state = system_->user_state;
+  frame.worker = 0;
+
+  // Systems that filter on changes don't run at all if nothing changed.
+  if (!changed_.empty()) {
+    bool is_changed = false;
+    for (size_t j : changed_) {
+      is_changed |= game_state->ComponentGet(components_[j])->Version() > last_run_;
+    }
+    if (!is_changed) {
+      return;
+    }
+  }
+
+  bool is_targeted = events.targets && source_size > 0 &&
+    join_ != qbComponentJoin::QB_JOIN_CROSS;
+  bool is_parallel = !is_targeted && grain_size_ > 0 && source_size > 0 &&
+    (is_plain_ || join_ != qbComponentJoin::QB_JOIN_CROSS);
+  for (auto& worker : workers_) {
+    std::fill(worker.scratch.begin(), worker.scratch.end(), 0);
+  }
+  frame.scratch = Scratch(0);
 
   if (condition_ && !condition_(&frame)) {
     return;
   }
 
-  if (transform_) {
+  if (transform_ || batch_) {
     for (auto& t: tickets_) {
       t->lock();
     }
+
+    // Structural changes made while iterating are applied by the next flush,
+    // so no instance moves or joins the iteration before it is done.
+    if (source_size > 0) {
+      game_state->BeginDeferred();
+    }
+
+    // Buffered components that are only read don't take the lock, the
+    // published copy is never written while it is held.
+    is_snapshot_.assign(source_size, false);
+    has_snapshot_ = false;
+    for (size_t j = 0; j < source_size; ++j) {
+      is_snapshot_[j] = !is_mutable_[j] &&
+        game_state->ComponentGet(components_[j])->IsBuffered();
+      has_snapshot_ |= is_snapshot_[j] && !is_optional_[j];
+    }
+
     if (source_size == 0) {
       Run_0(&frame);
-    } else if (source_size == 1) {
-      Component* c = game_state->ComponentGet(components_[0]);
-      c->Lock(instances_[0].is_mutable);
-      Run_1(c, &frame, game_state);
-      c->Unlock(instances_[0].is_mutable);
-    } else if (source_size > 1) {
+    } else if (is_plain_) {
+      Component* live = game_state->ComponentGet(components_[0]);
+      Component* c = is_snapshot_[0] ? live->AcquireRead() : live;
+      if (!is_snapshot_[0]) {
+        c->Lock(is_mutable_[0]);
+      }
+      CollectTerms({ c }, game_state);
+      if (is_targeted) {
+        Run_Targets({ c }, events, &frame, game_state);
+      } else if (c->IsTag()) {
+        Run_Tags({ c }, &frame, game_state);
+      } else if (is_parallel) {
+        Run_Parallel({ c }, &frame, game_state);
+      } else {
+        Run_1(c, &frame, game_state);
+      }
+      if (is_snapshot_[0]) {
+        live->ReleaseRead(c);
+      } else {
+        c->Unlock(is_mutable_[0]);
+      }
+    } else {
       thread_local static std::vector<Component*> components;
       components.resize(0);
       size_t index = 0;
       for (auto component : components_) {
         Component* c = game_state->ComponentGet(component);
-        c->Lock(instances_[index].is_mutable);
-        components.push_back(c);
-        c->Unlock(instances_[index].is_mutable);
+        if (is_snapshot_[index]) {
+          components.push_back(c->AcquireRead());
+        } else {
+          c->Lock(is_mutable_[index]);
+          components.push_back(c);
+          c->Unlock(is_mutable_[index]);
+        }
         ++index;
       }
-      Run_N(components, &frame, game_state);
+      CollectTerms(components, game_state);
+      if (is_targeted) {
+        Run_Targets(components, events, &frame, game_state);
+      } else if (join_ != qbComponentJoin::QB_JOIN_CROSS &&
+          tag_sets_.size() == sorted_components_.size()) {
+        Run_Tags(components, &frame, game_state);
+      } else if (is_parallel) {
+        Run_Parallel(components, &frame, game_state);
+      } else {
+        Run_N(components, &frame, game_state);
+      }
+      for (size_t j = 0; j < source_size; ++j) {
+        if (is_snapshot_[j]) {
+          game_state->ComponentGet(components_[j])->ReleaseRead(components[j]);
+        }
+      }
+    }
+    if (source_size > 0) {
+      game_state->EndDeferred();
     }
     for (auto& t : tickets_) {
       t->unlock();
@@ -91,8 +264,15 @@ void SystemImpl::Run(GameState* game_state, void* event) {
   }
 
   if (callback_) {
+    frame.worker = 0;
+    frame.scratch = Scratch(0);
     callback_(&frame);
   }
+
+  // Everything written from now on is newer than this run.
+  if (!changed_.empty()) {
+    last_run_ = ChangeTick::Advance();
+  }
 }
 
 qbInstance_ SystemImpl::FindInstance(qbEntity entity, Component* component, GameState* state) {
@@ -106,100 +286,497 @@ void SystemImpl::CopyToInstance(Component* component, qbEntity entity, qbInstanc
   CopyToInstance(component, entity, (*component)[entity], instance, state);
 }
 
-void SystemImpl::CopyToInstance(Component* component, qbEntity entity, void* instance_data, qbInstance instance, GameState* state) {
+void SystemImpl::CopyToInstance(Component* component, qbEntity entity, void* instance_data, qbInstance instance, GameState* state, bool is_touched) {
   instance->entity = entity;
   instance->data = instance_data;
   instance->component = component;
   instance->state = state;
+  instance->is_touched = is_touched;
+}
+
+void SystemImpl::CopyToInstances(Worker* worker, const std::vector<Component*>& components,
+                                 qbEntity entity, GameState* state) {
+  for (size_t j = 0; j < components.size(); ++j) {
+    if (IsAbsent(components, j, entity, state)) {
+      CopyToInstance(components[j], entity, nullptr, &worker->instances[j], state);
+    } else {
+      CopyToInstance(components[j], entity, &worker->instances[j], state);
+    }
+  }
+}
+
+void SystemImpl::CopyToInstances(Worker* worker, const std::vector<Component*>& components,
+                                 Archetype* archetype, size_t row, GameState* state) {
+  qbEntity entity = archetype->Entities()[row];
+  for (size_t j = 0; j < components.size(); ++j) {
+    int64_t column = worker->columns[j];
+    if (column >= 0) {
+      CopyToInstance(components[j], entity, archetype->At(column, row),
+                     &worker->instances[j], state, is_mutable_[j]);
+    } else if (IsAbsent(components, j, entity, state)) {
+      CopyToInstance(components[j], entity, nullptr, &worker->instances[j], state);
+    } else {
+      CopyToInstance(components[j], entity, &worker->instances[j], state);
+    }
+  }
+}
+
+bool SystemImpl::EntityChanged(const std::vector<Component*>& components, qbEntity entity,
+                               GameState* state) {
+  for (size_t j : changed_) {
+    if (IsAbsent(components, j, entity, state)) {
+      continue;
+    }
+    if (components[j]->ChangedSince(entity, last_run_)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool SystemImpl::TouchBlock(Archetype* archetype, const std::vector<int64_t>& columns,
+                            const std::vector<Component*>& components, size_t block) {
+  // Components outside of the table are checked and stamped as a whole.
+  if (!changed_.empty()) {
+    bool is_changed = false;
+    for (size_t j : changed_) {
+      is_changed |= columns[j] < 0
+        ? components[j]->Version() > last_run_
+        : archetype->BlockStamp(columns[j], block).ChangedSince(last_run_);
+    }
+    if (!is_changed) {
+      return false;
+    }
+  }
+  for (size_t j = 0; j < components.size(); ++j) {
+    if (is_mutable_[j] && columns[j] >= 0) {
+      archetype->BlockStamp(columns[j], block).Touch();
+      components[j]->Touch();
+    }
+  }
+  return true;
+}
+
+void SystemImpl::CollectTerms(const std::vector<Component*>& components, GameState* state) {
+  is_tag_.resize(components.size());
+  has_sparse_optional_ = false;
+  for (size_t j = 0; j < components.size(); ++j) {
+    is_tag_[j] = components[j]->IsTag();
+    has_sparse_optional_ |= is_optional_[j] && !is_tag_[j] && !components[j]->IsArchetype();
+  }
+
+  tag_sets_.resize(0);
+  for (qbComponent component : sorted_components_) {
+    Component* c = state->ComponentGet(component);
+    if (c->IsTag()) {
+      tag_sets_.push_back(&c->Tags());
+    }
+  }
+
+  // Tables never hold tags or sparse components, so those have to be
+  // checked per entity.
+  without_sets_.resize(0);
+  has_row_without_ = false;
+  for (qbComponent component : without_) {
+    Component* c = state->ComponentGet(component);
+    if (c->IsTag()) {
+      without_sets_.push_back(&c->Tags());
+    }
+    has_row_without_ |= !c->IsArchetype();
+  }
+}
+
+bool SystemImpl::IsExcluded(Archetype* archetype) const {
+  for (qbComponent component : without_) {
+    if (archetype->ColumnOf(component) >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void SystemImpl::SetColumns(Worker* worker, Archetype* archetype) {
+  for (size_t j = 0; j < components_.size(); ++j) {
+    worker->columns[j] = is_tag_[j] ? -1 : archetype->ColumnOf(components_[j]);
+  }
 }
 
-void SystemImpl::RunTransform(qbInstance* instances, qbFrame* frame) {
-  transform_(instances, frame);
+void SystemImpl::SetBatch(Worker* worker, Archetype* archetype, size_t row) {
+  for (size_t j = 0; j < components_.size(); ++j) {
+    int64_t column = worker->columns[j];
+    if (column < 0) {
+      worker->batch_data[j] = nullptr;
+      worker->batch_strides[j] = 0;
+      continue;
+    }
+    worker->batch_data[j] = archetype->At(column, row);
+    worker->batch_strides[j] = archetype->Stride(column);
+  }
+}
+
+void SystemImpl::RunTransform(Worker* worker, qbFrame* frame) {
+  if (!batch_) {
+    transform_(worker->instance_data.data(), frame);
+    return;
+  }
+
+  // Joins that can't be iterated block by block are given one entity at a
+  // time.
+  for (size_t i = 0; i < worker->instances.size(); ++i) {
+    qbInstance_& instance = worker->instances[i];
+    worker->batch_data[i] = instance.data;
+    worker->batch_strides[i] = instance.component->ElementSize();
+    if (is_mutable_[i] && !instance.is_touched && instance.data) {
+      instance.component->Touch(instance.entity);
+    }
+  }
+  RunBatch(worker, &worker->instances[0].entity, 1, frame);
+}
+
+void SystemImpl::RunBatch(Worker* worker, const qbEntity* entities, size_t count, qbFrame* frame) {
+  batch_(entities, count, worker->batch_data.data(), worker->batch_strides.data(), frame);
 }
 
 void SystemImpl::Run_0(qbFrame* f) {
-  RunTransform(nullptr, f);
+  if (batch_) {
+    RunBatch(&workers_[0], nullptr, 0, f);
+    return;
+  }
+  transform_(nullptr, f);
 }
 
 void SystemImpl::Run_1(Component* component, qbFrame* f, GameState* state) {
-  for (auto id_component : *component) {
-    CopyToInstance(component, id_component.first, id_component.second, &instances_[0], state);
-    RunTransform(instance_data_.data(), f);
+  Worker* worker = &workers_[0];
+  bool is_mutable = is_mutable_[0];
+  bool is_filtered = !changed_.empty();
+  if (batch_) {
+    component->ForEachBlock(
+      [=](const qbEntity* entities, void* data, size_t stride, size_t count,
+          ChangeStamp* stamp) {
+        if (is_filtered && !stamp->ChangedSince(last_run_)) {
+          return;
+        }
+        if (is_mutable) {
+          stamp->Touch();
+          component->Touch();
+        }
+        worker->batch_data[0] = data;
+        worker->batch_strides[0] = stride;
+        RunBatch(worker, entities, count, f);
+      });
+    return;
+  }
+
+  if (component->IsArchetype()) {
+    const std::vector<Archetype*>& archetypes = component->Archetypes();
+    for (size_t i = 0; i < archetypes.size(); ++i) {
+      Archetype* archetype = archetypes[i];
+      size_t column = archetype->ColumnOf(component->Id());
+
+      for (size_t row = 0; row < archetype->Size(); ++row) {
+        if (row % Archetype::kBlockRows == 0) {
+          ChangeStamp& stamp = archetype->BlockStamp(column, row / Archetype::kBlockRows);
+          if (is_filtered && !stamp.ChangedSince(last_run_)) {
+            row += Archetype::kBlockRows - 1;
+            continue;
+          }
+          if (is_mutable) {
+            stamp.Touch();
+            component->Touch();
+          }
+        }
+        CopyToInstance(component, archetype->Entities()[row],
+                       archetype->At(column, row), &worker->instances[0], state,
+                       is_mutable);
+        RunTransform(worker, f);
+      }
+    }
+    return;
+  }
+
+  size_t block_end = 0;
+  for (size_t slot = 0; slot < component->Size(); ++slot) {
+    if (slot == block_end) {
+      ChangeStamp* stamp = component->BlockAt(slot, &block_end);
+      if (is_filtered && !stamp->ChangedSince(last_run_)) {
+        slot = block_end - 1;
+        continue;
+      }
+      if (is_mutable) {
+        stamp->Touch();
+        component->Touch();
+      }
+    }
+    auto id_component = *(component->begin() + slot);
+    CopyToInstance(component, id_component.first, id_component.second,
+                   &worker->instances[0], state, is_mutable);
+    RunTransform(worker, f);
   }
 }
 
 void SystemImpl::Run_N(const std::vector<Component*>& components, qbFrame* f, GameState* state) {
-  Component* source = components[0];
-  switch(join_) {
-    case qbComponentJoin::QB_JOIN_INNER: {
-      uint64_t min = 0xFFFFFFFFFFFFFFFF;
-      for (size_t i = 0; i < components_.size(); ++i) {
+  Worker* worker = &workers_[0];
+  if (join_ == qbComponentJoin::QB_JOIN_CROSS) {
+    static std::vector<size_t> indices(components_.size(), 0);
+
+    // Tags have no instances to iterate over.
+    if (std::find(is_tag_.begin(), is_tag_.end(), true) != is_tag_.end()) {
+      return;
+    }
+
+    for (Component* component : components) {
+      if (component->Size() == 0) {
+        return;
+      }
+    }
+
+    while (1) {
+      bool is_changed = changed_.empty();
+      for (size_t i = 0; i < indices.size(); ++i) {
         Component* src = components[i];
-        uint64_t maybe_min = src->Size();
-        if (maybe_min < min) {
-          min = maybe_min;
-          source = src;
+        auto it = src->begin() + indices[i];
+        CopyToInstance(src, (*it).first, &worker->instances[i], state);
+      }
+      for (size_t j : changed_) {
+        is_changed |= components[j]->ChangedSince(worker->instances[j].entity, last_run_);
+      }
+      if (is_changed) {
+        RunTransform(worker, f);
+      }
+
+      bool all_zero = true;
+      ++indices[0];
+      for (size_t i = 0; i < indices.size(); ++i) {
+        if (indices[i] >= components[i]->Size()) {
+          indices[i] = 0;
+          if (i + 1 < indices.size()) {
+            ++indices[i + 1];
+          }
         }
+        all_zero &= indices[i] == 0;
       }
-    } break;
-    case qbComponentJoin::QB_JOIN_LEFT:
-      source = components[0];
-    break;
-    case qbComponentJoin::QB_JOIN_CROSS: {
-      static std::vector<size_t> indices(components_.size(), 0);
 
-      for (Component* component : components) {
-        if (component->Size() == 0) {
-          return;
+      if (all_zero) break;
+    }
+    return;
+  }
+
+  Query* query = QueryFor(state);
+  if (query->IsArchetype()) {
+    Run_Archetypes(query, components, f, state);
+    return;
+  }
+
+  for (size_t i = 0; i < query->Size(); ++i) {
+    qbEntity entity = query->Entities()[i];
+    if (IsExcluded(entity, state) || !InSnapshots(components, entity) ||
+        (!changed_.empty() && !EntityChanged(components, entity, state))) {
+      continue;
+    }
+    CopyToInstances(worker, components, entity, state);
+    RunTransform(worker, f);
+  }
+}
+
+void SystemImpl::Run_Targets(const std::vector<Component*>& components, const Events& events,
+                             qbFrame* f, GameState* state) {
+  Worker* worker = &workers_[0];
+  for (size_t i = 0; i < events.count; ++i) {
+    qbEntity entity = events.targets[i];
+    if (!IsMatch(entity, state) || !InSnapshots(components, entity) ||
+        (!changed_.empty() && !EntityChanged(components, entity, state))) {
+      continue;
+    }
+    f->event = (uint8_t*)events.messages + i * events.size;
+    CopyToInstances(worker, components, entity, state);
+    RunTransform(worker, f);
+  }
+}
+
+void SystemImpl::Run_Tags(const std::vector<Component*>& components, qbFrame* f, GameState* state) {
+  Worker* worker = &workers_[0];
+  bool is_all_tags =
+    std::find(is_tag_.begin(), is_tag_.end(), false) == is_tag_.end();
+  bool has_sparse_without = without_sets_.size() < without_.size();
+  qbEntity entities[64];
+  EntityBitset::ForEachWord(tag_sets_, without_sets_, [&](size_t word, uint64_t bits) {
+    size_t count = 0;
+    while (bits) {
+      qbEntity entity = state->EntityHandleOf((uint32_t)(word * 64 + __builtin_ctzll(bits)));
+      bits &= bits - 1;
+      if ((has_sparse_without && IsExcluded(entity, state)) ||
+          !InSnapshots(components, entity) ||
+          (!changed_.empty() && !EntityChanged(components, entity, state))) {
+        continue;
+      }
+      entities[count++] = entity;
+    }
+
+    // Only tags can be given as a batch, they have no data.
+    if (batch_ && is_all_tags) {
+      std::fill(worker->batch_data.begin(), worker->batch_data.end(), nullptr);
+      std::fill(worker->batch_strides.begin(), worker->batch_strides.end(), 0);
+      if (count > 0) {
+        RunBatch(worker, entities, count, f);
+      }
+      return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      CopyToInstances(worker, components, entities[i], state);
+      RunTransform(worker, f);
+    }
+  });
+}
+
+void SystemImpl::Run_Archetypes(Query* query, const std::vector<Component*>& components, qbFrame* f, GameState* state) {
+  Worker* worker = &workers_[0];
+  const std::vector<Archetype*>& archetypes = query->Archetypes();
+  for (size_t i = 0; i < archetypes.size(); ++i) {
+    Archetype* archetype = archetypes[i];
+    if (IsExcluded(archetype)) {
+      continue;
+    }
+    SetColumns(worker, archetype);
+
+    for (size_t block = 0; block < archetype->Blocks(); ++block) {
+      if (!TouchBlock(archetype, worker->columns, components, block)) {
+        continue;
+      }
+
+      size_t begin = block * Archetype::kBlockRows;
+      if (batch_ && !has_sparse_optional_) {
+        // Rows that don't match split the block into multiple batches.
+        ForEachMatch(archetype->Entities() + begin,
+                     std::min((size_t)Archetype::kBlockRows, archetype->Size() - begin),
+                     state,
+                     [&](size_t offset, size_t count) {
+                       SetBatch(worker, archetype, begin + offset);
+                       RunBatch(worker, archetype->Entities() + begin + offset, count, f);
+                     });
+        continue;
+      }
+
+      for (size_t row = begin;
+           row < begin + Archetype::kBlockRows && row < archetype->Size(); ++row) {
+        if (!MatchesRow(archetype->Entities()[row], state)) {
+          continue;
         }
+        CopyToInstances(worker, components, archetype, row, state);
+        RunTransform(worker, f);
       }
+    }
+  }
+}
 
-      while (1) {
-        for (size_t i = 0; i < indices.size(); ++i) {
-          Component* src = components[i];
-          auto it = src->begin() + indices[i];
-          CopyToInstance(src, (*it).first, &instances_[i], state);
+void SystemImpl::Run_Parallel(const std::vector<Component*>& components, qbFrame* f, GameState* state) {
+  chunks_.resize(0);
+  auto split = [this](Archetype* archetype, size_t row, const qbEntity* entities,
+                      void* data, size_t stride, size_t count) {
+    for (size_t i = 0; i < count; i += grain_size_) {
+      chunks_.push_back({ archetype, row + i, entities + i, (uint8_t*)data + i * stride,
+                          stride, std::min(grain_size_, count - i) });
+    }
+  };
+
+  // Blocks are filtered and stamped up front, so workers only read the
+  // stamps of instances they look up themselves.
+  if (is_plain_) {
+    Component* component = components[0];
+    bool is_mutable = is_mutable_[0];
+    bool is_filtered = !changed_.empty();
+    component->ForEachBlock(
+      [=, &split](const qbEntity* entities, void* data, size_t stride, size_t count,
+                  ChangeStamp* stamp) {
+        if (is_filtered && !stamp->ChangedSince(last_run_)) {
+          return;
         }
-        RunTransform(instance_data_.data(), f);
-
-        bool all_zero = true;
-        ++indices[0];
-        for (size_t i = 0; i < indices.size(); ++i) {
-          if (indices[i] >= components[i]->Size()) {
-            indices[i] = 0;
-            if (i + 1 < indices.size()) {
-              ++indices[i + 1];
-            }
+        if (is_mutable) {
+          stamp->Touch();
+          component->Touch();
+        }
+        split(nullptr, 0, entities, data, stride, count);
+      });
+  } else {
+    Query* query = QueryFor(state);
+    if (query->IsArchetype()) {
+      Worker* worker = &workers_[0];
+      for (Archetype* archetype : query->Archetypes()) {
+        if (IsExcluded(archetype)) {
+          continue;
+        }
+        SetColumns(worker, archetype);
+        for (size_t block = 0; block < archetype->Blocks(); ++block) {
+          if (TouchBlock(archetype, worker->columns, components, block)) {
+            size_t row = block * Archetype::kBlockRows;
+            split(archetype, row, archetype->Entities() + row, nullptr, 0,
+                  std::min((size_t)Archetype::kBlockRows, archetype->Size() - row));
           }
-          all_zero &= indices[i] == 0;
         }
-
-        if (all_zero) break;
       }
+    } else if (changed_.empty() && without_.empty() && !has_snapshot_) {
+      split(nullptr, 0, query->Entities(), nullptr, 0, query->Size());
+    } else {
+      filtered_entities_.resize(0);
+      for (size_t i = 0; i < query->Size(); ++i) {
+        qbEntity entity = query->Entities()[i];
+        if (!IsExcluded(entity, state) && InSnapshots(components, entity) &&
+            (changed_.empty() || EntityChanged(components, entity, state))) {
+          filtered_entities_.push_back(entity);
+        }
+      }
+      split(nullptr, 0, filtered_entities_.data(), nullptr, 0, filtered_entities_.size());
     }
   }
 
-  switch(join_) {
-    case qbComponentJoin::QB_JOIN_LEFT:
-    case qbComponentJoin::QB_JOIN_INNER: {
-      for (auto id_component : *source) {
-        qbId entity_id = id_component.first;
-        bool should_continue = false;
-        for (size_t j = 0; j < components_.size(); ++j) {
-          Component* c = components[j];
-          if (!c->Has(entity_id)) {
-            should_continue = true;
-            break;
-          }
-          CopyToInstance(c, entity_id, &instances_[j], state);
-        }
-        if (should_continue) continue;
+  JobSystem::Get()->ParallelFor(chunks_.size(), 1,
+    [this, &components, f, state](size_t begin, size_t end) {
+      size_t worker = JobSystem::ThreadIndex();
+      qbFrame frame = *f;
+      frame.worker = worker;
+      frame.scratch = Scratch(worker);
+      for (size_t i = begin; i < end; ++i) {
+        RunChunk(chunks_[i], components, &workers_[worker], &frame, state);
+      }
+    });
+}
 
-        RunTransform(instance_data_.data(), f);
+void SystemImpl::RunChunk(const Chunk& chunk, const std::vector<Component*>& components,
+                          Worker* worker, qbFrame* f, GameState* state) {
+  if (chunk.archetype) {
+    Archetype* archetype = chunk.archetype;
+    SetColumns(worker, archetype);
+    ForEachMatch(chunk.entities, chunk.count, state, [&](size_t begin, size_t count) {
+      if (batch_ && !has_sparse_optional_) {
+        SetBatch(worker, archetype, chunk.row + begin);
+        RunBatch(worker, chunk.entities + begin, count, f);
+        return;
+      }
+      for (size_t i = 0; i < count; ++i) {
+        CopyToInstances(worker, components, archetype, chunk.row + begin + i, state);
+        RunTransform(worker, f);
       }
-    } break;
-    default:
-      break;
+    });
+    return;
   }
-}
 
+  if (is_plain_) {
+    if (batch_) {
+      worker->batch_data[0] = chunk.data;
+      worker->batch_strides[0] = chunk.stride;
+      RunBatch(worker, chunk.entities, chunk.count, f);
+      return;
+    }
+    for (size_t i = 0; i < chunk.count; ++i) {
+      CopyToInstance(components[0], chunk.entities[i], chunk.data + i * chunk.stride,
+                     &worker->instances[0], state, is_mutable_[0]);
+      RunTransform(worker, f);
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < chunk.count; ++i) {
+    CopyToInstances(worker, components, chunk.entities[i], state);
+    RunTransform(worker, f);
+  }
+}
@@ -19,6 +19,7 @@
 #ifndef SYSTEM_IMPL__H
 #define SYSTEM_IMPL__H
 
+#include "archetype.h"
 #include "defs.h"
 #include "game_state.h"
 #include "barrier.h"
@@ -30,35 +31,259 @@ class SystemImpl {
  public:
   SystemImpl(const qbSystemAttr_& attr, qbSystem system, std::vector<qbComponent> components);
 
+  // The messages an event-triggered system is run with. "messages" holds
+  // "count" messages of "size" bytes each. If "targets" is set, it holds one
+  // entity per message and only those are visited. Cross joins and systems
+  // without components ignore the targets.
+  struct Events {
+    void* messages;
+    size_t count;
+    size_t size;
+    const qbEntity* targets;
+  };
+
   static SystemImpl* FromRaw(qbSystem system);
 
   void Run(GameState* game_state, void* event = nullptr);
+  void Run(GameState* game_state, const Events& events);
+
+  // True if the system wants all queued messages of an event in one run.
+  bool BatchesEvents() const {
+    return batch_events_;
+  }
 
   qbInstance_ FindInstance(qbEntity entity, Component* component, GameState* state);
 
+  // Finds the query the system iterates in the given state. Called before the
+  // system runs alongside others so that running it only reads shared state.
+  void Prepare(GameState* game_state);
+
+  size_t WorkerCount() const;
+  void* Scratch(size_t worker);
+
  private:
+  // Everything written while running the transform. Each thread running the
+  // system gets its own worker.
+  struct Worker {
+    std::vector<qbInstance_> instances;
+    std::vector<qbInstance> instance_data;
+    std::vector<void*> batch_data;
+    std::vector<size_t> batch_strides;
+    std::vector<int64_t> columns;
+    std::vector<uint8_t> scratch;
+  };
+
+  // A range of instances run by a single worker. If "archetype" is set, the
+  // instances are read from the table starting at "row". Otherwise "data"
+  // holds the instances of the first component, "stride" bytes apart, or is
+  // null for joins.
+  struct Chunk {
+    Archetype* archetype;
+    size_t row;
+    const qbEntity* entities;
+    uint8_t* data;
+    size_t stride;
+    size_t count;
+  };
+
   void CopyToInstance(Component* component, qbEntity entity, qbInstance instance, GameState* state);
-  void CopyToInstance(Component* component, qbEntity entity, void* instance_data, qbInstance instance, GameState* state);
+  void CopyToInstance(Component* component, qbEntity entity, void* instance_data, qbInstance instance, GameState* state, bool is_touched = false);
+
+  // Copies the entity's instance of every component into the worker.
+  // Optional components the entity does not own are given a null pointer.
+  void CopyToInstances(Worker* worker, const std::vector<Component*>& components,
+                       qbEntity entity, GameState* state);
+
+  // Same as above for the entity at "row" of the table. The worker's
+  // "columns" must hold the table's column of every component.
+  void CopyToInstances(Worker* worker, const std::vector<Component*>& components,
+                       Archetype* archetype, size_t row, GameState* state);
+
+  // True if any component the system filters on changed for the entity since
+  // the last run.
+  bool EntityChanged(const std::vector<Component*>& components, qbEntity entity,
+                     GameState* state);
+
+  // Checks the change filter for a block of the table and stamps the mutable
+  // columns. Returns false if the block should be skipped.
+  bool TouchBlock(Archetype* archetype, const std::vector<int64_t>& columns,
+                  const std::vector<Component*>& components, size_t block);
+
+  // Finds which of the components are tags and how the "without" terms have
+  // to be tested in the given state. Must be called before running.
+  void CollectTerms(const std::vector<Component*>& components, GameState* state);
+
+  // True if every published copy the system reads holds the entity. Copies
+  // are a frame old, so they can miss entities the query already has.
+  bool InSnapshots(const std::vector<Component*>& components, qbEntity entity) const {
+    if (!has_snapshot_) {
+      return true;
+    }
+    for (size_t j = 0; j < components.size(); ++j) {
+      if (is_snapshot_[j] && !is_optional_[j] && !components[j]->Has(entity)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // True if the optional component at "j" has no instance to give for the
+  // entity.
+  bool IsAbsent(const std::vector<Component*>& components, size_t j,
+                qbEntity entity, GameState* state) const {
+    return is_optional_[j] &&
+      (!state->EntityHasComponent(entity, components_[j]) ||
+       (is_snapshot_[j] && !components[j]->Has(entity)));
+  }
+
+  // True if the entity owns one of the "without" components.
+  bool IsExcluded(qbEntity entity, GameState* state) const {
+    return !without_.empty() && state->EntityHasAny(entity, without_signature_);
+  }
+
+  // True if the entity is alive and matches all required components, "with"
+  // and "without" terms.
+  bool IsMatch(qbEntity entity, GameState* state) const {
+    return state->EntityHasComponent(entity, sorted_components_[0]) &&
+           state->EntityHasAll(entity, required_signature_) &&
+           !IsExcluded(entity, state);
+  }
+
+  // True if the table has a column for one of the "without" components.
+  bool IsExcluded(Archetype* archetype) const;
+
+  // Checks the terms that can not be answered by the table an entity is in:
+  // the required tags and the "without" components stored outside of tables.
+  bool MatchesRow(qbEntity entity, GameState* state) const {
+    for (const EntityBitset* tags : tag_sets_) {
+      if (!tags->Test(entity)) {
+        return false;
+      }
+    }
+    return !has_row_without_ || !IsExcluded(entity, state);
+  }
+
+  // Calls "fn(begin, count)" for every run of consecutive entities that pass
+  // "MatchesRow".
+  template<class Fn_>
+  void ForEachMatch(const qbEntity* entities, size_t count, GameState* state, Fn_ fn) {
+    if (tag_sets_.empty() && !has_row_without_) {
+      fn((size_t)0, count);
+      return;
+    }
+    size_t begin = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if (!MatchesRow(entities[i], state)) {
+        if (i > begin) {
+          fn(begin, i - begin);
+        }
+        begin = i + 1;
+      }
+    }
+    if (count > begin) {
+      fn(begin, count - begin);
+    }
+  }
+
+  // Sets the worker's "columns" to the table's column of every component or
+  // -1 if there is none.
+  void SetColumns(Worker* worker, Archetype* archetype);
+
+  // Points the worker's batch at the given row of the table. Components
+  // without a column are given a null pointer. Requires "SetColumns".
+  void SetBatch(Worker* worker, Archetype* archetype, size_t row);
 
   void Run_0(qbFrame* f);
   void Run_1(Component* component, qbFrame* f, GameState* state);
   void Run_N(const std::vector<Component*>& components, qbFrame* f, GameState* state);
 
-  void RunTransform(qbInstance* instances, qbFrame* frame);
+  // Runs the transform on each target that matches the system with the
+  // frame's event set to the target's message.
+  void Run_Targets(const std::vector<Component*>& components, const Events& events,
+                   qbFrame* f, GameState* state);
+
+  // Iterates the intersection of the required tags' bitsets minus the
+  // "without" tags one word at a time. Only valid if all required components
+  // are tags.
+  void Run_Tags(const std::vector<Component*>& components, qbFrame* f, GameState* state);
+
+  // Iterates the query's archetype tables directly. Only valid if all
+  // required components other than tags are archetype-stored.
+  void Run_Archetypes(Query* query, const std::vector<Component*>& components, qbFrame* f, GameState* state);
+
+  // Splits the instances into chunks of "grain_size_" and runs them on all
+  // workers. Not valid for cross joins.
+  void Run_Parallel(const std::vector<Component*>& components, qbFrame* f, GameState* state);
+  void RunChunk(const Chunk& chunk, const std::vector<Component*>& components,
+                Worker* worker, qbFrame* f, GameState* state);
+
+  void RunTransform(Worker* worker, qbFrame* frame);
+
+  // Runs the batch function over "count" entities starting at the addresses
+  // in the worker's "batch_data".
+  void RunBatch(Worker* worker, const qbEntity* entities, size_t count, qbFrame* frame);
+
+  void ResizeWorkers(size_t count);
+
+  // Returns the system's inner join over all its required components in the
+  // given state.
+  Query* QueryFor(GameState* state);
 
   qbSystem system_;
   std::vector<qbComponent> components_;
+  std::vector<bool> is_mutable_;
+  std::vector<bool> is_optional_;
+
+  // The required components and "with" terms, sorted and unique.
+  std::vector<qbComponent> sorted_components_;
+  ComponentSignature required_signature_;
+
+  std::vector<qbComponent> without_;
+  ComponentSignature without_signature_;
+
+  // True if the system is a single component without any other terms.
+  bool is_plain_;
 
   qbComponentJoin join_;
   void* user_state_;
+  bool batch_events_;
 
-  std::vector<qbInstance> instance_data_;
-  std::vector<qbInstance_> instances_;  
   std::vector<qbTicket_*> tickets_;
 
+  Query* query_;
+  GameState* query_state_;
+
+  std::vector<Worker> workers_;
+  std::vector<Chunk> chunks_;
+  size_t grain_size_;
+  size_t scratch_size_;
+
   qbTransformFn transform_;
+  qbBatchFn batch_;
   qbCallbackFn callback_;
   qbConditionFn condition_;
+
+  // Filled by "CollectTerms" for the running GameState. "tag_sets_" are the
+  // required tags and "without_sets_" are the "without" tags.
+  std::vector<bool> is_tag_;
+  std::vector<const EntityBitset*> tag_sets_;
+  std::vector<const EntityBitset*> without_sets_;
+  bool has_row_without_;
+  bool has_sparse_optional_;
+
+  // Set for the buffered components the system only reads. These are run
+  // with the last published copy instead of the live instances.
+  // "has_snapshot_" is set if one of them is required.
+  std::vector<bool> is_snapshot_;
+  bool has_snapshot_;
+
+  // Indices into "components_" of the components to filter on changes.
+  std::vector<size_t> changed_;
+
+  // Entities of a sparse join that passed the filters, split into chunks by
+  // "Run_Parallel".
+  std::vector<qbEntity> filtered_entities_;
+  uint64_t last_run_;
 };
 
 
@@ -0,0 +1,257 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "system_scheduler.h"
+#include "system_impl.h"
+#include "job_system.h"
+
+#include <algorithm>
+#include <set>
+
+namespace {
+
+bool Intersects(const std::vector<qbComponent>& a,
+                const std::vector<qbComponent>& b) {
+  auto i = a.begin();
+  auto j = b.begin();
+  while (i != a.end() && j != b.end()) {
+    if (*i < *j) {
+      ++i;
+    } else if (*j < *i) {
+      ++j;
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::vector<qbComponent> SortedUnique(std::vector<qbComponent> components) {
+  std::sort(components.begin(), components.end());
+  components.erase(std::unique(components.begin(), components.end()),
+                   components.end());
+  return components;
+}
+
+}
+
+SystemScheduler::SystemScheduler()
+  : dirty_(false), has_concurrent_(false), state_(nullptr), remaining_(0) {}
+
+void SystemScheduler::Register(qbSystem system, const qbSystemAttr_& attr) {
+  Node& node = nodes_[system];
+  node.scheduler = this;
+  node.system = system;
+  node.reads = SortedUnique(attr.constants);
+  node.writes = SortedUnique(attr.mutables);
+  node.before = attr.before;
+  node.after = attr.after;
+  node.concurrent = attr.concurrent;
+  node.enabled = false;
+  node.in_degree = 0;
+  node.pending = 0;
+}
+
+void SystemScheduler::Enable(qbSystem system) {
+  auto found = nodes_.find(system);
+  if (found != nodes_.end() && !found->second.enabled) {
+    found->second.enabled = true;
+    dirty_ = true;
+  }
+}
+
+void SystemScheduler::Disable(qbSystem system) {
+  auto found = nodes_.find(system);
+  if (found != nodes_.end() && found->second.enabled) {
+    found->second.enabled = false;
+    dirty_ = true;
+  }
+}
+
+bool SystemScheduler::Conflicts(const Node& a, const Node& b) {
+  if (!a.concurrent || !b.concurrent) {
+    return true;
+  }
+  return Intersects(a.writes, b.writes) ||
+         Intersects(a.writes, b.reads) ||
+         Intersects(a.reads, b.writes);
+}
+
+void SystemScheduler::Build() {
+  order_.clear();
+  has_concurrent_ = false;
+
+  std::vector<Node*> unordered;
+  for (auto& id_node : nodes_) {
+    Node& node = id_node.second;
+    node.successors.clear();
+    node.in_degree = 0;
+    if (node.enabled) {
+      unordered.push_back(&node);
+      has_concurrent_ |= node.concurrent;
+    }
+  }
+
+  // Explicit edges to disabled systems or systems in other programs are
+  // ignored.
+  auto find_enabled = [this](qbSystem system) -> Node* {
+    auto found = nodes_.find(system);
+    return found != nodes_.end() && found->second.enabled ? &found->second : nullptr;
+  };
+  std::set<std::pair<Node*, Node*>> explicit_edges;
+  for (Node* node : unordered) {
+    for (qbSystem system : node->before) {
+      if (Node* other = find_enabled(system)) {
+        explicit_edges.insert({ node, other });
+      }
+    }
+    for (qbSystem system : node->after) {
+      if (Node* other = find_enabled(system)) {
+        explicit_edges.insert({ other, node });
+      }
+    }
+  }
+  for (auto& edge : explicit_edges) {
+    edge.first->successors.push_back(edge.second);
+    ++edge.second->in_degree;
+  }
+
+  std::sort(unordered.begin(), unordered.end(), [](Node* a, Node* b) {
+    if (a->system->policy.priority != b->system->policy.priority) {
+      return a->system->policy.priority > b->system->policy.priority;
+    }
+    return a->system->id < b->system->id;
+  });
+
+  // Repeatedly takes the first system in priority order that has no unordered
+  // explicit predecessors. Cycles are broken by taking the first system.
+  while (!unordered.empty()) {
+    auto next = std::find_if(unordered.begin(), unordered.end(),
+                             [](Node* node) { return node->in_degree == 0; });
+    if (next == unordered.end()) {
+      next = unordered.begin();
+    }
+    Node* node = *next;
+    unordered.erase(next);
+    order_.push_back(node);
+    for (Node* successor : node->successors) {
+      if (successor->in_degree > 0) {
+        --successor->in_degree;
+      }
+    }
+  }
+
+  for (Node* node : order_) {
+    node->successors.clear();
+    node->in_degree = 0;
+  }
+
+  // An edge from every system to each later system it must not overlap with.
+  for (size_t i = 0; i < order_.size(); ++i) {
+    for (size_t j = i + 1; j < order_.size(); ++j) {
+      Node* first = order_[i];
+      Node* second = order_[j];
+      if (Conflicts(*first, *second) ||
+          explicit_edges.count({ first, second }) > 0) {
+        first->successors.push_back(second);
+        ++second->in_degree;
+      }
+    }
+  }
+}
+
+void SystemScheduler::Run(GameState* state) {
+  if (dirty_) {
+    Build();
+    dirty_ = false;
+  }
+
+  if (!has_concurrent_) {
+    for (Node* node : order_) {
+      SystemImpl::FromRaw(node->system)->Run(state);
+    }
+    return;
+  }
+
+  // Concurrent systems may be reading while others run, so structural changes
+  // are deferred until the next flush.
+  state->BeginDeferred();
+  for (Node* node : order_) {
+    SystemImpl::FromRaw(node->system)->Prepare(state);
+  }
+  std::unique_lock<std::mutex> lock(mu_);
+  state_ = state;
+  remaining_ = order_.size();
+  for (Node* node : order_) {
+    node->pending = node->in_degree;
+  }
+  for (Node* node : order_) {
+    if (node->pending == 0) {
+      Schedule(node);
+    }
+  }
+
+  // Runs the non-concurrent systems as they become ready and helps run other
+  // jobs in between. Blocking here could starve the concurrent systems if this
+  // thread is itself a job worker.
+  while (remaining_ > 0) {
+    if (main_queue_.empty()) {
+      lock.unlock();
+      if (!JobSystem::Get()->RunOne()) {
+        std::this_thread::yield();
+      }
+      lock.lock();
+      continue;
+    }
+
+    Node* node = main_queue_.front();
+    main_queue_.pop_front();
+    lock.unlock();
+    SystemImpl::FromRaw(node->system)->Run(state);
+    lock.lock();
+    Complete(node);
+  }
+  lock.unlock();
+  state->EndDeferred();
+}
+
+void SystemScheduler::Schedule(Node* node) {
+  if (!node->concurrent) {
+    main_queue_.push_back(node);
+    return;
+  }
+
+  JobSystem::Get()->Submit(RunConcurrent, qbVoid(node), nullptr);
+}
+
+void SystemScheduler::RunConcurrent(qbVar arg) {
+  Node* node = (Node*)arg.p;
+  SystemScheduler* self = node->scheduler;
+  SystemImpl::FromRaw(node->system)->Run(self->state_);
+  std::lock_guard<std::mutex> lock(self->mu_);
+  self->Complete(node);
+}
+
+void SystemScheduler::Complete(Node* node) {
+  --remaining_;
+  for (Node* successor : node->successors) {
+    if (--successor->pending == 0) {
+      Schedule(successor);
+    }
+  }
+}
@@ -0,0 +1,91 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef SYSTEM_SCHEDULER__H
+#define SYSTEM_SCHEDULER__H
+
+#include "defs.h"
+#include "game_state.h"
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Orders the loop systems of a program and runs them once per frame.
+//
+// Systems are ordered by their explicit before/after edges, then by priority,
+// then by creation. Any two systems that conflict are run in that order. Two
+// concurrent systems conflict if one writes a component the other reads or
+// writes. Non-concurrent systems conflict with every other system and are run
+// on the calling thread. Concurrent systems are submitted as jobs as soon as
+// all systems they conflict with have finished.
+class SystemScheduler {
+ public:
+  SystemScheduler();
+
+  // Must be called once for every system before it is enabled.
+  void Register(qbSystem system, const qbSystemAttr_& attr);
+
+  void Enable(qbSystem system);
+  void Disable(qbSystem system);
+
+  void Run(GameState* state);
+
+ private:
+  struct Node {
+    SystemScheduler* scheduler;
+    qbSystem system;
+
+    // Sorted components read and written by the system.
+    std::vector<qbComponent> reads;
+    std::vector<qbComponent> writes;
+
+    std::vector<qbSystem> before;
+    std::vector<qbSystem> after;
+    bool concurrent;
+    bool enabled;
+
+    std::vector<Node*> successors;
+    size_t in_degree;
+    size_t pending;
+  };
+
+  static bool Conflicts(const Node& a, const Node& b);
+
+  // Rebuilds the order and the dependency graph.
+  void Build();
+
+  // Both must be called with "mu_" held.
+  void Schedule(Node* node);
+  void Complete(Node* node);
+
+  static void RunConcurrent(qbVar arg);
+
+  std::unordered_map<qbSystem, Node> nodes_;
+  std::vector<Node*> order_;
+  bool dirty_;
+  bool has_concurrent_;
+
+  std::mutex mu_;
+  GameState* state_;
+  std::deque<Node*> main_queue_;
+  size_t remaining_;
+};
+
+#endif  // SYSTEM_SCHEDULER__H
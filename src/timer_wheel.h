@@ -0,0 +1,203 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef TIMER_WHEEL__H
+#define TIMER_WHEEL__H
+
+#include <cstddef>
+#include <cstdint>
+
+// An intrusive doubly-linked list node. A node is in at most one list or
+// wheel at a time. "data" points back to the node's owner.
+struct TimerNode {
+  TimerNode* prev = nullptr;
+  TimerNode* next = nullptr;
+  uint64_t deadline = 0;
+  void* data = nullptr;
+
+  bool IsLinked() const {
+    return prev != nullptr;
+  }
+
+  // Removes the node from whatever list it is in. O(1).
+  void Unlink() {
+    if (prev) {
+      prev->next = next;
+      next->prev = prev;
+      prev = next = nullptr;
+    }
+  }
+};
+
+// An intrusive list of "TimerNode"s. Nodes are not owned.
+class TimerList {
+ public:
+  TimerList() {
+    head_.prev = head_.next = &head_;
+  }
+
+  TimerList(const TimerList&) = delete;
+  TimerList& operator=(const TimerList&) = delete;
+
+  bool Empty() const {
+    return head_.next == &head_;
+  }
+
+  TimerNode* Front() {
+    return Empty() ? nullptr : head_.next;
+  }
+
+  // Returns the node after "node" or null if it is the last one.
+  TimerNode* Next(TimerNode* node) {
+    return node->next == &head_ ? nullptr : node->next;
+  }
+
+  void PushBack(TimerNode* node) {
+    node->Unlink();
+    node->prev = head_.prev;
+    node->next = &head_;
+    head_.prev->next = node;
+    head_.prev = node;
+  }
+
+  // Moves all nodes to the back of "other".
+  void Splice(TimerList* other) {
+    if (Empty()) {
+      return;
+    }
+    TimerNode* first = head_.next;
+    TimerNode* last = head_.prev;
+    first->prev = other->head_.prev;
+    last->next = &other->head_;
+    other->head_.prev->next = first;
+    other->head_.prev = last;
+    head_.prev = head_.next = &head_;
+  }
+
+ private:
+  TimerNode head_;
+};
+
+// A hierarchical timing wheel. Deadlines are in abstract ticks, for example
+// milliseconds or frames. Scheduling and cancelling are O(1) and advancing
+// only visits slots that hold nodes, so idle timers cost nothing until they
+// are due. Level "l" has 64 slots of 64^l ticks each. A node is kept at the
+// highest level where its deadline differs from the current tick and moved
+// down a level each time the wheel reaches its slot.
+// Not thread-safe.
+class TimerWheel {
+ public:
+  explicit TimerWheel(uint64_t now = 0) : now_(now) {
+    for (uint64_t& occupied : occupied_) {
+      occupied = 0;
+    }
+  }
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  uint64_t Now() const {
+    return now_;
+  }
+
+  // Schedules the node to be returned by "Advance" once the wheel reaches
+  // "deadline". Nodes already due are returned by the next "Advance".
+  void Schedule(TimerNode* node, uint64_t deadline) {
+    node->deadline = deadline;
+    if (deadline <= now_) {
+      due_.PushBack(node);
+      return;
+    }
+
+    size_t level = (63 - __builtin_clzll(deadline ^ now_)) / kSlotBits;
+    size_t slot = (deadline >> (level * kSlotBits)) & (kSlots - 1);
+    slots_[level][slot].PushBack(node);
+    occupied_[level] |= 1ULL << slot;
+  }
+
+  // Cancels a scheduled node.
+  static void Cancel(TimerNode* node) {
+    node->Unlink();
+  }
+
+  // Moves the wheel to "now" and calls "fn(node)" for every node whose
+  // deadline is reached, in order of their slots. "fn" may schedule nodes
+  // again.
+  template<class Fn_>
+  void Advance(uint64_t now, Fn_ fn) {
+    TimerList expired;
+    due_.Splice(&expired);
+    Drain(&expired, fn);
+
+    while (now_ < now) {
+      // The lowest occupied level holds the earliest slot. Slots behind the
+      // current tick are empty, they were moved down when they were reached.
+      size_t level = 0;
+      size_t slot = 0;
+      uint64_t start = 0;
+      for (; level < kLevels; ++level) {
+        size_t shift = level * kSlotBits;
+        uint64_t current = (now_ >> shift) & (kSlots - 1);
+        uint64_t ahead = occupied_[level] & (~0ULL << current);
+        if (ahead) {
+          slot = __builtin_ctzll(ahead);
+          uint64_t span = shift + kSlotBits >= 64 ? 0 : ~0ULL << (shift + kSlotBits);
+          start = (now_ & span) | ((uint64_t)slot << shift);
+          break;
+        }
+      }
+      if (level == kLevels || start > now) {
+        now_ = now;
+        break;
+      }
+
+      now_ = start > now_ ? start : now_;
+      occupied_[level] &= ~(1ULL << slot);
+      slots_[level][slot].Splice(&expired);
+      for (TimerNode* node = expired.Front(); node; node = expired.Front()) {
+        if (node->deadline <= now_) {
+          node->Unlink();
+          fn(node);
+        } else {
+          Schedule(node, node->deadline);
+        }
+      }
+    }
+  }
+
+ private:
+  static const size_t kSlotBits = 6;
+  static const size_t kSlots = 1 << kSlotBits;
+  // Enough levels to cover every 64-bit tick.
+  static const size_t kLevels = (64 + kSlotBits - 1) / kSlotBits;
+
+  template<class Fn_>
+  static void Drain(TimerList* list, Fn_ fn) {
+    for (TimerNode* node = list->Front(); node; node = list->Front()) {
+      node->Unlink();
+      fn(node);
+    }
+  }
+
+  uint64_t now_;
+  uint64_t occupied_[kLevels];
+  TimerList slots_[kLevels][kSlots];
+  TimerList due_;
+};
+
+#endif  // TIMER_WHEEL__H
@@ -0,0 +1,146 @@
+/**
+* Author: Samuel Rohde (rohde.samuel@cubez.io)
+*
+* Copyright 2020 Samuel Rohde
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#ifndef WORK_STEALING_DEQUE__H
+#define WORK_STEALING_DEQUE__H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// A Chase-Lev deque. Only the owning thread may call Push and Pop, any thread
+// may call Steal. The owner takes the most recently pushed element, thieves
+// take the oldest.
+//
+// Based on "Correct and Efficient Work-Stealing for Weak Memory Models"
+// (Le et al. 2013).
+template<class Ty_>
+class WorkStealingDeque {
+ public:
+  WorkStealingDeque(int64_t capacity = 256) : top_(0), bottom_(0) {
+    array_.store(new Array(capacity), std::memory_order_relaxed);
+  }
+
+  ~WorkStealingDeque() {
+    delete array_.load(std::memory_order_relaxed);
+    for (Array* array : retired_) {
+      delete array;
+    }
+  }
+
+  void Push(Ty_* value) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    Array* array = array_.load(std::memory_order_relaxed);
+    if (b - t > array->capacity - 1) {
+      array = Grow(array, b, t);
+    }
+    array->Put(b, value);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+  }
+
+  Ty_* Pop() {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* array = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+
+    if (t > b) {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    Ty_* value = array->Get(b);
+    if (t == b) {
+      // Last element, race against thieves.
+      if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        value = nullptr;
+      }
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return value;
+  }
+
+  Ty_* Steal() {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+
+    Array* array = array_.load(std::memory_order_acquire);
+    Ty_* value = array->Get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return value;
+  }
+
+  bool Empty() const {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    return b <= t;
+  }
+
+ private:
+  struct Array {
+    Array(int64_t capacity)
+      : capacity(capacity), mask(capacity - 1),
+        values(new std::atomic<Ty_*>[capacity]) {}
+
+    ~Array() {
+      delete[] values;
+    }
+
+    Ty_* Get(int64_t i) const {
+      return values[i & mask].load(std::memory_order_relaxed);
+    }
+
+    void Put(int64_t i, Ty_* value) {
+      values[i & mask].store(value, std::memory_order_relaxed);
+    }
+
+    const int64_t capacity;
+    const int64_t mask;
+    std::atomic<Ty_*>* values;
+  };
+
+  // Thieves may still be reading the old array, so it is kept until the deque
+  // is destroyed.
+  Array* Grow(Array* array, int64_t b, int64_t t) {
+    Array* grown = new Array(array->capacity * 2);
+    for (int64_t i = t; i < b; ++i) {
+      grown->Put(i, array->Get(i));
+    }
+    retired_.push_back(array);
+    array_.store(grown, std::memory_order_release);
+    return grown;
+  }
+
+  std::atomic<int64_t> top_;
+  std::atomic<int64_t> bottom_;
+  std::atomic<Array*> array_;
+  std::vector<Array*> retired_;
+};
+
+#endif  // WORK_STEALING_DEQUE__H